@@ -49,6 +49,7 @@ endif(CMAKE_COMPILER_IS_GNUCC AND NOT MINGW AND NOT OS2)
 # HEADERS
 check_include_file(sys/types.h HAVE_SYS_TYPES_H)
 check_include_file(resolv.h HAVE_RESOLV_H)
+check_include_file(sys/inotify.h HAVE_SYS_INOTIFY_H)
 
 # FUNCTIONS
 set(CMAKE_REQUIRED_LIBRARIES)
@@ -67,6 +68,8 @@ endif()
 check_function_exists(res_init HAVE_RES_INIT)
 check_function_exists(__res_init HAVE___RES_INIT)
 
+check_function_exists(__res_state HAVE___RES_STATE)
+
 check_function_exists(res_ninit HAVE_RES_NINIT)
 check_function_exists(__res_ninit HAVE___RES_NINIT)
 if (RESOLV_LIRBRARY)
@@ -96,6 +99,8 @@ check_function_exists(__res_nsearch HAVE___RES_NSEARCH)
 
 check_symbol_exists(ns_name_compress "sys/types.h;arpa/nameser.h" HAVE_NS_NAME_COMPRESS)
 
+check_symbol_exists(getentropy "unistd.h" HAVE_GETENTROPY)
+
 if (UNIX)
     if (NOT LINUX)
         # libsocket (Solaris)
@@ -153,6 +158,8 @@ int main(void) {
 }" HAVE_IPV6)
 
 check_struct_has_member("struct __res_state" _u._ext.nsaddrs resolv.h HAVE_RESOLV_IPV6_NSADDRS)
+check_struct_has_member("struct __res_state" res_h_errno resolv.h HAVE_RES_STATE_RES_H_ERRNO)
+check_struct_has_member("struct stat" st_mtim.tv_nsec sys/stat.h HAVE_STRUCT_STAT_ST_MTIM)
 
 check_c_source_compiles("
 void log_fn(const char *format, ...) __attribute__ ((format (printf, 1, 2)));
@@ -161,6 +168,18 @@ int main(void) {
     return 0;
 }" HAVE_ATTRIBUTE_PRINTF_FORMAT)
 
+check_c_source_compiles("
+void test_constructor_attribute(void) __attribute__ ((constructor));
+
+void test_constructor_attribute(void)
+{
+    return;
+}
+
+int main(void) {
+    return 0;
+}" HAVE_CONSTRUCTOR_ATTRIBUTE)
+
 check_c_source_compiles("
 void test_destructor_attribute(void) __attribute__ ((destructor));
 
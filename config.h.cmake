@@ -15,12 +15,15 @@
 /************************** HEADER FILES *************************/
 
 #cmakedefine HAVE_SYS_TYPES_H 1
+#cmakedefine HAVE_SYS_INOTIFY_H 1
 
 /*************************** FUNCTIONS ***************************/
 
 #cmakedefine HAVE_RES_INIT 1
 #cmakedefine HAVE___RES_INIT 1
 
+#cmakedefine HAVE___RES_STATE 1
+
 #cmakedefine HAVE_RES_NINIT 1
 #cmakedefine HAVE_RES_NINIT_IN_LIBRESOLV 1
 #cmakedefine HAVE___RES_NINIT 1
@@ -46,6 +49,8 @@
 
 #cmakedefine HAVE_NS_NAME_COMPRESS 1
 
+#cmakedefine HAVE_GETENTROPY 1
+
 /*************************** LIBRARIES ***************************/
 
 #cmakedefine HAVE_LIBRESOLV 1
@@ -54,8 +59,11 @@
 
 #cmakedefine HAVE_IPV6 1
 #cmakedefine HAVE_RESOLV_IPV6_NSADDRS 1
+#cmakedefine HAVE_RES_STATE_RES_H_ERRNO 1
+#cmakedefine HAVE_STRUCT_STAT_ST_MTIM 1
 
 #cmakedefine HAVE_ATTRIBUTE_PRINTF_FORMAT 1
+#cmakedefine HAVE_CONSTRUCTOR_ATTRIBUTE 1
 #cmakedefine HAVE_DESTRUCTOR_ATTRIBUTE 1
 
 /*************************** ENDIAN *****************************/
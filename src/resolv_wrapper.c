@@ -38,6 +38,10 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -45,8 +49,22 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include <resolv.h>
+#include <netdb.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* GCC has printf type attribute check. */
 #ifdef HAVE_ATTRIBUTE_PRINTF_FORMAT
@@ -55,6 +73,12 @@
 #define PRINTF_ATTRIBUTE(a,b)
 #endif /* HAVE_ATTRIBUTE_PRINTF_FORMAT */
 
+#ifdef HAVE_CONSTRUCTOR_ATTRIBUTE
+#define CONSTRUCTOR_ATTRIBUTE __attribute__ ((constructor))
+#else
+#define CONSTRUCTOR_ATTRIBUTE
+#endif /* HAVE_CONSTRUCTOR_ATTRIBUTE */
+
 #ifdef HAVE_DESTRUCTOR_ATTRIBUTE
 #define DESTRUCTOR_ATTRIBUTE __attribute__ ((destructor))
 #else
@@ -69,6 +93,33 @@
 #define ns_name_compress dn_comp
 #endif
 
+/*
+ * The RESOLV_WRAPPER_* environment variables are read into a snapshot when
+ * the library is loaded and when the configuration is refreshed. A replaced
+ * snapshot is freed once the lookups which might still use it are done.
+ */
+struct rwrap_config {
+	unsigned int serial; /* tells snapshots apart, their memory is reused */
+
+	unsigned int debuglevel;
+	char *hosts;
+	char *resolv_conf;
+	int hosts_check_interval; /* ms, -1 disables reloading */
+	size_t answer_cache_size;
+	unsigned int max_chain_length;
+	unsigned int hosts_load_threads; /* 0 uses all online CPUs */
+	bool hosts_perfect_hash;
+	bool rrset_cyclic;
+	int refresh_signal;
+	char *trace_file;
+};
+
+static struct rwrap_config *rwrap_config;
+
+/* Copies of the snapshot, checked by every log and trace call */
+static unsigned int rwrap_config_debuglevel;
+static bool rwrap_config_tracing;
+
 enum rwrap_dbglvl_e {
 	RWRAP_LOG_ERROR = 0,
 	RWRAP_LOG_WARN,
@@ -81,7 +132,21 @@ enum rwrap_dbglvl_e {
 #else /* NDEBUG */
 
 static void rwrap_log(enum rwrap_dbglvl_e dbglvl, const char *func, const char *format, ...) PRINTF_ATTRIBUTE(3, 4);
-# define RWRAP_LOG(dbglvl, ...) rwrap_log((dbglvl), __func__, __VA_ARGS__)
+
+/* The level is checked first, so the arguments are not even evaluated */
+# define RWRAP_LOG(dbglvl, ...) do { \
+	if (rwrap_log_enabled(dbglvl)) { \
+		rwrap_log((dbglvl), __func__, __VA_ARGS__); \
+	} \
+} while(0)
+
+static inline bool rwrap_log_enabled(enum rwrap_dbglvl_e dbglvl)
+{
+	unsigned int lvl = __atomic_load_n(&rwrap_config_debuglevel,
+					   __ATOMIC_RELAXED);
+
+	return lvl >= (unsigned int)dbglvl;
+}
 
 static void rwrap_log(enum rwrap_dbglvl_e dbglvl,
 		      const char *func,
@@ -89,42 +154,33 @@ static void rwrap_log(enum rwrap_dbglvl_e dbglvl,
 {
 	char buffer[1024];
 	va_list va;
-	const char *d;
-	unsigned int lvl = 0;
 	int pid = getpid();
 
-	d = getenv("RESOLV_WRAPPER_DEBUGLEVEL");
-	if (d != NULL) {
-		lvl = atoi(d);
-	}
-
 	va_start(va, format);
 	vsnprintf(buffer, sizeof(buffer), format, va);
 	va_end(va);
 
-	if (lvl >= dbglvl) {
-		switch (dbglvl) {
-			case RWRAP_LOG_ERROR:
-				fprintf(stderr,
-					"RWRAP_ERROR(%d) - %s: %s\n",
-					pid, func, buffer);
-				break;
-			case RWRAP_LOG_WARN:
-				fprintf(stderr,
-					"RWRAP_WARN(%d) - %s: %s\n",
-					pid, func, buffer);
-				break;
-			case RWRAP_LOG_DEBUG:
-				fprintf(stderr,
-					"RWRAP_DEBUG(%d) - %s: %s\n",
-					pid, func, buffer);
-				break;
-			case RWRAP_LOG_TRACE:
-				fprintf(stderr,
-					"RWRAP_TRACE(%d) - %s: %s\n",
-					pid, func, buffer);
-				break;
-		}
+	switch (dbglvl) {
+		case RWRAP_LOG_ERROR:
+			fprintf(stderr,
+				"RWRAP_ERROR(%d) - %s: %s\n",
+				pid, func, buffer);
+			break;
+		case RWRAP_LOG_WARN:
+			fprintf(stderr,
+				"RWRAP_WARN(%d) - %s: %s\n",
+				pid, func, buffer);
+			break;
+		case RWRAP_LOG_DEBUG:
+			fprintf(stderr,
+				"RWRAP_DEBUG(%d) - %s: %s\n",
+				pid, func, buffer);
+			break;
+		case RWRAP_LOG_TRACE:
+			fprintf(stderr,
+				"RWRAP_TRACE(%d) - %s: %s\n",
+				pid, func, buffer);
+			break;
 	}
 }
 #endif /* NDEBUG RWRAP_LOG */
@@ -133,19 +189,21 @@ static void rwrap_log(enum rwrap_dbglvl_e dbglvl,
 #define SAFE_FREE(x) do { if ((x) != NULL) {free(x); (x)=NULL;} } while(0)
 #endif
 
-#define NEXT_KEY(buf, key) do {					\
-	(key) = (buf) ? strpbrk((buf), " \t") : NULL;		\
-	if ((key) != NULL) {					\
-		(key)[0] = '\0';				\
-		(key)++;					\
-	}							\
-	while ((key) != NULL					\
-	       && (isblank((int)(key)[0]))) {			\
-		(key)++;					\
-	}							\
-} while(0);
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+/* The most records in the chain of a CNAME or SRV answer, by default */
+#ifndef RWRAP_MAX_CHAIN_LENGTH
+#define RWRAP_MAX_CHAIN_LENGTH 5
+#endif
+
+/* The smallest part of a hosts file which gets a parser thread of its own */
+#ifndef RWRAP_FAKE_LOAD_CHUNK_MIN
+#define RWRAP_FAKE_LOAD_CHUNK_MIN (1024 * 1024)
+#endif
 
-#define RWRAP_MAX_RECURSION 5
+#define RWRAP_FAKE_LOAD_MAX_THREADS 64
 
 /* Priority and weight can be omitted from the hosts file, but need to be part
  * of the output
@@ -153,766 +211,7036 @@ static void rwrap_log(enum rwrap_dbglvl_e dbglvl,
 #define DFL_SRV_PRIO	1
 #define DFL_SRV_WEIGHT	100
 
-struct rwrap_srv_rrdata {
-	uint16_t port;
-	uint16_t prio;
-	uint16_t weight;
-	char hostname[MAXDNAME];
-};
+/*********************************************************
+ * RWRAP FAKE HOSTS DATABASE
+ *********************************************************/
 
-struct rwrap_soa_rrdata {
-	uint32_t serial;
-	uint32_t refresh;
-	uint32_t retry;
-	uint32_t expire;
-	uint32_t minimum;
-	char nameserver[MAXDNAME];
-	char mailbox[MAXDNAME];
-};
+/*
+ * The fake hosts database is an image that only uses offsets, so it can be
+ * written to a file by rwrap_compile and mapped back into memory as it is.
+ * A text hosts file is parsed into the same image when it is loaded.
+ *
+ * The image consists of a header, the names, the records, the hash buckets,
+ * the displacements of a perfect hash, a Bloom filter, the index of the
+ * children of a name and a data blob. Names are interned: every name is stored
+ * once, as its first label and the id of the name it is a subdomain of, so
+ * a zone is shared by all names in it. The records refer to their owner and
+ * to the name a CNAME, SRV, MX, NS or PTR record points to by id. They are
+ * grouped by their owner and then by type into RRsets, which keep the file
+ * order. Only the names which exist, the owners and their parents, are
+ * chained in the buckets, by the hash over their lower-cased wire format.
+ * With a perfect hash every hash of such a name gets a bucket of its own,
+ * only names with the same hash share it. If there are wildcard records the
+ * names which exist are also indexed by their label and parent, so that a
+ * query walks down from the root to its closest encloser. The other RDATA
+ * is stored in the data blob already encoded in wire format, so answers are
+ * assembled by copying it.
+ * Pattern records follow the index as they are in the file, they are
+ * compiled when the database is loaded. The reverse index after them maps
+ * the addresses of the PTR records and of all A and AAAA records to names,
+ * sorted by the address in binary. The last index holds the zone cut of
+ * every name, the closest owner of an SOA record at or above it, which
+ * negative answers carry in their authority section.
+ */
 
-struct rwrap_fake_rr {
-	union fake_rrdata {
-		struct in_addr a_rec;
-		struct in6_addr aaaa_rec;
-		struct rwrap_srv_rrdata srv_rec;
-		struct rwrap_soa_rrdata soa_rec;
-		char cname_rec[MAXDNAME];
-	} rrdata;
+#define RWRAP_FAKE_DB_MAGIC "RWRAPDB"
+#define RWRAP_FAKE_DB_VERSION 12
+#define RWRAP_FAKE_DB_BYTE_ORDER 0x01020304
 
-	char key[MAXDNAME];
-	int type; /* ns_t_* */
-};
+#define RWRAP_FAKE_DB_MIN_BUCKETS 64
 
-static void rwrap_fake_rr_init(struct rwrap_fake_rr *rr, size_t len)
-{
-	size_t i;
+/*
+ * How often (in ms) to check if the hosts file has changed. With inotify the
+ * check is a single non-blocking read, so it is done more often than a
+ * stat(). Between the checks a query only reads the clock.
+ */
+#ifndef RWRAP_FAKE_DB_CHECK_INTERVAL
+# ifdef HAVE_SYS_INOTIFY_H
+#  define RWRAP_FAKE_DB_CHECK_INTERVAL 100
+# else
+#  define RWRAP_FAKE_DB_CHECK_INTERVAL 1000
+# endif
+#endif /* RWRAP_FAKE_DB_CHECK_INTERVAL */
 
-	for (i = 0; i < len; i++) {
-		rr[i].type = ns_t_invalid;
-	}
-}
+/*
+ * Every name which exists, the owners and their parents, is added to a Bloom
+ * filter, so that names which are not in the file are rejected without
+ * walking the hash chains. With 16 bits per name and four probes about 0.2%
+ * of the misses get through.
+ */
+#define RWRAP_FAKE_BLOOM_BITS_PER_NAME 16
+#define RWRAP_FAKE_BLOOM_MIN_BITS 512
+#define RWRAP_FAKE_BLOOM_PROBES 4
 
-static int rwrap_create_fake_a_rr(const char *key,
-				  const char *value,
-				  struct rwrap_fake_rr *rr)
-{
-	int ok;
+/*
+ * The perfect hash maps the hash of a name to one of its displacements
+ * first, about three hashes share one. A displacement either is the bucket
+ * of its only hash, flagged by RWRAP_FAKE_MPH_DIRECT, or seeds a second
+ * hash which puts all of its hashes into free buckets.
+ */
+#define RWRAP_FAKE_MPH_HASHES_PER_DISP 3
+#define RWRAP_FAKE_MPH_DIRECT 0x80000000U
+#define RWRAP_FAKE_MPH_MAX_TRIES (1U << 20)
 
-	ok = inet_pton(AF_INET, value, &rr->rrdata.a_rec);
-	if (!ok) {
-		RWRAP_LOG(RWRAP_LOG_ERROR,
-			  "Failed to convert [%s] to binary\n", value);
-		return -1;
-	}
+/*
+ * The zone cut of a name is the id + 1 of the owner of its SOA record, or 0
+ * outside of any zone. RWRAP_FAKE_CUT_EXISTS marks the names which exist,
+ * the owners and their parents. Those without records are hashed as well,
+ * so that a query for them gets NODATA instead of NXDOMAIN (RFC 8020).
+ */
+#define RWRAP_FAKE_CUT_EXISTS 0x80000000U
 
-	memcpy(rr->key, key, strlen(key) + 1);
-	rr->type = ns_t_a;
-	return 0;
-}
+/*
+ * The records of an address RRset are stored next to each other in the data
+ * blob, each as it is in a message: a pointer to the question name, the
+ * type, class, TTL and RDATA length, then the RDATA the record points to.
+ * An answer copies the whole RRset at once and only rewrites the owners if
+ * they are not the question name.
+ */
+#define RWRAP_FAKE_RR_HDR (NS_INT16SZ + NS_RRFIXEDSZ)
+#define RWRAP_FAKE_RR_QNAME (NS_CMPRSFLGS << 8 | NS_HFIXEDSZ)
+
+/* TXT records can be longer than any other RDATA, up to this limit */
+#define RWRAP_FAKE_RDATA_MAX 4096
+
+/* Not known to every arpa/nameser.h */
+#define RWRAP_NS_T_URI 256
+#define RWRAP_NS_T_CAA 257
+
+struct rwrap_fake_db_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t nnames;
+	uint32_t nrecords;
+	uint32_t nbuckets;
+	uint32_t mph_size; /* displacements, 0 without a perfect hash */
+	uint32_t slots_off;
+	uint32_t names_off;
+	uint32_t records_off;
+	uint32_t buckets_off;
+	uint32_t mph_off;
+	uint32_t bloom_off;
+	uint32_t bloom_bits;
+	uint32_t trie_off;
+	uint32_t trie_size; /* 0 without wildcards */
+	uint32_t patterns_off;
+	uint32_t npatterns;
+	uint32_t ptrs_off;
+	uint32_t nptrs;
+	uint32_t cuts_off; /* one per name */
+	uint32_t data_off;
+	uint32_t data_len;
+};
 
-static int rwrap_create_fake_aaaa_rr(const char *key,
-				     const char *value,
-				     struct rwrap_fake_rr *rr)
-{
-	int ok;
+/* Every name ends with the root, it has no records and is not hashed */
+#define RWRAP_FAKE_NAME_ROOT 0
 
-	ok = inet_pton(AF_INET6, value, &rr->rrdata.aaaa_rec);
-	if (!ok) {
-		RWRAP_LOG(RWRAP_LOG_ERROR,
-			  "Failed to convert [%s] to binary\n", value);
-		return -1;
-	}
+/*
+ * The names are split in two arrays with the same index. The slots hold
+ * what a lookup walks through, so that a bucket chain touches 8 bytes per
+ * name until the hash matches.
+ */
+struct rwrap_fake_slot {
+	uint32_t hash; /* over the whole name in wire format */
+	uint32_t next; /* id of the next name in the chain, 0 ends it */
+};
 
-	memcpy(rr->key, key, strlen(key) + 1);
-	rr->type = ns_t_aaaa;
-	return 0;
-}
+struct rwrap_fake_name {
+	uint32_t parent; /* id of the name without the first label */
+	uint32_t label; /* first label, with its length byte */
+	uint32_t records; /* index of the first record */
+	uint16_t nrecords;
+	uint16_t len; /* in wire format */
+};
 
-static int rwrap_create_fake_srv_rr(const char *key,
-				    const char *value,
-				    struct rwrap_fake_rr *rr)
-{
-	char *str_prio;
-	char *str_weight;
-	char *str_port;
-	const char *hostname;
+struct rwrap_fake_record {
+	uint32_t name; /* id of the owner */
+	uint32_t target; /* id of the name the record points to */
+	uint32_t chain; /* index + 1 of the record the target resolves to */
+	uint32_t rdata;
+	uint16_t rdlen;
+	uint16_t type; /* ns_t_* */
+};
 
-	/* parse the value into priority, weight, port and hostname
-	 * and check the validity */
-	hostname = value;
-	NEXT_KEY(hostname, str_port);
-	NEXT_KEY(str_port, str_prio);
-	NEXT_KEY(str_prio, str_weight);
-	if (str_port == NULL || hostname == NULL) {
-		RWRAP_LOG(RWRAP_LOG_ERROR,
-			  "Malformed SRV entry [%s]\n", value);
-		return -1;
-	}
+/* A record for the names a pattern matches, the text is in the data blob */
+struct rwrap_fake_pattern {
+	uint32_t source; /* offset of the lower-cased pattern */
+	uint32_t value; /* offset of the value in the text format */
+	uint16_t source_len;
+	uint16_t value_len;
+	uint16_t type;
+	uint16_t reserved;
+};
 
-	if (str_prio) {
-		rr->rrdata.srv_rec.prio = atoi(str_prio);
-	} else {
-		rr->rrdata.srv_rec.prio = DFL_SRV_PRIO;
-	}
-	if (str_weight) {
-		rr->rrdata.srv_rec.weight = atoi(str_weight);
-	} else {
-		rr->rrdata.srv_rec.weight = DFL_SRV_WEIGHT;
-	}
-	rr->rrdata.srv_rec.port = atoi(str_port);
-	memcpy(rr->rrdata.srv_rec.hostname , hostname, strlen(hostname) + 1);
+/* Points the address of a reverse lookup to a name */
+struct rwrap_fake_ptr {
+	uint8_t addr[16]; /* an IPv4 address in the first 4 bytes */
+	uint32_t target; /* id of the name */
+	uint8_t len; /* of the address */
+	uint8_t reserved[3];
+};
 
-	memcpy(rr->key, key, strlen(key) + 1);
-	rr->type = ns_t_srv;
-	return 0;
-}
+/*
+ * Finished answers, including the empty ones for names which are not in the
+ * file, are cached per snapshot, keyed on the lower-cased query name and the
+ * type. The cache is split into shards with their own read-write lock and
+ * memory budget, entries are evicted with the CLOCK algorithm. Hits only
+ * take the lock shared.
+ */
+#define RWRAP_ANSWER_CACHE_SHARDS 16
+
+#ifndef RWRAP_ANSWER_CACHE_SIZE
+#define RWRAP_ANSWER_CACHE_SIZE (1024 * 1024)
+#endif /* RWRAP_ANSWER_CACHE_SIZE */
+
+struct rwrap_answer_entry {
+	struct rwrap_answer_entry *next;
+	uint32_t hash;
+	uint16_t type;
+	bool referenced;
+	size_t size; /* accounted memory */
+	char *name;
+	size_t len;
+	uint8_t answer[];
+};
 
-static int rwrap_create_fake_soa_rr(const char *key,
-				    const char *value,
-				    struct rwrap_fake_rr *rr)
-{
-	const char *nameserver;
-	char *mailbox;
-	char *str_serial;
-	char *str_refresh;
-	char *str_retry;
-	char *str_expire;
-	char *str_minimum;
+struct rwrap_answer_shard {
+	pthread_rwlock_t lock;
 
-	/* parse the value into nameserver, mailbox, serial, refresh,
-	 * retry, expire, minimum and check the validity
-	 */
-	nameserver = value;
-	NEXT_KEY(nameserver, mailbox);
-	NEXT_KEY(mailbox, str_serial);
-	NEXT_KEY(str_serial, str_refresh);
-	NEXT_KEY(str_refresh, str_retry);
-	NEXT_KEY(str_retry, str_expire);
-	NEXT_KEY(str_expire, str_minimum);
-	if (nameserver == NULL || mailbox == NULL || str_serial == NULL ||
-	    str_refresh == NULL || str_retry == NULL || str_expire == NULL ||
-	    str_minimum == NULL) {
-		RWRAP_LOG(RWRAP_LOG_ERROR,
-			  "Malformed SOA entry [%s]\n", value);
-		return -1;
-	}
+	struct rwrap_answer_entry **buckets;
+	size_t nbuckets;
 
-	memcpy(rr->rrdata.soa_rec.nameserver, nameserver, strlen(nameserver)+1);
-	memcpy(rr->rrdata.soa_rec.mailbox, mailbox, strlen(mailbox)+1);
+	/* The clock, hand points to the next eviction candidate */
+	struct rwrap_answer_entry **ring;
+	size_t nentries;
+	size_t hand;
 
-	rr->rrdata.soa_rec.serial = atoi(str_serial);
-	rr->rrdata.soa_rec.refresh = atoi(str_refresh);
-	rr->rrdata.soa_rec.retry = atoi(str_retry);
-	rr->rrdata.soa_rec.expire = atoi(str_expire);
-	rr->rrdata.soa_rec.minimum = atoi(str_minimum);
+	size_t size;
+	size_t limit;
+};
 
-	memcpy(rr->key, key, strlen(key) + 1);
-	rr->type = ns_t_soa;
-	return 0;
-}
+struct rwrap_answer_cache {
+	struct rwrap_answer_shard shards[RWRAP_ANSWER_CACHE_SHARDS];
+};
 
-static int rwrap_create_fake_cname_rr(const char *key,
-				      const char *value,
-				      struct rwrap_fake_rr *rr)
-{
-	memcpy(rr->rrdata.cname_rec , value, strlen(value) + 1);
-	memcpy(rr->key, key, strlen(key) + 1);
-	rr->type = ns_t_cname;
-	return 0;
-}
+struct rwrap_fake_db {
+	char *path;
+	struct stat st;
+
+	struct rwrap_answer_cache cache;
+
+	/* A compiled database is used directly from the mapping */
+	void *map;
+	size_t map_len;
+
+	/* A text file is parsed into an allocated image */
+	uint8_t *image;
+
+	const struct rwrap_fake_db_header *hdr;
+	const struct rwrap_fake_slot *slots;
+	const struct rwrap_fake_name *names;
+	const struct rwrap_fake_record *records;
+	const uint32_t *buckets;
+	const uint32_t *mph;
+	const uint32_t *bloom;
+	const uint32_t *trie;
+	const struct rwrap_fake_pattern *patterns;
+	const struct rwrap_fake_ptr *ptrs;
+	const uint32_t *cuts;
+	const char *data;
+
+	/* The patterns compiled when the database is loaded, or NULL */
+	struct rwrap_fake_matcher *matcher;
+
+	/* Counts the answers, for RESOLV_WRAPPER_RRSET_ORDER=cyclic */
+	unsigned int rotation;
+};
 
-/* Prepares a fake header with a single response. Advances header_blob */
-static ssize_t rwrap_fake_header(uint8_t **header_blob, size_t remaining,
-			         size_t ancount, size_t arcount)
-{
-	uint8_t *hb;
-	HEADER *h;
+struct rwrap_fake_rdata {
+	uint8_t data[RWRAP_FAKE_RDATA_MAX];
+	size_t len;
+};
 
-	if (remaining < NS_HFIXEDSZ) {
-		RWRAP_LOG(RWRAP_LOG_ERROR, "Buffer too small!\n");
-		return -1;
-	}
+struct rwrap_msg;
 
-	hb = *header_blob;
-	memset(hb, 0, NS_HFIXEDSZ);
+/*
+ * A record type the fake hosts file knows. The parser converts the value of
+ * a line to the RDATA in wire format when the file is loaded. A name at the
+ * end of the RDATA, from the offset target on, is interned instead of
+ * stored. With glue the address records of the target follow the record in
+ * answers. The encoder writes the stored RDATA and the target to an answer.
+ */
+struct rwrap_rr_type {
+	const char *name;
+	int target; /* offset of the name the record points to, or -1 */
+	bool glue;
+	bool packed; /* the RDATA has a fixed size and no names */
+
+	int (*parse)(const char *value,
+		     size_t value_len,
+		     struct rwrap_fake_rdata *rd);
+	/* Checks the stored RDATA of a database, if the encoder parses it */
+	bool (*valid)(const uint8_t *rdata, size_t rdlen);
+	int (*encode)(struct rwrap_msg *msg,
+		      const uint8_t *rdata,
+		      size_t rdlen,
+		      const uint8_t *target);
+};
 
-	h = (HEADER *) hb;
-	h->id = res_randomid();		/* random query ID */
-	h->qr = 1;			/* response flag */
-	h->rd = 1;			/* recursion desired */
-	h->ra = 1;			/* resursion available */
+struct rwrap_fake_builder {
+	struct rwrap_fake_slot *slots;
+	struct rwrap_fake_name *names;
+	size_t nnames;
+	size_t names_alloc;
 
-	h->qdcount = htons(1);		/* no. of questions */
-	h->ancount = htons(ancount);	/* no. of answers */
-	h->arcount = htons(arcount);	/* no. of add'tl records */
+	/* Finds names by their parent and label, id + 1 or 0 if empty */
+	uint32_t *intern;
+	size_t intern_size;
 
-	hb += NS_HFIXEDSZ;		/* move past the header */
-	*header_blob = hb;
+	struct rwrap_fake_record *records;
+	size_t nrecords;
+	size_t records_alloc;
 
-	return NS_HFIXEDSZ;
-}
+	struct rwrap_fake_pattern *patterns;
+	size_t npatterns;
+	size_t patterns_alloc;
 
-static ssize_t rwrap_fake_question(const char *question,
-				   uint16_t type,
-				   uint8_t **question_ptr,
-				   size_t remaining)
-{
-	uint8_t *qb = *question_ptr;
-	int n;
+	/* The PTR records under in-addr.arpa and ip6.arpa, in file order */
+	struct rwrap_fake_ptr *ptrs;
+	size_t nptrs;
+	size_t ptrs_alloc;
 
-	n = ns_name_compress(question, qb, remaining, NULL, NULL);
-	if (n < 0) {
-		RWRAP_LOG(RWRAP_LOG_ERROR,
-			  "Failed to compress [%s]\n", question);
-		return -1;
-	}
+	char *data;
+	size_t data_len;
+	size_t data_alloc;
+};
 
-	qb += n;
-	remaining -= n;
+/*
+ * The current database is an immutable snapshot which is replaced with an
+ * RCU-like pointer swap when the hosts file changes. Readers only announce
+ * themselves in one of two counters, selected by the lowest bit of the
+ * epoch, and never block. The thread which reloads the file publishes the
+ * new snapshot, flips the epoch twice and waits for both counters to drain
+ * before the old snapshot is freed.
+ */
+static struct {
+	struct rwrap_fake_db *db;
+	unsigned int epoch;
+	unsigned int readers[2];
+
+	/* Serializes reloading, never taken by lookups */
+	pthread_mutex_t lock;
+
+	/* Read by lookups with atomics, the others only with the lock */
+	int check_interval; /* ms, -1 disables reloading */
+	unsigned int last_check; /* ms of the monotonic clock, wraps */
+	int watch_fd;
+	pid_t watch_pid; /* a child has to watch the file again */
+
+	size_t cache_size;
+} rwrap_fake = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.check_interval = RWRAP_FAKE_DB_CHECK_INTERVAL,
+	.cache_size = RWRAP_ANSWER_CACHE_SIZE,
+	.watch_fd = -1,
+};
 
-	if (remaining < 2 * sizeof(uint16_t)) {
-		RWRAP_LOG(RWRAP_LOG_ERROR, "Buffer too small!\n");
-		return -1;
-	}
+/*********************************************************
+ * RWRAP CONFIG
+ *********************************************************/
 
-	NS_PUT16(type, qb);
-	NS_PUT16(ns_c_in, qb);
+/* Used if there is no memory for a snapshot */
+static struct rwrap_config rwrap_config_default = {
+	.hosts_check_interval = RWRAP_FAKE_DB_CHECK_INTERVAL,
+	.answer_cache_size = RWRAP_ANSWER_CACHE_SIZE,
+	.max_chain_length = RWRAP_MAX_CHAIN_LENGTH,
+};
 
-	*question_ptr = qb;
-	return n + 2 * sizeof(uint16_t);
-}
+/* Serializes refreshing, never taken by lookups */
+static pthread_mutex_t rwrap_config_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static ssize_t rwrap_fake_rdata_common(uint16_t type,
-				       size_t rdata_size,
-				       const char *key,
-				       size_t remaining,
-				       uint8_t **rdata_ptr)
-{
-	uint8_t *rd = *rdata_ptr;
-	ssize_t written = 0;
+/* Set by the refresh signal, the next lookup refreshes the snapshot */
+static int rwrap_config_stale;
 
-	written = ns_name_compress(key, rd, remaining, NULL, NULL);
-	if (written < 0) {
-		RWRAP_LOG(RWRAP_LOG_ERROR,
-			  "Failed to compress [%s]\n", key);
-		return -1;
-	}
-	rd += written;
-	remaining -= written;
+/*
+ * Readers of the snapshot announce themselves in one of two counters like
+ * those of the fake hosts database, so that a refresh knows when the old
+ * snapshot can be freed. A reader must not refresh the configuration.
+ */
+static unsigned int rwrap_config_epoch;
+static unsigned int rwrap_config_readers[2];
+static unsigned int rwrap_config_serial;
 
-	if (remaining < 3 * sizeof(uint16_t) + sizeof(uint32_t)) {
-		RWRAP_LOG(RWRAP_LOG_ERROR, "Buffer too small\n");
-		return -1;
-	}
+static int rwrap_config_signal;
+static struct sigaction rwrap_config_old_sigaction;
+
+static bool rwrap_config_num(const char *name,
+			     long min,
+			     long max,
+			     long *val)
+{
+	const char *d = getenv(name);
+	char *end = NULL;
+	long n;
 
-	NS_PUT16(type, rd);
-	NS_PUT16(ns_c_in, rd);
-	NS_PUT32(RWRAP_DEFAULT_FAKE_TTL, rd);
-	NS_PUT16(rdata_size, rd);
+	if (d == NULL) {
+		return false;
+	}
 
-	if (remaining < rdata_size) {
-		RWRAP_LOG(RWRAP_LOG_ERROR, "Buffer too small\n");
-		return -1;
+	errno = 0;
+	n = strtol(d, &end, 10);
+	if (errno != 0 || end == d || *end != '\0' || n < min || n > max) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Ignoring invalid value %s=%s\n", name, d);
+		return false;
 	}
 
-	*rdata_ptr = rd;
-	return written + 3 * sizeof(uint16_t) + sizeof(uint32_t) + rdata_size;
+	*val = n;
+	return true;
 }
 
-static ssize_t rwrap_fake_a(struct rwrap_fake_rr *rr,
-			    uint8_t *answer_ptr,
-			    size_t anslen)
+static int rwrap_config_str(const char *name, char **val)
 {
-	uint8_t *a = answer_ptr;
-	ssize_t resp_size;
+	const char *d = getenv(name);
 
-	if (rr == NULL || rr->type != ns_t_a) {
-		RWRAP_LOG(RWRAP_LOG_ERROR,
-			  "Malformed record, no or wrong value!\n");
-		return -1;
+	if (d == NULL) {
+		*val = NULL;
+		return 0;
 	}
-	RWRAP_LOG(RWRAP_LOG_TRACE, "Adding A RR");
 
-	resp_size = rwrap_fake_rdata_common(ns_t_a, sizeof(struct in_addr), rr->key,
-					    anslen, &a);
-	if (resp_size < 0) {
+	*val = strdup(d);
+	if (*val == NULL) {
 		return -1;
 	}
 
-	memcpy(a, &rr->rrdata.a_rec, sizeof(struct in_addr));
+	return 0;
+}
 
-	return resp_size;
+static void rwrap_config_free(struct rwrap_config *c)
+{
+	free(c->hosts);
+	free(c->resolv_conf);
+	free(c->trace_file);
+	free(c);
 }
 
-static ssize_t rwrap_fake_aaaa(struct rwrap_fake_rr *rr,
-			       uint8_t *answer,
-			       size_t anslen)
+static struct rwrap_config *rwrap_config_load(void)
 {
-	uint8_t *a = answer;
-	ssize_t resp_size;
+	struct rwrap_config *c;
+	const char *d;
+	long n;
+	int rc;
 
-	if (rr == NULL || rr->type != ns_t_aaaa) {
-		RWRAP_LOG(RWRAP_LOG_ERROR,
-			  "Malformed record, no or wrong value!\n");
-		return -1;
+	c = calloc(1, sizeof(struct rwrap_config));
+	if (c == NULL) {
+		return NULL;
 	}
-	RWRAP_LOG(RWRAP_LOG_TRACE, "Adding AAAA RR");
 
-	resp_size = rwrap_fake_rdata_common(ns_t_aaaa, sizeof(struct in6_addr),
-					    rr->key, anslen, &a);
-	if (resp_size < 0) {
-		return -1;
+	if (rwrap_config_num("RESOLV_WRAPPER_DEBUGLEVEL", 0, INT_MAX, &n)) {
+		c->debuglevel = n;
 	}
 
-	memcpy(a, &rr->rrdata.aaaa_rec, sizeof(struct in6_addr));
-
-	return resp_size;
-}
+	rc = rwrap_config_str("RESOLV_WRAPPER_HOSTS", &c->hosts);
+	if (rc != 0) {
+		rwrap_config_free(c);
+		return NULL;
+	}
 
-static ssize_t rwrap_fake_srv(struct rwrap_fake_rr *rr,
-			      uint8_t *answer,
-			      size_t anslen)
-{
-	uint8_t *a = answer;
-	ssize_t resp_size;
-	size_t rdata_size;
-	unsigned char hostname_compressed[MAXDNAME];
-	ssize_t compressed_len;
+	rc = rwrap_config_str("RESOLV_WRAPPER_CONF", &c->resolv_conf);
+	if (rc != 0) {
+		rwrap_config_free(c);
+		return NULL;
+	}
 
-	if (rr == NULL || rr->type != ns_t_srv) {
-		RWRAP_LOG(RWRAP_LOG_ERROR,
-			  "Malformed record, no or wrong value!\n");
-		return -1;
+	rc = rwrap_config_str("RESOLV_WRAPPER_TRACE_FILE", &c->trace_file);
+	if (rc != 0) {
+		rwrap_config_free(c);
+		return NULL;
 	}
-	RWRAP_LOG(RWRAP_LOG_TRACE, "Adding SRV RR");
-	rdata_size = 3 * sizeof(uint16_t);
 
-	/* Prepare the data to write */
-	compressed_len = ns_name_compress(rr->rrdata.srv_rec.hostname,
-					  hostname_compressed, MAXDNAME,
-					  NULL, NULL);
-	if (compressed_len < 0) {
-		return -1;
+	c->hosts_check_interval = RWRAP_FAKE_DB_CHECK_INTERVAL;
+	if (rwrap_config_num("RESOLV_WRAPPER_HOSTS_CHECK_INTERVAL",
+			     -1, INT_MAX, &n)) {
+		c->hosts_check_interval = n;
 	}
-	rdata_size += compressed_len;
 
-	resp_size = rwrap_fake_rdata_common(ns_t_srv, rdata_size,
-					    rr->key, anslen, &a);
-	if (resp_size < 0) {
-		return -1;
+	c->answer_cache_size = RWRAP_ANSWER_CACHE_SIZE;
+	if (rwrap_config_num("RESOLV_WRAPPER_ANSWER_CACHE_SIZE",
+			     0, LONG_MAX, &n)) {
+		c->answer_cache_size = n;
 	}
 
-	NS_PUT16(rr->rrdata.srv_rec.prio, a);
-	NS_PUT16(rr->rrdata.srv_rec.weight, a);
-	NS_PUT16(rr->rrdata.srv_rec.port, a);
-	memcpy(a, hostname_compressed, compressed_len);
+	c->max_chain_length = RWRAP_MAX_CHAIN_LENGTH;
+	if (rwrap_config_num("RESOLV_WRAPPER_MAX_CHAIN_LENGTH",
+			     1, UINT16_MAX, &n)) {
+		c->max_chain_length = n;
+	}
 
-	return resp_size;
-}
+	if (rwrap_config_num("RESOLV_WRAPPER_HOSTS_LOAD_THREADS",
+			     0, RWRAP_FAKE_LOAD_MAX_THREADS, &n)) {
+		c->hosts_load_threads = n;
+	}
 
-static ssize_t rwrap_fake_soa(struct rwrap_fake_rr *rr,
-			      uint8_t *answer,
-			      size_t anslen)
-{
-	uint8_t *a = answer;
-	ssize_t resp_size;
-	size_t rdata_size;
-	unsigned char nameser_compressed[MAXDNAME];
-	ssize_t compressed_ns_len;
-	unsigned char mailbox_compressed[MAXDNAME];
-	ssize_t compressed_mb_len;
+	if (rwrap_config_num("RESOLV_WRAPPER_HOSTS_PERFECT_HASH", 0, 1, &n)) {
+		c->hosts_perfect_hash = n;
+	}
 
-	if (rr == NULL || rr->type != ns_t_soa) {
+	d = getenv("RESOLV_WRAPPER_RRSET_ORDER");
+	if (d != NULL && strcmp(d, "cyclic") == 0) {
+		c->rrset_cyclic = true;
+	} else if (d != NULL && strcmp(d, "fixed") != 0) {
 		RWRAP_LOG(RWRAP_LOG_ERROR,
-			  "Malformed record, no or wrong value!\n");
-		return -1;
+			  "Ignoring invalid value RESOLV_WRAPPER_RRSET_ORDER=%s\n",
+			  d);
 	}
-	RWRAP_LOG(RWRAP_LOG_TRACE, "Adding SOA RR");
-	rdata_size = 5 * sizeof(uint16_t);
 
-	compressed_ns_len = ns_name_compress(rr->rrdata.soa_rec.nameserver,
-					     nameser_compressed,
-					     MAXDNAME, NULL, NULL);
-	if (compressed_ns_len < 0) {
-		return -1;
+	if (rwrap_config_num("RESOLV_WRAPPER_CONFIG_SIGNAL", 1, INT_MAX, &n)) {
+		c->refresh_signal = n;
 	}
-	rdata_size += compressed_ns_len;
 
-	compressed_mb_len = ns_name_compress(rr->rrdata.soa_rec.mailbox,
-					     mailbox_compressed,
-					     MAXDNAME, NULL, NULL);
-	if (compressed_mb_len < 0) {
-		return -1;
-	}
-	rdata_size += compressed_mb_len;
+	return c;
+}
 
-	resp_size = rwrap_fake_rdata_common(ns_t_soa, rdata_size,
-					    rr->key, anslen, &a);
-	if (resp_size < 0) {
-		return -1;
-	}
+/* Chains to the handler the application had installed for the signal */
+static void rwrap_config_signal_handler(int signum, siginfo_t *info, void *uc)
+{
+	const struct sigaction *old = &rwrap_config_old_sigaction;
 
-	memcpy(a, nameser_compressed, compressed_ns_len);
-	a += compressed_ns_len;
-	memcpy(a, mailbox_compressed, compressed_mb_len);
-	a += compressed_mb_len;
-	NS_PUT32(rr->rrdata.soa_rec.serial, a);
-	NS_PUT32(rr->rrdata.soa_rec.refresh, a);
-	NS_PUT32(rr->rrdata.soa_rec.retry, a);
-	NS_PUT32(rr->rrdata.soa_rec.expire, a);
-	NS_PUT32(rr->rrdata.soa_rec.minimum, a);
+	__atomic_store_n(&rwrap_config_stale, 1, __ATOMIC_RELAXED);
 
-	return resp_size;
+	if ((old->sa_flags & SA_SIGINFO) != 0) {
+		if (old->sa_sigaction != NULL) {
+			old->sa_sigaction(signum, info, uc);
+		}
+	} else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN) {
+		old->sa_handler(signum);
+	}
 }
 
-static ssize_t rwrap_fake_cname(struct rwrap_fake_rr *rr,
-				uint8_t *answer,
-				size_t anslen)
+/* Installs the handler for the refresh signal, restoring the old one */
+static void rwrap_config_install_signal(int signum)
 {
-	uint8_t *a = answer;
-	ssize_t resp_size;
-	unsigned char hostname_compressed[MAXDNAME];
-	ssize_t rdata_size;
+	struct sigaction sa;
+	int rc;
 
-	if (rr == NULL || rr->type != ns_t_cname) {
-		RWRAP_LOG(RWRAP_LOG_ERROR,
-			  "Malformed record, no or wrong value!\n");
-		return -1;
+	if (signum == rwrap_config_signal) {
+		return;
 	}
-	RWRAP_LOG(RWRAP_LOG_TRACE, "Adding CNAME RR");
 
-	/* Prepare the data to write */
-	rdata_size = ns_name_compress(rr->rrdata.cname_rec,
-				      hostname_compressed, MAXDNAME,
-				      NULL, NULL);
-	if (rdata_size < 0) {
-		return -1;
+	if (rwrap_config_signal != 0) {
+		sigaction(rwrap_config_signal, &rwrap_config_old_sigaction, NULL);
+		rwrap_config_signal = 0;
 	}
 
-	resp_size = rwrap_fake_rdata_common(ns_t_cname, rdata_size,
-					    rr->key, anslen, &a);
-	if (resp_size < 0) {
-		return -1;
+	if (signum == 0) {
+		return;
 	}
 
-	memcpy(a, hostname_compressed, rdata_size);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = rwrap_config_signal_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART | SA_SIGINFO;
 
-	return resp_size;
+	rc = sigaction(signum, &sa, &rwrap_config_old_sigaction);
+	if (rc != 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Failed to install a handler for signal %d: %s\n",
+			  signum, strerror(errno));
+		return;
+	}
+	rwrap_config_signal = signum;
 }
 
-#define RESOLV_MATCH(line, name) \
-	(strncmp(line, name, sizeof(name) - 1) == 0 && \
-	(line[sizeof(name) - 1] == ' ' || \
-	 line[sizeof(name) - 1] == '\t'))
+/* Waits until all readers which might still use the old snapshot are done */
+static void rwrap_config_synchronize(void)
+{
+	unsigned int epoch;
+	int i;
 
-#define TYPE_MATCH(type, ns_type, rec_type, str_type, key, query) \
-	((type) == (ns_type) && \
-	 (strncmp((rec_type), (str_type), sizeof(str_type)) == 0) && \
-	 (strcasecmp(key, query)) == 0)
+	for (i = 0; i < 2; i++) {
+		epoch = __atomic_fetch_add(&rwrap_config_epoch, 1,
+					   __ATOMIC_SEQ_CST);
 
+		while (__atomic_load_n(&rwrap_config_readers[epoch & 1],
+				       __ATOMIC_SEQ_CST) != 0) {
+			sched_yield();
+		}
+	}
+}
 
-static int rwrap_get_record(const char *hostfile, unsigned recursion,
-			    const char *query, int type,
-			    struct rwrap_fake_rr *rr);
+void resolv_wrapper_refresh_config(void);
 
-static int rwrap_srv_recurse(const char *hostfile, unsigned recursion,
-			     const char *query, struct rwrap_fake_rr *rr)
+/*
+ * Reads the RESOLV_WRAPPER_* environment variables again. This is done when
+ * the library is loaded, a process which changes them later has to call
+ * this or send itself the signal from RESOLV_WRAPPER_CONFIG_SIGNAL.
+ */
+void resolv_wrapper_refresh_config(void)
 {
-	int rc;
+	struct rwrap_config *c;
+	struct rwrap_config *old;
 
-	rc = rwrap_get_record(hostfile, recursion, query, ns_t_a, rr);
-	if (rc == 0) return 0;
+	pthread_mutex_lock(&rwrap_config_lock);
 
-	rc = rwrap_get_record(hostfile, recursion, query, ns_t_aaaa, rr);
-	if (rc == ENOENT) rc = 0;
+	c = rwrap_config_load();
+	if (c == NULL) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Failed to read the resolv_wrapper configuration\n");
+		pthread_mutex_unlock(&rwrap_config_lock);
+		return;
+	}
+	c->serial = ++rwrap_config_serial;
 
-	return rc;
-}
+	__atomic_store_n(&rwrap_config_debuglevel, c->debuglevel,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&rwrap_config_tracing, c->trace_file != NULL,
+			 __ATOMIC_RELAXED);
+	old = __atomic_exchange_n(&rwrap_config, c, __ATOMIC_SEQ_CST);
 
-static int rwrap_cname_recurse(const char *hostfile, unsigned recursion,
-			       const char *query, struct rwrap_fake_rr *rr)
-{
-	int rc;
+	rwrap_config_install_signal(c->refresh_signal);
 
-	rc = rwrap_get_record(hostfile, recursion, query, ns_t_a, rr);
-	if (rc == 0) return 0;
+	if (old != NULL) {
+		rwrap_config_synchronize();
+		rwrap_config_free(old);
+	}
 
-	rc = rwrap_get_record(hostfile, recursion, query, ns_t_aaaa, rr);
-	if (rc == 0) return 0;
+	pthread_mutex_unlock(&rwrap_config_lock);
+}
 
-	rc = rwrap_get_record(hostfile, recursion, query, ns_t_cname, rr);
-	if (rc == ENOENT) rc = 0;
+/*
+ * Returns the current snapshot, which is not freed before
+ * rwrap_config_put(). Unlike rwrap_config_hold() it is never refreshed, it
+ * may be NULL.
+ */
+static struct rwrap_config *rwrap_config_enter(unsigned int *idx)
+{
+	*idx = __atomic_load_n(&rwrap_config_epoch, __ATOMIC_SEQ_CST) & 1;
+	__atomic_fetch_add(&rwrap_config_readers[*idx], 1, __ATOMIC_SEQ_CST);
 
-	return rc;
+	return __atomic_load_n(&rwrap_config, __ATOMIC_SEQ_CST);
 }
 
-static int rwrap_get_record(const char *hostfile, unsigned recursion,
-			    const char *query, int type,
-			    struct rwrap_fake_rr *rr)
+/*
+ * Returns the snapshot for a lookup, which is not freed before
+ * rwrap_config_put(). The environment is read again first if the refresh
+ * signal came.
+ */
+static struct rwrap_config *rwrap_config_hold(unsigned int *idx)
 {
-	FILE *fp = NULL;
-	char buf[BUFSIZ];
-	char *key = NULL;
-	char *value = NULL;
-	int rc = ENOENT;
+	struct rwrap_config *c;
 
-	if (recursion >= RWRAP_MAX_RECURSION) {
-		RWRAP_LOG(RWRAP_LOG_ERROR, "Recursed too deep!\n");
-		return -1;
+	if (__atomic_load_n(&rwrap_config_stale, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&rwrap_config_stale, 0, __ATOMIC_ACQ_REL)) {
+		resolv_wrapper_refresh_config();
 	}
 
-	RWRAP_LOG(RWRAP_LOG_TRACE,
-		  "Searching in fake hosts file %s\n", hostfile);
+	if (__atomic_load_n(&rwrap_config, __ATOMIC_ACQUIRE) == NULL) {
+		/* Without constructor support the first lookup loads it */
+		resolv_wrapper_refresh_config();
+	}
 
-	fp = fopen(hostfile, "r");
-	if (fp == NULL) {
-		RWRAP_LOG(RWRAP_LOG_ERROR,
-			  "Opening %s failed: %s",
-			  hostfile, strerror(errno));
-		return -1;
+	c = rwrap_config_enter(idx);
+	if (c == NULL) {
+		c = &rwrap_config_default;
 	}
 
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		char *rec_type;
-		char *q;
+	return c;
+}
 
-		rec_type = buf;
-		key = value = NULL;
+static void rwrap_config_put(unsigned int idx)
+{
+	__atomic_fetch_sub(&rwrap_config_readers[idx], 1, __ATOMIC_SEQ_CST);
+}
 
-		NEXT_KEY(rec_type, key);
-		NEXT_KEY(key, value);
+/* Returns the snapshot to a caller which holds it already */
+static struct rwrap_config *rwrap_config_get(void)
+{
+	struct rwrap_config *c;
 
-		if (key == NULL || value == NULL) {
-			RWRAP_LOG(RWRAP_LOG_WARN,
-				"Malformed line: not enough parts, use \"rec_type key data\n"
-				"For example \"A cwrap.org 10.10.10.10\"");
-			continue;
+	c = __atomic_load_n(&rwrap_config, __ATOMIC_ACQUIRE);
+	if (c == NULL) {
+		c = &rwrap_config_default;
+	}
+
+	return c;
+}
+
+/*********************************************************
+ * RWRAP TRACE RING
+ *********************************************************/
+
+/*
+ * If RESOLV_WRAPPER_TRACE_FILE is set, events are recorded in binary form
+ * into a ring of the calling thread. Recording takes no lock, the ring is
+ * only appended to the trace file when the thread exits or the library is
+ * unloaded. rwrap_trace decodes the file.
+ */
+#define RWRAP_TRACE_MAGIC "RWRAPTR"
+#define RWRAP_TRACE_VERSION 1
+
+#ifndef RWRAP_TRACE_RING_SIZE
+#define RWRAP_TRACE_RING_SIZE 4096 /* entries, a power of two */
+#endif /* RWRAP_TRACE_RING_SIZE */
+
+#define RWRAP_TRACE_NARGS 3
+
+enum rwrap_trace_event {
+	RWRAP_TRACE_QUERY = 1,
+	RWRAP_TRACE_ANSWER,
+	RWRAP_TRACE_FAKE_CACHED,
+	RWRAP_TRACE_FAKE_FOUND,
+	RWRAP_TRACE_FAKE_NOTFOUND,
+	RWRAP_TRACE_FAKE_LOAD,
+};
+
+static const struct {
+	const char *name;
+	const char *args[RWRAP_TRACE_NARGS];
+} rwrap_trace_events[] = {
+	[RWRAP_TRACE_QUERY] = {
+		"query", { "type", "class", "search" } },
+	[RWRAP_TRACE_ANSWER] = {
+		"answer", { "type", "len", NULL } },
+	[RWRAP_TRACE_FAKE_CACHED] = {
+		"fake_cached", { "type", "len", NULL } },
+	[RWRAP_TRACE_FAKE_FOUND] = {
+		"fake_found", { "type", "len", NULL } },
+	[RWRAP_TRACE_FAKE_NOTFOUND] = {
+		"fake_notfound", { "type", NULL, NULL } },
+	[RWRAP_TRACE_FAKE_LOAD] = {
+		"fake_load", { "records", "compiled", NULL } },
+};
+
+#define RWRAP_TRACE_NEVENTS \
+	(sizeof(rwrap_trace_events) / sizeof(rwrap_trace_events[0]))
+
+struct rwrap_trace_entry {
+	uint64_t ts; /* CLOCK_MONOTONIC in ns */
+	uint32_t event;
+	uint32_t reserved;
+	uint64_t args[RWRAP_TRACE_NARGS];
+};
+
+/* Every flush of a ring is written as a segment */
+struct rwrap_trace_segment {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t pid;
+	uint64_t thread;
+	uint64_t nentries;
+	uint64_t dropped; /* overwritten before they were written */
+};
+
+struct rwrap_trace_ring {
+	struct rwrap_trace_ring *next;
+	uint64_t thread;
+
+	uint64_t head; /* number of recorded entries, stored with release */
+	uint64_t flushed; /* number of entries written to the file */
+
+	struct rwrap_trace_entry entries[RWRAP_TRACE_RING_SIZE];
+};
+
+static struct {
+	pthread_key_t key;
+	pthread_once_t once;
+	bool key_ok;
+
+	/* Protects the list of rings, only taken to add and remove one */
+	pthread_mutex_t lock;
+	struct rwrap_trace_ring *rings;
+	uint64_t nthreads;
+	bool closed; /* the rings were written when the library was unloaded */
+} rwrap_trace = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define RWRAP_TRACE(event, a0, a1, a2) do { \
+	if (rwrap_trace_enabled()) { \
+		rwrap_trace_record((event), (a0), (a1), (a2)); \
+	} \
+} while(0)
+
+static inline bool rwrap_trace_enabled(void)
+{
+	return __atomic_load_n(&rwrap_config_tracing, __ATOMIC_RELAXED);
+}
+
+/*
+ * Appends the entries which were not written yet. Only the thread which owns
+ * the ring records into it and moves the flushed entries on. Another thread
+ * copies the ring and leaves out what the owner overwrote meanwhile.
+ */
+static void rwrap_trace_flush(struct rwrap_trace_ring *ring, bool own)
+{
+	struct rwrap_trace_segment seg;
+	struct rwrap_trace_entry *copy = NULL;
+	const struct rwrap_trace_entry *entries = ring->entries;
+	struct rwrap_config *c;
+	struct iovec iov[3];
+	uint64_t start = ring->flushed;
+	uint64_t end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t head;
+	unsigned int idx;
+	size_t first;
+	size_t n;
+	int fd;
+
+	c = rwrap_config_enter(&idx);
+	if (c == NULL || c->trace_file == NULL || start == end) {
+		rwrap_config_put(idx);
+		return;
+	}
+
+	memset(&seg, 0, sizeof(seg));
+	memcpy(seg.magic, RWRAP_TRACE_MAGIC, sizeof(RWRAP_TRACE_MAGIC));
+	seg.version = RWRAP_TRACE_VERSION;
+	seg.entry_size = sizeof(struct rwrap_trace_entry);
+	seg.pid = getpid();
+	seg.thread = ring->thread;
+
+	if (end - start > RWRAP_TRACE_RING_SIZE) {
+		seg.dropped = end - start - RWRAP_TRACE_RING_SIZE;
+		start = end - RWRAP_TRACE_RING_SIZE;
+	}
+
+	if (!own) {
+		copy = malloc(sizeof(ring->entries));
+		if (copy == NULL) {
+			rwrap_config_put(idx);
+			return;
 		}
+		memcpy(copy, ring->entries, sizeof(ring->entries));
+		entries = copy;
 
-		q = value;
-		while(q[0] != '\n' && q[0] != '\0') {
-			q++;
+		/* The entry after head may be half written over an old one */
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head + 1 - start > RWRAP_TRACE_RING_SIZE) {
+			uint64_t torn = head + 1 - RWRAP_TRACE_RING_SIZE - start;
+
+			torn = MIN(torn, end - start);
+			seg.dropped += torn;
+			start += torn;
 		}
-		q[0] = '\0';
+	}
+	seg.nentries = end - start;
+
+	/* The entries wrap around the end of the ring at most once */
+	first = start & (RWRAP_TRACE_RING_SIZE - 1);
+	n = MIN(seg.nentries, RWRAP_TRACE_RING_SIZE - first);
+
+	iov[0].iov_base = &seg;
+	iov[0].iov_len = sizeof(seg);
+	iov[1].iov_base = (void *)&entries[first];
+	iov[1].iov_len = n * sizeof(struct rwrap_trace_entry);
+	iov[2].iov_base = (void *)&entries[0];
+	iov[2].iov_len = (seg.nentries - n) * sizeof(struct rwrap_trace_entry);
+
+	fd = open(c->trace_file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd == -1) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Opening %s failed: %s\n",
+			  c->trace_file, strerror(errno));
+		rwrap_config_put(idx);
+		free(copy);
+		return;
+	}
+
+	/* A single write, so segments of several processes do not mix */
+	if (writev(fd, iov, 3) == -1) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Writing to %s failed: %s\n",
+			  c->trace_file, strerror(errno));
+	}
+	close(fd);
+	rwrap_config_put(idx);
+	free(copy);
 
-		if (TYPE_MATCH(type, ns_t_a, rec_type, "A", key, query)) {
-			rc = rwrap_create_fake_a_rr(key, value, rr);
+	if (own) {
+		ring->flushed = end;
+	}
+}
+
+static void rwrap_trace_ring_free(void *ptr)
+{
+	struct rwrap_trace_ring *ring = (struct rwrap_trace_ring *)ptr;
+	struct rwrap_trace_ring **pp;
+
+	pthread_mutex_lock(&rwrap_trace.lock);
+	if (!rwrap_trace.closed) {
+		rwrap_trace_flush(ring, true);
+	}
+	for (pp = &rwrap_trace.rings; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == ring) {
+			*pp = ring->next;
 			break;
-		} else if (TYPE_MATCH(type, ns_t_aaaa,
-				      rec_type, "AAAA", key, query)) {
-			rc = rwrap_create_fake_aaaa_rr(key, value, rr);
+		}
+	}
+	pthread_mutex_unlock(&rwrap_trace.lock);
+
+	free(ring);
+}
+
+static void rwrap_trace_key_init(void)
+{
+	int rc;
+
+	rc = pthread_key_create(&rwrap_trace.key, rwrap_trace_ring_free);
+	if (rc != 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Failed to create the trace ring key: %s\n",
+			  strerror(rc));
+		return;
+	}
+	rwrap_trace.key_ok = true;
+}
+
+static struct rwrap_trace_ring *rwrap_trace_ring(void)
+{
+	struct rwrap_trace_ring *ring;
+	int rc;
+
+	pthread_once(&rwrap_trace.once, rwrap_trace_key_init);
+	if (!rwrap_trace.key_ok) {
+		return NULL;
+	}
+
+	ring = (struct rwrap_trace_ring *)pthread_getspecific(rwrap_trace.key);
+	if (ring != NULL) {
+		return ring;
+	}
+
+	ring = calloc(1, sizeof(struct rwrap_trace_ring));
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	rc = pthread_setspecific(rwrap_trace.key, ring);
+	if (rc != 0) {
+		free(ring);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&rwrap_trace.lock);
+	ring->thread = ++rwrap_trace.nthreads;
+	ring->next = rwrap_trace.rings;
+	rwrap_trace.rings = ring;
+	pthread_mutex_unlock(&rwrap_trace.lock);
+
+	return ring;
+}
+
+static void rwrap_trace_record(enum rwrap_trace_event event,
+			       uint64_t a0,
+			       uint64_t a1,
+			       uint64_t a2)
+{
+	struct rwrap_trace_ring *ring = rwrap_trace_ring();
+	struct rwrap_trace_entry *e;
+	struct timespec ts;
+
+	if (ring == NULL) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	e = &ring->entries[ring->head & (RWRAP_TRACE_RING_SIZE - 1)];
+	e->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	e->event = event;
+	e->reserved = 0;
+	e->args[0] = a0;
+	e->args[1] = a1;
+	e->args[2] = a2;
+
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Writes what is left in the rings, called when the library is unloaded.
+ * Other threads may still record, what they record later is not written.
+ */
+static void rwrap_trace_flush_all(void)
+{
+	struct rwrap_trace_ring *own = NULL;
+	struct rwrap_trace_ring *ring;
+
+	if (rwrap_trace.key_ok) {
+		own = pthread_getspecific(rwrap_trace.key);
+	}
+
+	pthread_mutex_lock(&rwrap_trace.lock);
+	for (ring = rwrap_trace.rings; ring != NULL; ring = ring->next) {
+		rwrap_trace_flush(ring, ring == own);
+	}
+	rwrap_trace.closed = true;
+	pthread_mutex_unlock(&rwrap_trace.lock);
+}
+
+int rwrap_trace_decode(const char *tracefile, FILE *out);
+
+/* Prints a trace file written by the rings as text */
+int rwrap_trace_decode(const char *tracefile, FILE *out)
+{
+	struct rwrap_trace_segment seg;
+	struct rwrap_trace_entry e;
+	FILE *fp;
+	uint64_t i;
+	size_t j;
+	int rc = 0;
+
+	fp = fopen(tracefile, "r");
+	if (fp == NULL) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Opening %s failed: %s\n",
+			  tracefile, strerror(errno));
+		return -1;
+	}
+
+	while (fread(&seg, sizeof(seg), 1, fp) == 1) {
+		if (memcmp(seg.magic, RWRAP_TRACE_MAGIC,
+			   sizeof(RWRAP_TRACE_MAGIC)) != 0 ||
+		    seg.version != RWRAP_TRACE_VERSION ||
+		    seg.entry_size != sizeof(struct rwrap_trace_entry)) {
+			RWRAP_LOG(RWRAP_LOG_ERROR,
+				  "Corrupt trace file %s\n", tracefile);
+			rc = -1;
 			break;
-		} else if (TYPE_MATCH(type, ns_t_srv,
-				      rec_type, "SRV", key, query)) {
-			rc = rwrap_create_fake_srv_rr(key, value, rr);
-			if (rc == 0) {
-				rc = rwrap_srv_recurse(hostfile, recursion+1,
-						rr->rrdata.srv_rec.hostname,
-						rr + 1);
+		}
+
+		fprintf(out, "# pid %llu thread %llu, %llu events",
+			(unsigned long long)seg.pid,
+			(unsigned long long)seg.thread,
+			(unsigned long long)seg.nentries);
+		if (seg.dropped > 0) {
+			fprintf(out, ", %llu dropped",
+				(unsigned long long)seg.dropped);
+		}
+		fprintf(out, "\n");
+
+		for (i = 0; i < seg.nentries; i++) {
+			if (fread(&e, sizeof(e), 1, fp) != 1) {
+				RWRAP_LOG(RWRAP_LOG_ERROR,
+					  "Truncated trace file %s\n",
+					  tracefile);
+				rc = -1;
+				goto done;
 			}
-			break;
-		} else if (TYPE_MATCH(type, ns_t_soa,
-				      rec_type, "SOA", key, query)) {
-			rc = rwrap_create_fake_soa_rr(key, value, rr);
-			break;
-		} else if (TYPE_MATCH(type, ns_t_cname,
-				      rec_type, "CNAME", key, query)) {
-			rc = rwrap_create_fake_cname_rr(key, value, rr);
-			if (rc == 0) {
-				rc = rwrap_cname_recurse(hostfile, recursion+1,
-							 value, rr + 1);
+
+			fprintf(out, "%llu.%09llu ",
+				(unsigned long long)(e.ts / 1000000000),
+				(unsigned long long)(e.ts % 1000000000));
+
+			if (e.event >= RWRAP_TRACE_NEVENTS ||
+			    rwrap_trace_events[e.event].name == NULL) {
+				fprintf(out, "event%u %llu %llu %llu\n",
+					e.event,
+					(unsigned long long)e.args[0],
+					(unsigned long long)e.args[1],
+					(unsigned long long)e.args[2]);
+				continue;
 			}
-			break;
-		} else if (TYPE_MATCH(type, ns_t_a, rec_type, "CNAME", key, query)) {
-			rc = rwrap_create_fake_cname_rr(key, value, rr);
-			if (rc == 0) {
-				rc = rwrap_cname_recurse(hostfile, recursion+1,
-							 value, rr + 1);
+
+			fprintf(out, "%s", rwrap_trace_events[e.event].name);
+			for (j = 0; j < RWRAP_TRACE_NARGS; j++) {
+				const char *arg;
+
+				arg = rwrap_trace_events[e.event].args[j];
+				if (arg == NULL) {
+					break;
+				}
+				fprintf(out, " %s=%lld", arg,
+					(long long)e.args[j]);
 			}
-			break;
+			fprintf(out, "\n");
 		}
 	}
 
-	if (rc == ENOENT && recursion == 0 && key != NULL) {
-		RWRAP_LOG(RWRAP_LOG_TRACE, "Record for [%s] not found\n", query);
-		memcpy(rr->key, key, strlen(key) + 1);
+	if (ferror(fp)) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Reading from %s failed\n", tracefile);
+		rc = -1;
 	}
 
+done:
 	fclose(fp);
 	return rc;
 }
 
-static ssize_t rwrap_fake_empty(int type,
-				const char *question,
-				uint8_t *answer,
-				size_t anslen)
+/*
+ * FNV-1a over the name and then the record type. The names are folded to
+ * lower case before, when they are loaded or queried. This is part of the
+ * compiled database format, bump RWRAP_FAKE_DB_VERSION if it changes.
+ */
+static uint32_t rwrap_fake_name_hash(const char *key, size_t len)
 {
-	ssize_t resp_data;
-	size_t remaining = anslen;
+	uint32_t h = 2166136261U;
+	size_t i;
 
-	resp_data = rwrap_fake_header(&answer, remaining, 0, 0);
-	if (resp_data < 0) {
-		return -1;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619U;
 	}
-	remaining -= resp_data;
 
-	resp_data += rwrap_fake_question(question, type, &answer, remaining);
-	if (resp_data < 0) {
-		return -1;
+	return h;
+}
+
+static uint32_t rwrap_fake_type_hash(uint32_t name_hash, int type)
+{
+	return (name_hash ^ (uint32_t)type) * 16777619U;
+}
+
+static uint32_t rwrap_fake_hash(const char *key, size_t len, int type)
+{
+	return rwrap_fake_type_hash(rwrap_fake_name_hash(key, len), type);
+}
+
+/* The murmur3 finalizer */
+static uint32_t rwrap_mix32(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/*
+ * Returns an ID for an answer. The IDs are a counter from a random seed,
+ * mixed by the murmur3 finalizer, so only the first one costs a syscall.
+ */
+static uint16_t rwrap_random_id(void)
+{
+	static uint32_t seed;
+	static uint32_t counter;
+	uint32_t s;
+
+	s = __atomic_load_n(&seed, __ATOMIC_RELAXED);
+	if (s == 0) {
+#ifdef HAVE_GETENTROPY
+		if (getentropy(&s, sizeof(s)) != 0) {
+			s = 0;
+		}
+#endif
+		if (s == 0) {
+			s = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+		}
+		s |= 1;
+		__atomic_store_n(&seed, s, __ATOMIC_RELAXED);
 	}
-	remaining -= resp_data;
 
-	resp_data += rwrap_fake_rdata_common(type, 0, question,
-					    remaining, &answer);
-	if (resp_data < 0) {
-		return -1;
+	return rwrap_mix32(s + __atomic_fetch_add(&counter, 0x9e3779b9U,
+						  __ATOMIC_RELAXED)) >> 16;
+}
+
+/*
+ * The probes of the Bloom filter are derived from the name hash by double
+ * hashing, the second hash is the murmur3 finalizer of the first one.
+ */
+static void rwrap_fake_bloom_probes(uint32_t name_hash,
+				    uint32_t nbits,
+				    uint32_t probes[RWRAP_FAKE_BLOOM_PROBES])
+{
+	uint32_t h2 = rwrap_mix32(name_hash) | 1;
+	size_t i;
+
+	for (i = 0; i < RWRAP_FAKE_BLOOM_PROBES; i++) {
+		probes[i] = (name_hash + (uint32_t)i * h2) & (nbits - 1);
+	}
+}
+
+/* Returns the index of the displacement of a name hash */
+static uint32_t rwrap_fake_mph_disp(uint32_t name_hash, uint32_t mph_size)
+{
+	return ((uint64_t)rwrap_mix32(name_hash) * mph_size) >> 32;
+}
+
+/* Returns the bucket of a name hash with the displacement disp */
+static uint32_t rwrap_fake_mph_bucket(uint32_t name_hash,
+				      uint32_t disp,
+				      uint32_t nbuckets)
+{
+	uint32_t h;
+
+	if ((disp & RWRAP_FAKE_MPH_DIRECT) != 0) {
+		return disp & ~RWRAP_FAKE_MPH_DIRECT;
 	}
 
-	return resp_data;
+	h = rwrap_mix32(name_hash ^ ((disp + 1) * 0x9e3779b9U));
+
+	return ((uint64_t)h * nbuckets) >> 32;
 }
 
-static inline bool rwrap_known_type(int type)
+/*
+ * Compares the results of two stat() calls of a file we read. The change
+ * time catches a rewrite which keeps the modification time, the nanoseconds
+ * one within the same second.
+ */
+static bool rwrap_stat_changed(const struct stat *old, const struct stat *cur)
 {
-	switch (type) {
-	case ns_t_a:
-	case ns_t_aaaa:
-	case ns_t_srv:
-	case ns_t_soa:
-	case ns_t_cname:
+	if (cur->st_dev != old->st_dev ||
+	    cur->st_ino != old->st_ino ||
+	    cur->st_size != old->st_size ||
+	    cur->st_mtime != old->st_mtime ||
+	    cur->st_ctime != old->st_ctime) {
 		return true;
 	}
 
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	return cur->st_mtim.tv_nsec != old->st_mtim.tv_nsec ||
+	       cur->st_ctim.tv_nsec != old->st_ctim.tv_nsec;
+#else
 	return false;
+#endif
+}
+
+/* DNS names only fold the ASCII letters, whatever the locale */
+#define RWRAP_TOLOWER(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+
+/* Copies len bytes of a name to dst in lower case */
+static void rwrap_fold_name(char *dst, const char *src, size_t len)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i before_a = _mm_set1_epi8('A' - 1);
+	const __m128i after_z = _mm_set1_epi8('Z' + 1);
+	const __m128i delta = _mm_set1_epi8('a' - 'A');
+
+	/* Bytes above 0x7f compare as negative and are kept */
+	for (; i + 16 <= len; i += 16) {
+		const void *p = src + i;
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		__m128i upper;
+
+		upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a),
+				      _mm_cmplt_epi8(v, after_z));
+		v = _mm_add_epi8(v, _mm_and_si128(upper, delta));
+		_mm_storeu_si128((__m128i *)(void *)(dst + i), v);
+	}
+#endif /* __SSE2__ */
+
+	for (; i < len; i++) {
+		dst[i] = RWRAP_TOLOWER(src[i]);
+	}
+}
+
+/* Returns the first space or tab in [p, end), or end */
+static const char *rwrap_find_blank(const char *p, const char *end)
+{
+#ifdef __SSE2__
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(const void *)p);
+		int mask;
+
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, space),
+						      _mm_cmpeq_epi8(v, tab)));
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 16;
+	}
+#endif /* __SSE2__ */
+
+	while (p < end && *p != ' ' && *p != '\t') {
+		p++;
+	}
+
+	return p;
+}
+
+/*
+ * Returns the next blank separated token of the line [*pos, end) and
+ * advances *pos past the blanks following it.
+ */
+static const char *rwrap_next_token(const char **pos,
+				    const char *end,
+				    size_t *len)
+{
+	const char *tok = *pos;
+	const char *p;
+
+	p = rwrap_find_blank(tok, end);
+	*len = p - tok;
+
+	while (p < end && isblank((int)*p)) {
+		p++;
+	}
+	*pos = p;
+
+	return tok;
 }
 
-static int rwrap_ancount(struct rwrap_fake_rr *rrs, int qtype)
-{
-	int i;
-	int ancount = 0;
+/* Copies a token out of the mapping so it can be passed to libc */
+static bool rwrap_token_str(const char *tok, size_t len,
+			    char *buf, size_t buflen)
+{
+	if (len == 0 || len >= buflen) {
+		return false;
+	}
+
+	memcpy(buf, tok, len);
+	buf[len] = '\0';
+
+	return true;
+}
+
+/* Converts the leading digits of a token like atoi() does */
+static uint32_t rwrap_token_num(const char *tok, size_t len)
+{
+	uint32_t num = 0;
+	size_t i;
+
+	for (i = 0; i < len && isdigit((int)tok[i]); i++) {
+		num = num * 10 + (tok[i] - '0');
+	}
+
+	return num;
+}
+
+/*
+ * Converts a name, like the lower-cased query key, to wire format. Returns
+ * the length or -1 if it is not a valid name.
+ */
+static ssize_t rwrap_fake_key_wire(const char *key,
+				   size_t len,
+				   uint8_t wire[NS_MAXCDNAME])
+{
+	const char *label = key;
+	const char *dot;
+	const char *end = key + len;
+	uint8_t *p = wire;
+	size_t n;
+
+	/* Only ns_name_pton() knows the escapes, the key is terminated */
+	if (memchr(key, '\\', len) != NULL) {
+		return ns_name_compress(key, wire, NS_MAXCDNAME, NULL, NULL);
+	}
+
+	if (len + 2 > NS_MAXCDNAME) {
+		return -1;
+	}
+
+	while (label < end) {
+		dot = memchr(label, '.', end - label);
+		if (dot == NULL) {
+			dot = end;
+		}
+
+		n = dot - label;
+		if (n == 0 || n > NS_MAXLABEL) {
+			return -1;
+		}
+
+		*p++ = n;
+		memcpy(p, label, n);
+		p += n;
+
+		label = dot + 1;
+	}
+	*p++ = 0;
+
+	return p - wire;
+}
+
+static bool rwrap_rdata_put_name(struct rwrap_fake_rdata *rd,
+				 const char *tok, size_t len)
+{
+	char name[MAXDNAME];
+	ssize_t n;
+
+	if (!rwrap_token_str(tok, len, name, sizeof(name))) {
+		return false;
+	}
+
+	n = rwrap_fake_key_wire(name, len, rd->data + rd->len);
+	if (n < 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Failed to compress [%s]\n", name);
+		return false;
+	}
+	rd->len += n;
+
+	return true;
+}
+
+static void rwrap_rdata_put16(struct rwrap_fake_rdata *rd, uint16_t val)
+{
+	uint8_t *p = rd->data + rd->len;
+
+	NS_PUT16(val, p);
+	rd->len += NS_INT16SZ;
+}
+
+static void rwrap_rdata_put32(struct rwrap_fake_rdata *rd, uint32_t val)
+{
+	uint8_t *p = rd->data + rd->len;
+
+	NS_PUT32(val, p);
+	rd->len += NS_INT32SZ;
+}
+
+static int rwrap_create_fake_a_rr(const char *value,
+				  size_t value_len,
+				  struct rwrap_fake_rdata *rd)
+{
+	char str_addr[INET_ADDRSTRLEN];
+	const char *tok;
+	size_t len;
+	int ok = 0;
+
+	tok = rwrap_next_token(&value, value + value_len, &len);
+	if (rwrap_token_str(tok, len, str_addr, sizeof(str_addr))) {
+		ok = inet_pton(AF_INET, str_addr, rd->data);
+	}
+	if (!ok) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Failed to convert [%.*s] to binary\n",
+			  (int)len, tok);
+		return -1;
+	}
+
+	rd->len = sizeof(struct in_addr);
+	return 0;
+}
+
+static int rwrap_create_fake_aaaa_rr(const char *value,
+				     size_t value_len,
+				     struct rwrap_fake_rdata *rd)
+{
+	char str_addr[INET6_ADDRSTRLEN];
+	const char *tok;
+	size_t len;
+	int ok = 0;
+
+	tok = rwrap_next_token(&value, value + value_len, &len);
+	if (rwrap_token_str(tok, len, str_addr, sizeof(str_addr))) {
+		ok = inet_pton(AF_INET6, str_addr, rd->data);
+	}
+	if (!ok) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Failed to convert [%.*s] to binary\n",
+			  (int)len, tok);
+		return -1;
+	}
+
+	rd->len = sizeof(struct in6_addr);
+	return 0;
+}
+
+static int rwrap_create_fake_srv_rr(const char *value,
+				    size_t value_len,
+				    struct rwrap_fake_rdata *rd)
+{
+	const char *end = value + value_len;
+	const char *p = value;
+	const char *hostname;
+	const char *str_port;
+	const char *str_prio;
+	const char *str_weight;
+	size_t hostname_len;
+	size_t port_len;
+	size_t prio_len;
+	size_t weight_len;
+
+	/* parse the value into priority, weight, port and hostname
+	 * and check the validity */
+	hostname = rwrap_next_token(&p, end, &hostname_len);
+	str_port = rwrap_next_token(&p, end, &port_len);
+	str_prio = rwrap_next_token(&p, end, &prio_len);
+	str_weight = rwrap_next_token(&p, end, &weight_len);
+	if (hostname_len == 0 || port_len == 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Malformed SRV entry [%.*s]\n",
+			  (int)value_len, value);
+		return -1;
+	}
+
+	if (prio_len > 0) {
+		rwrap_rdata_put16(rd, rwrap_token_num(str_prio, prio_len));
+	} else {
+		rwrap_rdata_put16(rd, DFL_SRV_PRIO);
+	}
+	if (weight_len > 0) {
+		rwrap_rdata_put16(rd, rwrap_token_num(str_weight, weight_len));
+	} else {
+		rwrap_rdata_put16(rd, DFL_SRV_WEIGHT);
+	}
+	rwrap_rdata_put16(rd, rwrap_token_num(str_port, port_len));
+
+	if (!rwrap_rdata_put_name(rd, hostname, hostname_len)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int rwrap_create_fake_soa_rr(const char *value,
+				    size_t value_len,
+				    struct rwrap_fake_rdata *rd)
+{
+	const char *end = value + value_len;
+	const char *p = value;
+	const char *tok[7];
+	size_t len[7];
+	size_t i;
+
+	/* parse the value into nameserver, mailbox, serial, refresh,
+	 * retry, expire, minimum and check the validity
+	 */
+	for (i = 0; i < 7; i++) {
+		tok[i] = rwrap_next_token(&p, end, &len[i]);
+		if (len[i] == 0) {
+			RWRAP_LOG(RWRAP_LOG_ERROR,
+				  "Malformed SOA entry [%.*s]\n",
+				  (int)value_len, value);
+			return -1;
+		}
+	}
+
+	if (!rwrap_rdata_put_name(rd, tok[0], len[0]) ||
+	    !rwrap_rdata_put_name(rd, tok[1], len[1])) {
+		return -1;
+	}
+
+	for (i = 2; i < 7; i++) {
+		rwrap_rdata_put32(rd, rwrap_token_num(tok[i], len[i]));
+	}
+
+	return 0;
+}
+
+/* The RDATA of CNAME, PTR and NS records is a single name */
+static int rwrap_create_fake_name_rr(const char *value,
+				     size_t value_len,
+				     struct rwrap_fake_rdata *rd)
+{
+	const char *hostname;
+	size_t len;
+
+	hostname = rwrap_next_token(&value, value + value_len, &len);
+	if (!rwrap_rdata_put_name(rd, hostname, len)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Copies the next string of the line [*pos, end) to buf, a token or a text
+ * in double quotes which can contain blanks and the escapes \" and \\.
+ * Returns its length or -1 if there is none or it is longer than size.
+ */
+static ssize_t rwrap_next_string(const char **pos,
+				 const char *end,
+				 char *buf,
+				 size_t size)
+{
+	const char *p = *pos;
+	const char *tok;
+	size_t n = 0;
+
+	if (p >= end) {
+		return -1;
+	}
+
+	if (*p != '"') {
+		tok = rwrap_next_token(pos, end, &n);
+		if (n > size) {
+			return -1;
+		}
+		memcpy(buf, tok, n);
+		return n;
+	}
+
+	for (p++; p < end && *p != '"'; p++) {
+		if (*p == '\\' && p + 1 < end) {
+			p++;
+		}
+		if (n == size) {
+			return -1;
+		}
+		buf[n++] = *p;
+	}
+	if (p == end) {
+		return -1;
+	}
+
+	for (p++; p < end && isblank((int)*p); p++) {
+		;
+	}
+	*pos = p;
+
+	return n;
+}
+
+/* Appends a <character-string> (RFC 1035, 3.3) read from [*pos, end) */
+static bool rwrap_rdata_put_string(struct rwrap_fake_rdata *rd,
+				   const char **pos,
+				   const char *end)
+{
+	char buf[UINT8_MAX];
+	ssize_t n;
+
+	n = rwrap_next_string(pos, end, buf, sizeof(buf));
+	if (n < 0 || rd->len + 1 + n > sizeof(rd->data)) {
+		return false;
+	}
+
+	rd->data[rd->len++] = n;
+	memcpy(rd->data + rd->len, buf, n);
+	rd->len += n;
+
+	return true;
+}
+
+/*
+ * The value of a TXT record is a sequence of strings in double quotes, or
+ * else a single string up to the end of the line. Strings longer than 255
+ * bytes are split into several (RFC 7208, 3.3).
+ */
+static int rwrap_create_fake_txt_rr(const char *value,
+				    size_t value_len,
+				    struct rwrap_fake_rdata *rd)
+{
+	const char *end = value + value_len;
+	const char *p = value;
+	char text[RWRAP_FAKE_RDATA_MAX];
+	const char *str;
+	ssize_t n;
+	size_t off;
+	size_t len;
+
+	while (end > p && isspace((int)end[-1])) {
+		end--;
+	}
+	if (p == end) {
+		goto malformed;
+	}
+
+	do {
+		if (*p == '"') {
+			n = rwrap_next_string(&p, end, text, sizeof(text));
+			str = text;
+		} else {
+			n = end - p;
+			str = p;
+			p = end;
+		}
+		if (n < 0) {
+			goto malformed;
+		}
+
+		off = 0;
+		do {
+			len = MIN(n - off, UINT8_MAX);
+			if (rd->len + 1 + len > sizeof(rd->data)) {
+				goto malformed;
+			}
+
+			rd->data[rd->len++] = len;
+			memcpy(rd->data + rd->len, str + off, len);
+			rd->len += len;
+			off += len;
+		} while (off < (size_t)n);
+	} while (p < end);
+
+	return 0;
+
+malformed:
+	RWRAP_LOG(RWRAP_LOG_ERROR,
+		  "Malformed TXT entry [%.*s]\n",
+		  (int)value_len, value);
+	return -1;
+}
+
+static int rwrap_create_fake_mx_rr(const char *value,
+				   size_t value_len,
+				   struct rwrap_fake_rdata *rd)
+{
+	const char *end = value + value_len;
+	const char *p = value;
+	const char *str_pref;
+	const char *exchange;
+	size_t pref_len;
+	size_t exchange_len;
+
+	str_pref = rwrap_next_token(&p, end, &pref_len);
+	exchange = rwrap_next_token(&p, end, &exchange_len);
+	if (pref_len == 0 || exchange_len == 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Malformed MX entry [%.*s]\n",
+			  (int)value_len, value);
+		return -1;
+	}
+
+	rwrap_rdata_put16(rd, rwrap_token_num(str_pref, pref_len));
+	if (!rwrap_rdata_put_name(rd, exchange, exchange_len)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int rwrap_create_fake_naptr_rr(const char *value,
+				      size_t value_len,
+				      struct rwrap_fake_rdata *rd)
+{
+	const char *end = value + value_len;
+	const char *p = value;
+	const char *tok[2];
+	const char *replacement;
+	size_t len[2];
+	size_t replacement_len;
+	size_t i;
+
+	/* order, preference, flags, services, regexp and replacement */
+	for (i = 0; i < 2; i++) {
+		tok[i] = rwrap_next_token(&p, end, &len[i]);
+		if (len[i] == 0) {
+			goto malformed;
+		}
+		rwrap_rdata_put16(rd, rwrap_token_num(tok[i], len[i]));
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (!rwrap_rdata_put_string(rd, &p, end)) {
+			goto malformed;
+		}
+	}
+
+	replacement = rwrap_next_token(&p, end, &replacement_len);
+	if (replacement_len == 1 && replacement[0] == '.') {
+		rd->data[rd->len++] = 0;
+		return 0;
+	}
+	if (!rwrap_rdata_put_name(rd, replacement, replacement_len)) {
+		goto malformed;
+	}
+
+	return 0;
+
+malformed:
+	RWRAP_LOG(RWRAP_LOG_ERROR,
+		  "Malformed NAPTR entry [%.*s]\n",
+		  (int)value_len, value);
+	return -1;
+}
+
+static int rwrap_create_fake_uri_rr(const char *value,
+				    size_t value_len,
+				    struct rwrap_fake_rdata *rd)
+{
+	const char *end = value + value_len;
+	const char *p = value;
+	const char *str_prio;
+	const char *str_weight;
+	size_t prio_len;
+	size_t weight_len;
+	ssize_t n;
+
+	/* priority, weight and the target, which is not a string */
+	str_prio = rwrap_next_token(&p, end, &prio_len);
+	str_weight = rwrap_next_token(&p, end, &weight_len);
+	if (prio_len == 0 || weight_len == 0) {
+		goto malformed;
+	}
+	rwrap_rdata_put16(rd, rwrap_token_num(str_prio, prio_len));
+	rwrap_rdata_put16(rd, rwrap_token_num(str_weight, weight_len));
+
+	n = rwrap_next_string(&p, end, (char *)rd->data + rd->len,
+			      sizeof(rd->data) - rd->len);
+	if (n <= 0) {
+		goto malformed;
+	}
+	rd->len += n;
+
+	return 0;
+
+malformed:
+	RWRAP_LOG(RWRAP_LOG_ERROR,
+		  "Malformed URI entry [%.*s]\n",
+		  (int)value_len, value);
+	return -1;
+}
+
+static int rwrap_create_fake_caa_rr(const char *value,
+				    size_t value_len,
+				    struct rwrap_fake_rdata *rd)
+{
+	const char *end = value + value_len;
+	const char *p = value;
+	const char *str_flags;
+	const char *tag;
+	size_t flags_len;
+	size_t tag_len;
+	size_t i;
+	ssize_t n;
+
+	/* flags, the tag and the value, which is not a string */
+	str_flags = rwrap_next_token(&p, end, &flags_len);
+	tag = rwrap_next_token(&p, end, &tag_len);
+	if (flags_len == 0 || tag_len == 0 || tag_len > 15) {
+		goto malformed;
+	}
+	for (i = 0; i < tag_len; i++) {
+		if (!isalnum((int)tag[i])) {
+			goto malformed;
+		}
+	}
+
+	rd->data[rd->len++] = rwrap_token_num(str_flags, flags_len);
+	rd->data[rd->len++] = tag_len;
+	memcpy(rd->data + rd->len, tag, tag_len);
+	rd->len += tag_len;
+
+	n = rwrap_next_string(&p, end, (char *)rd->data + rd->len,
+			      sizeof(rd->data) - rd->len);
+	if (n < 0) {
+		goto malformed;
+	}
+	rd->len += n;
+
+	return 0;
+
+malformed:
+	RWRAP_LOG(RWRAP_LOG_ERROR,
+		  "Malformed CAA entry [%.*s]\n",
+		  (int)value_len, value);
+	return -1;
+}
+
+/*
+ * Returns the length of an uncompressed name in wire format or -1 if it is
+ * malformed or does not end before end.
+ */
+static ssize_t rwrap_wire_name_len(const uint8_t *name, const uint8_t *end)
+{
+	const uint8_t *p = name;
+
+	while (p < end && *p != 0) {
+		if ((*p & NS_CMPRSFLGS) != 0) {
+			return -1;
+		}
+		p += *p + 1;
+	}
+
+	if (p >= end || p - name + 1 > NS_MAXCDNAME) {
+		return -1;
+	}
+
+	return p - name + 1;
+}
+
+/* The SOA RDATA has two names and five integers */
+static bool rwrap_rr_soa_valid(const uint8_t *rdata, size_t rdlen)
+{
+	const uint8_t *end = rdata + rdlen;
+	ssize_t n;
+
+	n = rwrap_wire_name_len(rdata, end);
+	if (n < 0) {
+		return false;
+	}
+	rdata += n;
+	n = rwrap_wire_name_len(rdata, end);
+
+	return n >= 0 && end - rdata - n == 5 * NS_INT32SZ;
+}
+
+static int rwrap_rr_encode_rdata(struct rwrap_msg *msg,
+				 const uint8_t *rdata,
+				 size_t rdlen,
+				 const uint8_t *target);
+static int rwrap_rr_encode_name(struct rwrap_msg *msg,
+				const uint8_t *rdata,
+				size_t rdlen,
+				const uint8_t *target);
+static int rwrap_rr_encode_srv(struct rwrap_msg *msg,
+			       const uint8_t *rdata,
+			       size_t rdlen,
+			       const uint8_t *target);
+static int rwrap_rr_encode_soa(struct rwrap_msg *msg,
+			       const uint8_t *rdata,
+			       size_t rdlen,
+			       const uint8_t *target);
+
+static const struct rwrap_rr_type rwrap_rr_a = {
+	"A", -1, false, true,
+	rwrap_create_fake_a_rr, NULL, rwrap_rr_encode_rdata,
+};
+static const struct rwrap_rr_type rwrap_rr_ns = {
+	"NS", 0, true, false,
+	rwrap_create_fake_name_rr, NULL, rwrap_rr_encode_name,
+};
+static const struct rwrap_rr_type rwrap_rr_cname = {
+	"CNAME", 0, true, false,
+	rwrap_create_fake_name_rr, NULL, rwrap_rr_encode_name,
+};
+static const struct rwrap_rr_type rwrap_rr_soa = {
+	"SOA", -1, false, false,
+	rwrap_create_fake_soa_rr, rwrap_rr_soa_valid, rwrap_rr_encode_soa,
+};
+static const struct rwrap_rr_type rwrap_rr_ptr = {
+	"PTR", 0, false, false,
+	rwrap_create_fake_name_rr, NULL, rwrap_rr_encode_name,
+};
+static const struct rwrap_rr_type rwrap_rr_mx = {
+	"MX", NS_INT16SZ, true, false,
+	rwrap_create_fake_mx_rr, NULL, rwrap_rr_encode_name,
+};
+static const struct rwrap_rr_type rwrap_rr_txt = {
+	"TXT", -1, false, false,
+	rwrap_create_fake_txt_rr, NULL, rwrap_rr_encode_rdata,
+};
+static const struct rwrap_rr_type rwrap_rr_aaaa = {
+	"AAAA", -1, false, true,
+	rwrap_create_fake_aaaa_rr, NULL, rwrap_rr_encode_rdata,
+};
+/* The target of SRV must not be compressed (RFC 2782) */
+static const struct rwrap_rr_type rwrap_rr_srv = {
+	"SRV", 3 * NS_INT16SZ, true, false,
+	rwrap_create_fake_srv_rr, NULL, rwrap_rr_encode_srv,
+};
+/* Neither the replacement of NAPTR (RFC 3403, 4.1) */
+static const struct rwrap_rr_type rwrap_rr_naptr = {
+	"NAPTR", -1, false, false,
+	rwrap_create_fake_naptr_rr, NULL, rwrap_rr_encode_rdata,
+};
+static const struct rwrap_rr_type rwrap_rr_uri = {
+	"URI", -1, false, false,
+	rwrap_create_fake_uri_rr, NULL, rwrap_rr_encode_rdata,
+};
+static const struct rwrap_rr_type rwrap_rr_caa = {
+	"CAA", -1, false, false,
+	rwrap_create_fake_caa_rr, NULL, rwrap_rr_encode_rdata,
+};
+
+/* The types by their code, the answers look up their type with one load */
+static const struct rwrap_rr_type *const rwrap_rr_types[] = {
+	[ns_t_a] = &rwrap_rr_a,
+	[ns_t_ns] = &rwrap_rr_ns,
+	[ns_t_cname] = &rwrap_rr_cname,
+	[ns_t_soa] = &rwrap_rr_soa,
+	[ns_t_ptr] = &rwrap_rr_ptr,
+	[ns_t_mx] = &rwrap_rr_mx,
+	[ns_t_txt] = &rwrap_rr_txt,
+	[ns_t_aaaa] = &rwrap_rr_aaaa,
+	[ns_t_srv] = &rwrap_rr_srv,
+	[ns_t_naptr] = &rwrap_rr_naptr,
+	[RWRAP_NS_T_URI] = &rwrap_rr_uri,
+	[RWRAP_NS_T_CAA] = &rwrap_rr_caa,
+};
+
+#define RWRAP_RR_TYPES (sizeof(rwrap_rr_types) / sizeof(rwrap_rr_types[0]))
+
+/* Returns the type with the code or NULL if the hosts file does not know it */
+static const struct rwrap_rr_type *rwrap_rr_type_get(int type)
+{
+	if (type < 0 || (size_t)type >= RWRAP_RR_TYPES) {
+		return NULL;
+	}
+
+	return rwrap_rr_types[type];
+}
+
+/* Returns the code of the type with the name, as in the hosts file */
+static int rwrap_fake_type(const char *rec_type, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < RWRAP_RR_TYPES; i++) {
+		const struct rwrap_rr_type *t = rwrap_rr_types[i];
+
+		if (t != NULL && strlen(t->name) == len &&
+		    memcmp(t->name, rec_type, len) == 0) {
+			return i;
+		}
+	}
+
+	return ns_t_invalid;
+}
+
+/* The RDATA of these types has no names, so their RRsets are packed */
+static bool rwrap_fake_type_packed(int type)
+{
+	const struct rwrap_rr_type *t = rwrap_rr_type_get(type);
+
+	return t != NULL && t->packed;
+}
+
+/* Parses the value of a record of type into its RDATA in wire format */
+static int rwrap_fake_rdata_parse(int type,
+				  const char *value,
+				  size_t value_len,
+				  struct rwrap_fake_rdata *rd)
+{
+	const struct rwrap_rr_type *t = rwrap_rr_type_get(type);
+
+	rd->len = 0;
+
+	if (t == NULL) {
+		return -1;
+	}
+
+	return t->parse(value, value_len, rd);
+}
+
+/*
+ * A record name starting with "~" is a pattern which has to match the whole
+ * query name, ignoring the case. It knows sets like [0-9] or [^.], groups
+ * with alternatives, "*", "+" and "?". A dot only matches a dot. The value
+ * of the record can refer to the text matched by the groups as $1 to $9:
+ *
+ *     A ~node-([0-9]+).rack([0-9]).example 10.$2.0.$1
+ *
+ * When a database is loaded all patterns are compiled into a single DFA, so
+ * one pass over the query name finds all the patterns which match it. The
+ * DFA does not track the groups, so the program of the pattern which
+ * answers the query runs once more in a Pike VM to find them.
+ */
+
+#define RWRAP_RE_MAX_GROUPS 9
+/* A pattern is at most as long as a name, every byte adds two nodes at most */
+#define RWRAP_RE_MAX_NODES (2 * NS_MAXCDNAME + 1)
+
+/* Beyond this the patterns are tried one after another */
+#ifndef RWRAP_FAKE_DFA_MAX_STATES
+#define RWRAP_FAKE_DFA_MAX_STATES 16384
+#endif
+
+enum rwrap_re_node_type {
+	RWRAP_RE_EMPTY = 0,
+	RWRAP_RE_SET,
+	RWRAP_RE_CAT,
+	RWRAP_RE_ALT,
+	RWRAP_RE_STAR,
+	RWRAP_RE_PLUS,
+	RWRAP_RE_QUEST,
+	RWRAP_RE_GROUP,
+};
+
+struct rwrap_re_node {
+	uint8_t type;
+	uint8_t group;
+	uint16_t set;
+	uint16_t left;
+	uint16_t right;
+};
+
+enum rwrap_re_op {
+	RWRAP_RE_OP_SET = 0,
+	RWRAP_RE_OP_SPLIT,
+	RWRAP_RE_OP_JMP,
+	RWRAP_RE_OP_SAVE,
+	RWRAP_RE_OP_MATCH,
+};
+
+struct rwrap_re_inst {
+	uint8_t op;
+	uint8_t slot; /* of SAVE */
+	uint16_t x; /* the set of SET, the target of JMP and SPLIT */
+	uint16_t y; /* the second target of SPLIT */
+};
+
+/* A set of bytes as a bitmap */
+struct rwrap_re_set {
+	uint32_t bits[256 / 32];
+};
+
+struct rwrap_re {
+	struct rwrap_re_inst *prog;
+	size_t len;
+	struct rwrap_re_set *sets;
+	size_t nsets;
+};
+
+struct rwrap_re_parser {
+	const char *p;
+	const char *end;
+	struct rwrap_re_node *nodes;
+	size_t nnodes;
+	struct rwrap_re_set *sets;
+	size_t nsets;
+	unsigned int ngroups;
+};
+
+static bool rwrap_re_set_has(const struct rwrap_re_set *set, uint8_t c)
+{
+	return (set->bits[c / 32] & (1U << (c % 32))) != 0;
+}
+
+static void rwrap_re_set_add(struct rwrap_re_set *set, uint8_t c)
+{
+	set->bits[c / 32] |= 1U << (c % 32);
+}
+
+static int rwrap_re_node(struct rwrap_re_parser *ps,
+			 enum rwrap_re_node_type type,
+			 int left,
+			 int right)
+{
+	struct rwrap_re_node *node;
+
+	if (left < 0 || right < 0 || ps->nnodes == RWRAP_RE_MAX_NODES) {
+		return -1;
+	}
+
+	node = &ps->nodes[ps->nnodes];
+	memset(node, 0, sizeof(struct rwrap_re_node));
+	node->type = type;
+	node->left = left;
+	node->right = right;
+
+	return ps->nnodes++;
+}
+
+/* Returns a node which matches one byte of a new set */
+static int rwrap_re_set_node(struct rwrap_re_parser *ps,
+			     struct rwrap_re_set **set)
+{
+	int n;
+
+	n = rwrap_re_node(ps, RWRAP_RE_SET, 0, 0);
+	if (n < 0) {
+		return -1;
+	}
+
+	ps->nodes[n].set = ps->nsets;
+	*set = &ps->sets[ps->nsets++];
+	memset(*set, 0, sizeof(struct rwrap_re_set));
+
+	return n;
+}
+
+/* Parses [...] after the opening bracket */
+static int rwrap_re_parse_set(struct rwrap_re_parser *ps)
+{
+	struct rwrap_re_set *set;
+	bool negate = false;
+	size_t i;
+	int n;
+
+	n = rwrap_re_set_node(ps, &set);
+	if (n < 0) {
+		return -1;
+	}
+
+	if (ps->p < ps->end && *ps->p == '^') {
+		negate = true;
+		ps->p++;
+	}
+
+	while (ps->p < ps->end && *ps->p != ']') {
+		uint8_t lo;
+		uint8_t hi;
+		unsigned int c;
+
+		if (*ps->p == '\\' && ps->p + 1 < ps->end) {
+			ps->p++;
+		}
+		lo = hi = *ps->p++;
+
+		if (ps->p + 1 < ps->end && *ps->p == '-' && ps->p[1] != ']') {
+			ps->p++;
+			if (*ps->p == '\\' && ps->p + 1 < ps->end) {
+				ps->p++;
+			}
+			hi = *ps->p++;
+		}
+		if (lo > hi) {
+			return -1;
+		}
+
+		for (c = lo; c <= hi; c++) {
+			rwrap_re_set_add(set, c);
+		}
+	}
+	if (ps->p == ps->end) {
+		return -1;
+	}
+	ps->p++;
+
+	if (negate) {
+		for (i = 0; i < 256 / 32; i++) {
+			set->bits[i] = ~set->bits[i];
+		}
+	}
+
+	return n;
+}
+
+static int rwrap_re_parse_alt(struct rwrap_re_parser *ps);
+
+static int rwrap_re_parse_atom(struct rwrap_re_parser *ps)
+{
+	struct rwrap_re_set *set;
+	unsigned int group;
+	int n;
+
+	switch (*ps->p) {
+	case '(':
+		ps->p++;
+		if (ps->ngroups == RWRAP_RE_MAX_GROUPS) {
+			return -1;
+		}
+		group = ++ps->ngroups;
+
+		n = rwrap_re_parse_alt(ps);
+		if (n < 0 || ps->p == ps->end || *ps->p != ')') {
+			return -1;
+		}
+		ps->p++;
+
+		n = rwrap_re_node(ps, RWRAP_RE_GROUP, n, 0);
+		if (n >= 0) {
+			ps->nodes[n].group = group;
+		}
+		return n;
+	case '[':
+		ps->p++;
+		return rwrap_re_parse_set(ps);
+	case ')':
+	case '|':
+	case '*':
+	case '+':
+	case '?':
+		return -1;
+	case '\\':
+		if (ps->p + 1 < ps->end) {
+			ps->p++;
+		}
+		break;
+	default:
+		break;
+	}
+
+	n = rwrap_re_set_node(ps, &set);
+	if (n >= 0) {
+		rwrap_re_set_add(set, *ps->p++);
+	}
+
+	return n;
+}
+
+static int rwrap_re_parse_repeat(struct rwrap_re_parser *ps)
+{
+	int n;
+
+	n = rwrap_re_parse_atom(ps);
+	while (n >= 0 && ps->p < ps->end) {
+		switch (*ps->p) {
+		case '*':
+			n = rwrap_re_node(ps, RWRAP_RE_STAR, n, 0);
+			break;
+		case '+':
+			n = rwrap_re_node(ps, RWRAP_RE_PLUS, n, 0);
+			break;
+		case '?':
+			n = rwrap_re_node(ps, RWRAP_RE_QUEST, n, 0);
+			break;
+		default:
+			return n;
+		}
+		ps->p++;
+	}
+
+	return n;
+}
+
+static int rwrap_re_parse_concat(struct rwrap_re_parser *ps)
+{
+	int n;
+
+	n = rwrap_re_node(ps, RWRAP_RE_EMPTY, 0, 0);
+	while (n >= 0 && ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+		int r = rwrap_re_parse_repeat(ps);
+
+		if (ps->nodes[n].type == RWRAP_RE_EMPTY) {
+			n = r;
+		} else {
+			n = rwrap_re_node(ps, RWRAP_RE_CAT, n, r);
+		}
+	}
+
+	return n;
+}
+
+static int rwrap_re_parse_alt(struct rwrap_re_parser *ps)
+{
+	int n;
+
+	n = rwrap_re_parse_concat(ps);
+	while (n >= 0 && ps->p < ps->end && *ps->p == '|') {
+		ps->p++;
+		n = rwrap_re_node(ps, RWRAP_RE_ALT, n,
+				  rwrap_re_parse_concat(ps));
+	}
+
+	return n;
+}
+
+/* Emits the program of a node at *pc, the standard Thompson construction */
+static void rwrap_re_emit(const struct rwrap_re_parser *ps,
+			  int n,
+			  struct rwrap_re_inst *prog,
+			  uint16_t *pc)
+{
+	const struct rwrap_re_node *node = &ps->nodes[n];
+	struct rwrap_re_inst *inst;
+	uint16_t l1;
+	uint16_t l2;
+
+	switch (node->type) {
+	case RWRAP_RE_EMPTY:
+		break;
+	case RWRAP_RE_SET:
+		inst = &prog[(*pc)++];
+		inst->op = RWRAP_RE_OP_SET;
+		inst->x = node->set;
+		break;
+	case RWRAP_RE_CAT:
+		rwrap_re_emit(ps, node->left, prog, pc);
+		rwrap_re_emit(ps, node->right, prog, pc);
+		break;
+	case RWRAP_RE_ALT:
+		l1 = (*pc)++;
+		rwrap_re_emit(ps, node->left, prog, pc);
+		l2 = (*pc)++;
+		prog[l1].op = RWRAP_RE_OP_SPLIT;
+		prog[l1].x = l1 + 1;
+		prog[l1].y = *pc;
+		rwrap_re_emit(ps, node->right, prog, pc);
+		prog[l2].op = RWRAP_RE_OP_JMP;
+		prog[l2].x = *pc;
+		break;
+	case RWRAP_RE_STAR:
+		l1 = (*pc)++;
+		rwrap_re_emit(ps, node->left, prog, pc);
+		inst = &prog[(*pc)++];
+		inst->op = RWRAP_RE_OP_JMP;
+		inst->x = l1;
+		prog[l1].op = RWRAP_RE_OP_SPLIT;
+		prog[l1].x = l1 + 1;
+		prog[l1].y = *pc;
+		break;
+	case RWRAP_RE_PLUS:
+		l1 = *pc;
+		rwrap_re_emit(ps, node->left, prog, pc);
+		inst = &prog[(*pc)++];
+		inst->op = RWRAP_RE_OP_SPLIT;
+		inst->x = l1;
+		inst->y = *pc;
+		break;
+	case RWRAP_RE_QUEST:
+		l1 = (*pc)++;
+		rwrap_re_emit(ps, node->left, prog, pc);
+		prog[l1].op = RWRAP_RE_OP_SPLIT;
+		prog[l1].x = l1 + 1;
+		prog[l1].y = *pc;
+		break;
+	case RWRAP_RE_GROUP:
+		inst = &prog[(*pc)++];
+		inst->op = RWRAP_RE_OP_SAVE;
+		inst->slot = 2 * node->group;
+		rwrap_re_emit(ps, node->left, prog, pc);
+		inst = &prog[(*pc)++];
+		inst->op = RWRAP_RE_OP_SAVE;
+		inst->slot = 2 * node->group + 1;
+		break;
+	}
+}
+
+static void rwrap_re_free(struct rwrap_re *re)
+{
+	SAFE_FREE(re->prog);
+	SAFE_FREE(re->sets);
+}
+
+/* Compiles a lower-cased pattern, returns -1 if it is malformed */
+static int rwrap_re_compile(struct rwrap_re *re,
+			    const char *pattern,
+			    size_t len)
+{
+	struct rwrap_re_parser ps;
+	uint16_t pc = 0;
+	int n;
+	int rc = -1;
+
+	memset(re, 0, sizeof(struct rwrap_re));
+	memset(&ps, 0, sizeof(ps));
+	ps.p = pattern;
+	ps.end = pattern + len;
+
+	ps.nodes = calloc(RWRAP_RE_MAX_NODES, sizeof(struct rwrap_re_node));
+	ps.sets = calloc(RWRAP_RE_MAX_NODES, sizeof(struct rwrap_re_set));
+	if (ps.nodes == NULL || ps.sets == NULL || len == 0 ||
+	    len >= NS_MAXCDNAME) {
+		goto done;
+	}
+
+	n = rwrap_re_parse_alt(&ps);
+	if (n < 0 || ps.p != ps.end) {
+		goto done;
+	}
+
+	/* Every node emits two instructions at most */
+	re->prog = calloc(2 * ps.nnodes + 1, sizeof(struct rwrap_re_inst));
+	re->sets = calloc(ps.nsets + 1, sizeof(struct rwrap_re_set));
+	if (re->prog == NULL || re->sets == NULL) {
+		goto done;
+	}
+
+	rwrap_re_emit(&ps, n, re->prog, &pc);
+	re->prog[pc++].op = RWRAP_RE_OP_MATCH;
+	re->len = pc;
+
+	memcpy(re->sets, ps.sets, ps.nsets * sizeof(struct rwrap_re_set));
+	re->nsets = ps.nsets;
+
+	rc = 0;
+done:
+	if (rc != 0) {
+		rwrap_re_free(re);
+	}
+	free(ps.nodes);
+	free(ps.sets);
+
+	return rc;
+}
+
+struct rwrap_re_thread {
+	uint16_t pc;
+	int16_t caps[2 * (RWRAP_RE_MAX_GROUPS + 1)];
+};
+
+struct rwrap_re_vm {
+	const struct rwrap_re *re;
+	uint32_t *mark;
+	uint32_t gen;
+};
+
+/*
+ * The marks and the lists of threads of the Pike VM belong to the calling
+ * thread and only grow, so matching a name does not allocate. The marks
+ * are not cleared between matches, every match moves the generation on.
+ */
+struct rwrap_re_scratch {
+	size_t len; /* of the longest program there is room for */
+	uint32_t *mark;
+	uint32_t gen;
+	struct rwrap_re_thread *lists;
+};
+
+static pthread_key_t rwrap_re_scratch_key;
+static pthread_once_t rwrap_re_scratch_once = PTHREAD_ONCE_INIT;
+static bool rwrap_re_scratch_key_ok;
+
+static void rwrap_re_scratch_free(void *ptr)
+{
+	struct rwrap_re_scratch *s = (struct rwrap_re_scratch *)ptr;
+
+	free(s->mark);
+	free(s->lists);
+	free(s);
+}
+
+static void rwrap_re_scratch_key_init(void)
+{
+	int rc;
+
+	rc = pthread_key_create(&rwrap_re_scratch_key, rwrap_re_scratch_free);
+	if (rc != 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Failed to create the pattern match key: %s\n",
+			  strerror(rc));
+		return;
+	}
+	rwrap_re_scratch_key_ok = true;
+}
+
+/* Returns the scratch of the thread with room for a program of len */
+static struct rwrap_re_scratch *rwrap_re_scratch(size_t len)
+{
+	struct rwrap_re_scratch *s;
+	struct rwrap_re_thread *lists;
+	uint32_t *mark;
+	int rc;
+
+	pthread_once(&rwrap_re_scratch_once, rwrap_re_scratch_key_init);
+	if (!rwrap_re_scratch_key_ok) {
+		return NULL;
+	}
+
+	s = (struct rwrap_re_scratch *)pthread_getspecific(rwrap_re_scratch_key);
+	if (s == NULL) {
+		s = calloc(1, sizeof(struct rwrap_re_scratch));
+		if (s == NULL) {
+			return NULL;
+		}
+
+		rc = pthread_setspecific(rwrap_re_scratch_key, s);
+		if (rc != 0) {
+			free(s);
+			return NULL;
+		}
+	}
+
+	if (s->len < len) {
+		mark = calloc(len, sizeof(uint32_t));
+		lists = calloc(2 * len, sizeof(struct rwrap_re_thread));
+		if (mark == NULL || lists == NULL) {
+			free(mark);
+			free(lists);
+			return NULL;
+		}
+
+		free(s->mark);
+		free(s->lists);
+		s->mark = mark;
+		s->lists = lists;
+		s->len = len;
+		s->gen = 0;
+	}
+
+	return s;
+}
+
+/* Adds a thread at pc, following the jumps in the order of priority */
+static void rwrap_re_add_thread(struct rwrap_re_vm *vm,
+				struct rwrap_re_thread *list,
+				size_t *n,
+				uint16_t pc,
+				const int16_t *caps,
+				int16_t sp)
+{
+	const struct rwrap_re_inst *inst = &vm->re->prog[pc];
+	int16_t saved[2 * (RWRAP_RE_MAX_GROUPS + 1)];
+
+	if (vm->mark[pc] == vm->gen) {
+		return;
+	}
+	vm->mark[pc] = vm->gen;
+
+	switch (inst->op) {
+	case RWRAP_RE_OP_JMP:
+		rwrap_re_add_thread(vm, list, n, inst->x, caps, sp);
+		break;
+	case RWRAP_RE_OP_SPLIT:
+		rwrap_re_add_thread(vm, list, n, inst->x, caps, sp);
+		rwrap_re_add_thread(vm, list, n, inst->y, caps, sp);
+		break;
+	case RWRAP_RE_OP_SAVE:
+		memcpy(saved, caps, sizeof(saved));
+		saved[inst->slot] = sp;
+		rwrap_re_add_thread(vm, list, n, pc + 1, saved, sp);
+		break;
+	default:
+		list[*n].pc = pc;
+		memcpy(list[*n].caps, caps, sizeof(list[*n].caps));
+		(*n)++;
+		break;
+	}
+}
+
+/*
+ * Matches the whole name and returns the offsets of the groups in caps, -1
+ * for a group which did not take part. Returns -1 if there is no match.
+ */
+static int rwrap_re_match(const struct rwrap_re *re,
+			  const char *name,
+			  size_t len,
+			  int16_t caps[2 * (RWRAP_RE_MAX_GROUPS + 1)])
+{
+	struct rwrap_re_scratch *s;
+	struct rwrap_re_vm vm;
+	struct rwrap_re_thread *clist;
+	struct rwrap_re_thread *nlist;
+	struct rwrap_re_thread *tmp;
+	size_t cn = 0;
+	size_t nn;
+	size_t sp;
+	size_t i;
+	int rc = -1;
+
+	s = rwrap_re_scratch(re->len);
+	if (s == NULL) {
+		return -1;
+	}
+
+	/* The generation moves on once more than there are bytes */
+	if (s->gen > UINT32_MAX - len - 2) {
+		memset(s->mark, 0, s->len * sizeof(uint32_t));
+		s->gen = 0;
+	}
+
+	vm.re = re;
+	vm.gen = s->gen + 1;
+	vm.mark = s->mark;
+	clist = s->lists;
+	nlist = clist + s->len;
+
+	for (i = 0; i < 2 * (RWRAP_RE_MAX_GROUPS + 1); i++) {
+		caps[i] = -1;
+	}
+	rwrap_re_add_thread(&vm, clist, &cn, 0, caps, 0);
+
+	for (sp = 0; sp <= len && cn > 0; sp++) {
+		vm.gen++;
+		nn = 0;
+
+		for (i = 0; i < cn; i++) {
+			const struct rwrap_re_inst *inst = &re->prog[clist[i].pc];
+
+			if (inst->op == RWRAP_RE_OP_MATCH) {
+				/* Threads of a lower priority are cut */
+				if (sp == len) {
+					memcpy(caps, clist[i].caps,
+					       sizeof(clist[i].caps));
+					rc = 0;
+					break;
+				}
+				continue;
+			}
+
+			if (sp < len &&
+			    rwrap_re_set_has(&re->sets[inst->x],
+					     (uint8_t)name[sp])) {
+				rwrap_re_add_thread(&vm, nlist, &nn,
+						    clist[i].pc + 1,
+						    clist[i].caps, sp + 1);
+			}
+		}
+
+		tmp = clist;
+		clist = nlist;
+		nlist = tmp;
+		cn = nn;
+	}
+
+	s->gen = vm.gen;
+
+	return rc;
+}
+
+/* The compiled patterns of a database */
+struct rwrap_fake_matcher {
+	struct rwrap_re *re;
+	size_t n;
+
+	/* The DFA, NULL if it got too big. State 0 is dead, 1 the start */
+	uint32_t *next;
+	uint32_t nstates;
+	uint8_t classes[256];
+	uint32_t nclasses;
+
+	/* The patterns a state matches, in file order */
+	uint32_t *accept_off;
+	uint32_t *accept;
+};
+
+static void rwrap_fake_matcher_free(struct rwrap_fake_matcher *m)
+{
+	size_t i;
+
+	if (m == NULL) {
+		return;
+	}
+
+	for (i = 0; i < m->n; i++) {
+		rwrap_re_free(&m->re[i]);
+	}
+	free(m->re);
+	free(m->next);
+	free(m->accept_off);
+	free(m->accept);
+	free(m);
+}
+
+/* The instructions of all patterns are numbered one after another */
+struct rwrap_fake_dfa_builder {
+	struct rwrap_fake_matcher *m;
+	size_t *base; /* of every pattern, and the total */
+	uint32_t *owner; /* the pattern of every instruction */
+
+	uint32_t *mark;
+	uint32_t gen;
+	uint32_t *stack;
+
+	/* The sets of instructions of the states */
+	uint32_t *pcs;
+	size_t npcs;
+	size_t pcs_alloc;
+	uint32_t *state_off;
+	size_t states_alloc; /* rows of the transition table too */
+
+	/* Open addressing over the states, by the hash of their set */
+	uint32_t *index;
+	size_t index_size;
+};
+
+static const struct rwrap_re_inst *rwrap_fake_dfa_inst(
+					struct rwrap_fake_dfa_builder *d,
+					uint32_t gpc)
+{
+	uint32_t i = d->owner[gpc];
+
+	return &d->m->re[i].prog[gpc - d->base[i]];
+}
+
+/*
+ * Adds the instructions which consume a byte or match, reachable from gpc
+ * without consuming one, to the end of the pcs array.
+ */
+static int rwrap_fake_dfa_closure(struct rwrap_fake_dfa_builder *d,
+				  uint32_t gpc)
+{
+	size_t top = 0;
+
+	d->stack[top++] = gpc;
+	while (top > 0) {
+		const struct rwrap_re_inst *inst;
+		uint32_t base;
+
+		gpc = d->stack[--top];
+		if (d->mark[gpc] == d->gen) {
+			continue;
+		}
+		d->mark[gpc] = d->gen;
+
+		inst = rwrap_fake_dfa_inst(d, gpc);
+		base = d->base[d->owner[gpc]];
+
+		switch (inst->op) {
+		case RWRAP_RE_OP_JMP:
+			d->stack[top++] = base + inst->x;
+			break;
+		case RWRAP_RE_OP_SPLIT:
+			d->stack[top++] = base + inst->y;
+			d->stack[top++] = base + inst->x;
+			break;
+		case RWRAP_RE_OP_SAVE:
+			d->stack[top++] = gpc + 1;
+			break;
+		default:
+			if (d->npcs == d->pcs_alloc) {
+				size_t n = d->pcs_alloc * 2;
+				uint32_t *pcs;
+
+				pcs = realloc(d->pcs, n * sizeof(uint32_t));
+				if (pcs == NULL) {
+					return -1;
+				}
+				d->pcs = pcs;
+				d->pcs_alloc = n;
+			}
+			d->pcs[d->npcs++] = gpc;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int rwrap_fake_dfa_pc_cmp(const void *a, const void *b)
+{
+	uint32_t pc1 = *(const uint32_t *)a;
+	uint32_t pc2 = *(const uint32_t *)b;
+
+	return pc1 < pc2 ? -1 : pc1 > pc2;
+}
+
+/*
+ * Turns the set of instructions at the end of the pcs array, from start, into
+ * a state. Returns the existing state with the same set or adds one, 0 for
+ * the empty set and -1 if there are too many states.
+ */
+static int64_t rwrap_fake_dfa_state(struct rwrap_fake_dfa_builder *d,
+				    size_t start)
+{
+	size_t n = d->npcs - start;
+	uint32_t hash = 2166136261U;
+	uint32_t *set = d->pcs + start;
+	uint32_t state;
+	size_t i;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	qsort(set, n, sizeof(uint32_t), rwrap_fake_dfa_pc_cmp);
+	for (i = 0; i < n; i++) {
+		hash = rwrap_fake_type_hash(hash, set[i]);
+	}
+
+	i = hash & (d->index_size - 1);
+	for (; d->index[i] != 0; i = (i + 1) & (d->index_size - 1)) {
+		uint32_t *other;
+
+		state = d->index[i];
+		other = d->pcs + d->state_off[state];
+		if (d->state_off[state + 1] - d->state_off[state] == n &&
+		    memcmp(other, set, n * sizeof(uint32_t)) == 0) {
+			d->npcs = start;
+			return state;
+		}
+	}
+
+	state = d->m->nstates;
+	if (state + 1 >= RWRAP_FAKE_DFA_MAX_STATES) {
+		return -1;
+	}
+
+	if (state == d->states_alloc) {
+		size_t rows = d->states_alloc * 2;
+		size_t ncls = d->m->nclasses;
+		uint32_t *off;
+		uint32_t *next;
+
+		off = realloc(d->state_off, (rows + 1) * sizeof(uint32_t));
+		if (off == NULL) {
+			return -1;
+		}
+		d->state_off = off;
+
+		next = realloc(d->m->next, rows * ncls * sizeof(uint32_t));
+		if (next == NULL) {
+			return -1;
+		}
+		memset(next + d->states_alloc * ncls, 0,
+		       (rows - d->states_alloc) * ncls * sizeof(uint32_t));
+		d->m->next = next;
+		d->states_alloc = rows;
+	}
+
+	d->index[i] = state;
+	d->state_off[state + 1] = d->npcs;
+	d->m->nstates++;
+
+	return state;
+}
+
+/*
+ * Builds the DFA by the subset construction. The bytes which no pattern
+ * tells apart share a class, so the table has a column per class.
+ */
+static int rwrap_fake_dfa_build(struct rwrap_fake_matcher *m)
+{
+	struct rwrap_fake_dfa_builder d;
+	uint8_t rep[256];
+	size_t total = 0;
+	size_t i;
+	size_t j;
+	uint32_t s;
+	int64_t next;
+	int rc = -1;
+
+	memset(&d, 0, sizeof(d));
+	d.m = m;
+
+	/* Refines the byte classes by every set of every pattern */
+	memset(m->classes, 0, sizeof(m->classes));
+	m->nclasses = 1;
+	for (i = 0; i < m->n; i++) {
+		for (j = 0; j < m->re[i].nsets; j++) {
+			int16_t ids[256][2];
+			uint8_t classes[256];
+			uint32_t n = 0;
+			unsigned int c;
+
+			memset(ids, 0xff, sizeof(ids));
+			for (c = 0; c < 256; c++) {
+				int in = rwrap_re_set_has(&m->re[i].sets[j], c);
+				int16_t *id = &ids[m->classes[c]][in];
+
+				if (*id < 0) {
+					*id = n++;
+				}
+				classes[c] = *id;
+			}
+			memcpy(m->classes, classes, sizeof(classes));
+			m->nclasses = n;
+		}
+	}
+	for (i = 0; i < 256; i++) {
+		rep[m->classes[255 - i]] = 255 - i;
+	}
+
+	d.base = calloc(m->n + 1, sizeof(size_t));
+	if (d.base == NULL) {
+		goto done;
+	}
+	for (i = 0; i < m->n; i++) {
+		d.base[i] = total;
+		total += m->re[i].len;
+	}
+	d.base[m->n] = total;
+
+	d.owner = calloc(total, sizeof(uint32_t));
+	d.mark = calloc(total, sizeof(uint32_t));
+	d.stack = calloc(2 * total, sizeof(uint32_t));
+	d.pcs_alloc = total;
+	d.pcs = calloc(d.pcs_alloc, sizeof(uint32_t));
+	d.states_alloc = 64;
+	d.state_off = calloc(d.states_alloc + 1, sizeof(uint32_t));
+	d.index_size = 2 * RWRAP_FAKE_DFA_MAX_STATES;
+	d.index = calloc(d.index_size, sizeof(uint32_t));
+	m->next = calloc(d.states_alloc * m->nclasses, sizeof(uint32_t));
+	if (d.owner == NULL || d.mark == NULL || d.stack == NULL ||
+	    d.pcs == NULL || d.state_off == NULL || d.index == NULL ||
+	    m->next == NULL) {
+		goto done;
+	}
+	for (i = 0; i < m->n; i++) {
+		for (j = d.base[i]; j < d.base[i + 1]; j++) {
+			d.owner[j] = i;
+		}
+	}
+
+	/* The dead state has no instructions, the start all the first ones */
+	m->nstates = 1;
+	d.gen++;
+	for (i = 0; i < m->n; i++) {
+		if (rwrap_fake_dfa_closure(&d, d.base[i]) != 0) {
+			goto done;
+		}
+	}
+	if (rwrap_fake_dfa_state(&d, 0) != 1) {
+		goto done;
+	}
+
+	for (s = 1; s < m->nstates; s++) {
+		for (j = 0; j < m->nclasses; j++) {
+			size_t start = d.npcs;
+
+			d.gen++;
+			for (i = d.state_off[s]; i < d.state_off[s + 1]; i++) {
+				uint32_t gpc = d.pcs[i];
+				const struct rwrap_re_inst *inst;
+				const struct rwrap_re_set *set;
+
+				inst = rwrap_fake_dfa_inst(&d, gpc);
+				if (inst->op != RWRAP_RE_OP_SET) {
+					continue;
+				}
+				set = &m->re[d.owner[gpc]].sets[inst->x];
+				if (rwrap_re_set_has(set, rep[j]) &&
+				    rwrap_fake_dfa_closure(&d, gpc + 1) != 0) {
+					goto done;
+				}
+			}
+
+			next = rwrap_fake_dfa_state(&d, start);
+			if (next < 0) {
+				goto done;
+			}
+			m->next[(size_t)s * m->nclasses + j] = next;
+		}
+	}
+
+	/* The patterns which match in a state, counted first */
+	m->accept_off = calloc(m->nstates + 1, sizeof(uint32_t));
+	if (m->accept_off == NULL) {
+		goto done;
+	}
+	for (i = 0, j = 0; i < d.npcs; i++) {
+		if (rwrap_fake_dfa_inst(&d, d.pcs[i])->op == RWRAP_RE_OP_MATCH) {
+			j++;
+		}
+	}
+	m->accept = calloc(j + 1, sizeof(uint32_t));
+	if (m->accept == NULL) {
+		goto done;
+	}
+	for (s = 0, j = 0; s < m->nstates; s++) {
+		m->accept_off[s] = j;
+		for (i = d.state_off[s]; i < d.state_off[s + 1]; i++) {
+			uint32_t gpc = d.pcs[i];
+
+			if (rwrap_fake_dfa_inst(&d, gpc)->op ==
+			    RWRAP_RE_OP_MATCH) {
+				m->accept[j++] = d.owner[gpc];
+			}
+		}
+	}
+	m->accept_off[m->nstates] = j;
+
+	rc = 0;
+done:
+	if (rc != 0) {
+		SAFE_FREE(m->next);
+		SAFE_FREE(m->accept_off);
+		SAFE_FREE(m->accept);
+		m->nstates = 0;
+	}
+	free(d.base);
+	free(d.owner);
+	free(d.mark);
+	free(d.stack);
+	free(d.pcs);
+	free(d.state_off);
+	free(d.index);
+
+	return rc;
+}
+
+/*
+ * Writes the value of a pattern record with $1 to $9 replaced by the groups
+ * of the name in caps. Returns its length or -1 if it does not fit.
+ */
+static ssize_t rwrap_fake_pattern_expand(const char *value,
+					 size_t value_len,
+					 const char *name,
+					 const int16_t *caps,
+					 char *buf,
+					 size_t size)
+{
+	size_t n = 0;
+	size_t i;
+
+	for (i = 0; i < value_len; i++) {
+		const char *s = &value[i];
+		size_t len = 1;
+
+		if (value[i] == '$' && i + 1 < value_len &&
+		    value[i + 1] >= '1' && value[i + 1] <= '9') {
+			int g = value[++i] - '0';
+
+			len = 0;
+			if (caps[2 * g] >= 0 && caps[2 * g + 1] >= caps[2 * g]) {
+				s = name + caps[2 * g];
+				len = caps[2 * g + 1] - caps[2 * g];
+			}
+		}
+
+		if (n + len > size) {
+			return -1;
+		}
+		memcpy(buf + n, s, len);
+		n += len;
+	}
+
+	return n;
+}
+
+static void rwrap_fake_builder_free(struct rwrap_fake_builder *b)
+{
+	free(b->slots);
+	free(b->names);
+	free(b->intern);
+	free(b->records);
+	free(b->patterns);
+	free(b->ptrs);
+	free(b->data);
+}
+
+/* Appends len bytes to the data blob and returns their offset in *off */
+static int rwrap_fake_builder_data(struct rwrap_fake_builder *b,
+				   const void *p,
+				   size_t len,
+				   uint32_t *off)
+{
+	if (b->data_len + len > b->data_alloc) {
+		size_t n = b->data_alloc == 0 ? BUFSIZ : b->data_alloc;
+		char *data;
+
+		while (b->data_len + len > n) {
+			n *= 2;
+		}
+		if (n > UINT32_MAX) {
+			return -1;
+		}
+
+		data = realloc(b->data, n);
+		if (data == NULL) {
+			return -1;
+		}
+		b->data = data;
+		b->data_alloc = n;
+	}
+
+	memcpy(b->data + b->data_len, p, len);
+	*off = b->data_len;
+	b->data_len += len;
+
+	return 0;
+}
+
+static void rwrap_wire_tolower(uint8_t *wire)
+{
+	uint8_t i;
+
+	for (; *wire != 0; wire += *wire + 1) {
+		for (i = 1; i <= *wire; i++) {
+			wire[i] = RWRAP_TOLOWER(wire[i]);
+		}
+	}
+}
+
+static uint32_t rwrap_fake_intern_hash(const uint8_t *label, uint32_t parent)
+{
+	return rwrap_fake_type_hash(rwrap_fake_name_hash((const char *)label,
+							 label[0] + 1),
+				    parent);
+}
+
+static int rwrap_fake_builder_intern_grow(struct rwrap_fake_builder *b)
+{
+	size_t size = b->intern_size == 0 ?
+		      RWRAP_FAKE_DB_MIN_BUCKETS : b->intern_size * 2;
+	uint32_t *intern;
+	size_t id;
+	size_t i;
+
+	intern = calloc(size, sizeof(uint32_t));
+	if (intern == NULL) {
+		return -1;
+	}
+
+	for (id = 1; id < b->nnames; id++) {
+		const uint8_t *label =
+			(const uint8_t *)b->data + b->names[id].label;
+
+		i = rwrap_fake_intern_hash(label, b->names[id].parent);
+		for (i &= size - 1; intern[i] != 0; i = (i + 1) & (size - 1));
+		intern[i] = id + 1;
+	}
+
+	free(b->intern);
+	b->intern = intern;
+	b->intern_size = size;
+
+	return 0;
+}
+
+/*
+ * Returns the id of the name made of the label and the parent in *id, the
+ * name is added if it is new. The label starts the whole name of len bytes
+ * in wire format, which is only hashed for a new name.
+ */
+static int rwrap_fake_builder_intern(struct rwrap_fake_builder *b,
+				     const uint8_t *label,
+				     uint32_t parent,
+				     size_t len,
+				     uint32_t *id)
+{
+	struct rwrap_fake_name *name;
+	size_t i;
+	int rc;
+
+	if (2 * (b->nnames + 1) > b->intern_size) {
+		rc = rwrap_fake_builder_intern_grow(b);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
+	i = rwrap_fake_intern_hash(label, parent) & (b->intern_size - 1);
+	for (; b->intern[i] != 0; i = (i + 1) & (b->intern_size - 1)) {
+		name = &b->names[b->intern[i] - 1];
+		if (name->parent == parent &&
+		    memcmp(b->data + name->label, label, label[0] + 1) == 0) {
+			*id = b->intern[i] - 1;
+			return 0;
+		}
+	}
+
+	if (b->nnames == b->names_alloc) {
+		size_t n = b->names_alloc * 2;
+		struct rwrap_fake_slot *slots;
+
+		slots = realloc(b->slots, n * sizeof(struct rwrap_fake_slot));
+		if (slots == NULL) {
+			return -1;
+		}
+		b->slots = slots;
+
+		name = realloc(b->names, n * sizeof(struct rwrap_fake_name));
+		if (name == NULL) {
+			return -1;
+		}
+		b->names = name;
+		b->names_alloc = n;
+	}
+
+	name = &b->names[b->nnames];
+	memset(name, 0, sizeof(struct rwrap_fake_name));
+	name->parent = parent;
+	name->len = len;
+
+	rc = rwrap_fake_builder_data(b, label, label[0] + 1, &name->label);
+	if (rc != 0) {
+		return rc;
+	}
+
+	b->slots[b->nnames].hash = rwrap_fake_name_hash((const char *)label,
+							len);
+	b->slots[b->nnames].next = 0;
+
+	*id = b->nnames;
+	b->intern[i] = ++b->nnames;
+
+	return 0;
+}
+
+/* Interns a lower-cased name in wire format and all its parents */
+static int rwrap_fake_builder_name(struct rwrap_fake_builder *b,
+				   const uint8_t *wire,
+				   uint32_t *id)
+{
+	const uint8_t *labels[NS_MAXCDNAME / 2];
+	size_t nlabels = 0;
+	const uint8_t *p;
+	size_t len;
+	int rc;
+
+	for (p = wire; *p != 0; p += *p + 1) {
+		labels[nlabels++] = p;
+	}
+	len = p - wire + 1;
+
+	*id = RWRAP_FAKE_NAME_ROOT;
+	while (nlabels > 0) {
+		p = labels[--nlabels];
+		rc = rwrap_fake_builder_intern(b, p, *id, len - (p - wire), id);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+/* Sets up the root name and the empty data at offset 0 */
+static int rwrap_fake_builder_init(struct rwrap_fake_builder *b)
+{
+	uint32_t off;
+	int rc;
+
+	memset(b, 0, sizeof(struct rwrap_fake_builder));
+
+	b->names_alloc = RWRAP_FAKE_DB_MIN_BUCKETS;
+	b->slots = calloc(b->names_alloc, sizeof(struct rwrap_fake_slot));
+	b->names = calloc(b->names_alloc, sizeof(struct rwrap_fake_name));
+	if (b->slots == NULL || b->names == NULL) {
+		return -1;
+	}
+
+	rc = rwrap_fake_builder_data(b, "", 1, &off);
+	if (rc != 0) {
+		return rc;
+	}
+
+	b->names[RWRAP_FAKE_NAME_ROOT].label = off;
+	b->names[RWRAP_FAKE_NAME_ROOT].len = 1;
+	b->nnames = 1;
+
+	return 0;
+}
+
+/* Orders the reverse index by the address length and then the address */
+static int rwrap_fake_ptr_cmp(const struct rwrap_fake_ptr *a,
+			      const struct rwrap_fake_ptr *b)
+{
+	if (a->len != b->len) {
+		return a->len < b->len ? -1 : 1;
+	}
+
+	return memcmp(a->addr, b->addr, a->len);
+}
+
+/* Whether the rest of a name in wire format is zone, of size bytes */
+static bool rwrap_wire_is(const uint8_t *wire, const uint8_t *zone, size_t size)
+{
+	const uint8_t *p;
+
+	for (p = wire; *p != 0; p += *p + 1) {
+		;
+	}
+
+	return (size_t)(p - wire + 1) == size && memcmp(wire, zone, size) == 0;
+}
+
+/*
+ * Reads the address of a reverse lookup from a lower-cased name in wire
+ * format, like 4.3.2.1.in-addr.arpa or the 32 nibbles of an IPv6 address
+ * under ip6.arpa. Returns -1 for other names.
+ */
+static int rwrap_fake_ptr_addr(const uint8_t *wire, struct rwrap_fake_ptr *ptr)
+{
+	static const uint8_t in_addr_arpa[] = "\7in-addr\4arpa";
+	static const uint8_t ip6_arpa[] = "\3ip6\4arpa";
+	const uint8_t *p;
+	unsigned int val;
+	size_t i;
+	uint8_t j;
+
+	memset(ptr, 0, sizeof(struct rwrap_fake_ptr));
+
+	for (p = wire, i = 0; i < 4 && *p >= 1 && *p <= 3; i++) {
+		for (j = 1, val = 0; j <= *p && isdigit((int)p[j]); j++) {
+			val = val * 10 + p[j] - '0';
+		}
+		if (j <= *p || val > UINT8_MAX) {
+			break;
+		}
+		ptr->addr[3 - i] = val;
+		p += *p + 1;
+	}
+	if (i == 4 && rwrap_wire_is(p, in_addr_arpa, sizeof(in_addr_arpa))) {
+		ptr->len = sizeof(struct in_addr);
+		return 0;
+	}
+
+	memset(ptr->addr, 0, sizeof(ptr->addr));
+	for (p = wire, i = 0; i < 32 && p[0] == 1 && isxdigit((int)p[1]); i++) {
+		val = isdigit((int)p[1]) ? p[1] - '0' : p[1] - 'a' + 10;
+		ptr->addr[15 - i / 2] |= val << (i % 2 * 4);
+		p += 2;
+	}
+	if (i == 32 && rwrap_wire_is(p, ip6_arpa, sizeof(ip6_arpa))) {
+		ptr->len = sizeof(struct in6_addr);
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Adds a PTR record of the reverse index, the target is lower-cased */
+static int rwrap_fake_builder_ptr(struct rwrap_fake_builder *b,
+				  const struct rwrap_fake_ptr *key,
+				  const uint8_t *target)
+{
+	struct rwrap_fake_ptr *ptr;
+
+	if (b->nptrs == b->ptrs_alloc) {
+		size_t n = b->ptrs_alloc == 0 ? 8 : b->ptrs_alloc * 2;
+
+		ptr = realloc(b->ptrs, n * sizeof(struct rwrap_fake_ptr));
+		if (ptr == NULL) {
+			return -1;
+		}
+		b->ptrs = ptr;
+		b->ptrs_alloc = n;
+	}
+
+	ptr = &b->ptrs[b->nptrs];
+	*ptr = *key;
+
+	b->nptrs++;
+
+	return rwrap_fake_builder_name(b, target, &ptr->target);
+}
+
+/*
+ * Adds a record owned by a lower-cased name in wire format. The targets of
+ * CNAME, SRV and PTR records in the RDATA have to be lower-cased too.
+ */
+static int rwrap_fake_builder_add(struct rwrap_fake_builder *b,
+				  int type,
+				  const uint8_t *owner,
+				  const uint8_t *rdata,
+				  size_t len)
+{
+	const struct rwrap_rr_type *t = rwrap_rr_type_get(type);
+	struct rwrap_fake_record *rec;
+	struct rwrap_fake_ptr ptr;
+	size_t rdlen = len;
+	int rc;
+
+	/* Reverse lookups have an index of their own */
+	if (type == ns_t_ptr && rwrap_fake_ptr_addr(owner, &ptr) == 0) {
+		return rwrap_fake_builder_ptr(b, &ptr, rdata);
+	}
+
+	if (b->nrecords == b->records_alloc) {
+		size_t nrec = b->records_alloc == 0 ?
+			      RWRAP_FAKE_DB_MIN_BUCKETS : b->records_alloc * 2;
+
+		rec = realloc(b->records,
+			      nrec * sizeof(struct rwrap_fake_record));
+		if (rec == NULL) {
+			return -1;
+		}
+		b->records = rec;
+		b->records_alloc = nrec;
+	}
+
+	rec = &b->records[b->nrecords];
+	memset(rec, 0, sizeof(struct rwrap_fake_record));
+	rec->type = type;
+
+	rc = rwrap_fake_builder_name(b, owner, &rec->name);
+	if (rc != 0) {
+		return rc;
+	}
+
+	/* The targets are interned, the rest of the RDATA is stored */
+	if (t->target >= 0) {
+		rdlen = t->target;
+	}
+	if (rdlen != len) {
+		rc = rwrap_fake_builder_name(b, rdata + rdlen, &rec->target);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
+	if (rwrap_fake_type_packed(type)) {
+		uint8_t hdr[RWRAP_FAKE_RR_HDR];
+		uint8_t *p = hdr;
+		uint32_t off;
+
+		NS_PUT16(RWRAP_FAKE_RR_QNAME, p);
+		NS_PUT16(type, p);
+		NS_PUT16(ns_c_in, p);
+		NS_PUT32(RWRAP_DEFAULT_FAKE_TTL, p);
+		NS_PUT16(rdlen, p);
+
+		rc = rwrap_fake_builder_data(b, hdr, sizeof(hdr), &off);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
+	rec->rdlen = rdlen;
+	rc = rwrap_fake_builder_data(b, rdata, rdlen, &rec->rdata);
+	if (rc != 0) {
+		return rc;
+	}
+
+	b->nrecords++;
+
+	return 0;
+}
+
+/* Adds a pattern record packed by rwrap_fake_parse_pattern() */
+static int rwrap_fake_builder_pattern(struct rwrap_fake_builder *b,
+				      int type,
+				      const uint8_t *rdata,
+				      size_t len)
+{
+	struct rwrap_fake_pattern *pat;
+	uint16_t source_len;
+	int rc;
+
+	if (b->npatterns == b->patterns_alloc) {
+		size_t n = b->patterns_alloc == 0 ? 8 : b->patterns_alloc * 2;
+
+		pat = realloc(b->patterns, n * sizeof(struct rwrap_fake_pattern));
+		if (pat == NULL) {
+			return -1;
+		}
+		b->patterns = pat;
+		b->patterns_alloc = n;
+	}
+
+	pat = &b->patterns[b->npatterns];
+	memset(pat, 0, sizeof(struct rwrap_fake_pattern));
+	pat->type = type;
+
+	NS_GET16(source_len, rdata);
+	pat->source_len = source_len;
+	pat->value_len = len - NS_INT16SZ - source_len;
+
+	rc = rwrap_fake_builder_data(b, rdata, source_len, &pat->source);
+	if (rc != 0) {
+		return rc;
+	}
+	rc = rwrap_fake_builder_data(b, rdata + source_len, pat->value_len,
+				     &pat->value);
+	if (rc != 0) {
+		return rc;
+	}
+
+	b->npatterns++;
+
+	return 0;
+}
+
+/*
+ * Checks a pattern record and packs it into the RDATA: the length of the
+ * pattern, the lower-cased pattern and the value as it is in the file.
+ */
+static int rwrap_fake_parse_pattern(int type,
+				    const char *source,
+				    size_t source_len,
+				    const char *value,
+				    size_t value_len,
+				    struct rwrap_fake_rdata *rd)
+{
+	int16_t caps[2 * (RWRAP_RE_MAX_GROUPS + 1)];
+	struct rwrap_fake_rdata check;
+	struct rwrap_re re;
+	char buf[MAXDNAME];
+	uint8_t *p = rd->data;
+	ssize_t n;
+	size_t i;
+
+	while (value_len > 0 && isspace((int)value[value_len - 1])) {
+		value_len--;
+	}
+
+	if (NS_INT16SZ + source_len + value_len > sizeof(rd->data)) {
+		RWRAP_LOG(RWRAP_LOG_WARN,
+			  "Pattern record [%.*s] too long\n",
+			  (int)source_len, source);
+		return -1;
+	}
+
+	NS_PUT16(source_len, p);
+	rwrap_fold_name((char *)p, source, source_len);
+
+	if (rwrap_re_compile(&re, (const char *)p, source_len) != 0) {
+		RWRAP_LOG(RWRAP_LOG_WARN,
+			  "Malformed pattern [%.*s]\n",
+			  (int)source_len, source);
+		return -1;
+	}
+	rwrap_re_free(&re);
+
+	/* The value has to be valid when every group matched "0" */
+	for (i = 0; i < 2 * (RWRAP_RE_MAX_GROUPS + 1); i += 2) {
+		caps[i] = 0;
+		caps[i + 1] = 1;
+	}
+	n = rwrap_fake_pattern_expand(value, value_len, "0", caps,
+				      buf, sizeof(buf));
+	if (n < 0 || rwrap_fake_rdata_parse(type, buf, n, &check) != 0) {
+		RWRAP_LOG(RWRAP_LOG_WARN,
+			  "Malformed value of pattern [%.*s]\n",
+			  (int)source_len, source);
+		return -1;
+	}
+
+	memcpy(p + source_len, value, value_len);
+	rd->len = NS_INT16SZ + source_len + value_len;
+
+	return 0;
+}
+
+/*
+ * Parses the line [p, eol) into the type, the lower-cased owner in wire
+ * format and the RDATA. Returns the length of the owner, 0 for a pattern
+ * record packed by rwrap_fake_parse_pattern(), or -1 if the line is
+ * skipped.
+ */
+static ssize_t rwrap_fake_parse_line(const char *p,
+				     const char *eol,
+				     int *type,
+				     uint8_t owner[NS_MAXCDNAME],
+				     struct rwrap_fake_rdata *rd)
+{
+	const struct rwrap_rr_type *t;
+	char name[MAXDNAME];
+	const char *rec_type;
+	const char *key;
+	const char *value;
+	size_t rec_type_len;
+	size_t key_len;
+	size_t value_len;
+	ssize_t n;
+	int rc;
+
+	rec_type = rwrap_next_token(&p, eol, &rec_type_len);
+	key = rwrap_next_token(&p, eol, &key_len);
+	value = p;
+	value_len = eol - p;
+
+	if (key_len == 0 || value == key + key_len) {
+		RWRAP_LOG(RWRAP_LOG_WARN,
+			"Malformed line: not enough parts, use \"rec_type key data\n"
+			"For example \"A cwrap.org 10.10.10.10\"");
+		return -1;
+	}
+
+	if (key_len >= MAXDNAME) {
+		RWRAP_LOG(RWRAP_LOG_WARN,
+			  "Record name [%.*s] too long\n",
+			  (int)key_len, key);
+		return -1;
+	}
+
+	*type = rwrap_fake_type(rec_type, rec_type_len);
+	if (*type == ns_t_invalid) {
+		RWRAP_LOG(RWRAP_LOG_WARN,
+			  "Unknown record type [%.*s]\n",
+			  (int)rec_type_len, rec_type);
+		return -1;
+	}
+
+	if (key[0] == '~') {
+		rc = rwrap_fake_parse_pattern(*type, key + 1, key_len - 1,
+					      value, value_len, rd);
+		return rc == 0 ? 0 : -1;
+	}
+
+	rc = rwrap_fake_rdata_parse(*type, value, value_len, rd);
+	if (rc != 0) {
+		return -1;
+	}
+
+	memcpy(name, key, key_len);
+	name[key_len] = '\0';
+
+	n = rwrap_fake_key_wire(name, key_len, owner);
+	if (n < 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Failed to compress [%s]\n", name);
+		return -1;
+	}
+	rwrap_wire_tolower(owner);
+
+	t = rwrap_rr_type_get(*type);
+	if (t->target >= 0) {
+		rwrap_wire_tolower(rd->data + t->target);
+	}
+
+	return n;
+}
+
+/*
+ * A part of a big hosts file which is parsed by a thread of its own. The
+ * lines are parsed into entries of the type, the length of the owner and
+ * the length of the RDATA, followed by the owner and the RDATA.
+ */
+struct rwrap_fake_chunk {
+	const char *text;
+	size_t text_len;
+
+	uint8_t *entries;
+	size_t len;
+	size_t alloc;
+
+	pthread_t thread;
+	bool started;
+	int rc;
+};
+
+#define RWRAP_FAKE_ENTRY_HDR (3 * NS_INT16SZ)
+
+static int rwrap_fake_chunk_put(struct rwrap_fake_chunk *c,
+				int type,
+				const uint8_t *owner,
+				size_t owner_len,
+				const struct rwrap_fake_rdata *rd)
+{
+	size_t len = RWRAP_FAKE_ENTRY_HDR + owner_len + rd->len;
+	uint8_t *p;
+
+	if (c->len + len > c->alloc) {
+		size_t n = c->alloc == 0 ? BUFSIZ : c->alloc;
+
+		while (c->len + len > n) {
+			n *= 2;
+		}
+
+		p = realloc(c->entries, n);
+		if (p == NULL) {
+			return -1;
+		}
+		c->entries = p;
+		c->alloc = n;
+	}
+
+	p = c->entries + c->len;
+	NS_PUT16(type, p);
+	NS_PUT16(owner_len, p);
+	NS_PUT16(rd->len, p);
+	memcpy(p, owner, owner_len);
+	memcpy(p + owner_len, rd->data, rd->len);
+	c->len += len;
+
+	return 0;
+}
+
+static void *rwrap_fake_chunk_parse(void *arg)
+{
+	struct rwrap_fake_chunk *c = (struct rwrap_fake_chunk *)arg;
+	const char *p = c->text;
+	const char *end = c->text + c->text_len;
+
+	while (p < end && c->rc == 0) {
+		struct rwrap_fake_rdata rd;
+		uint8_t owner[NS_MAXCDNAME];
+		const char *eol;
+		ssize_t n;
+		int type;
+
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		n = rwrap_fake_parse_line(p, eol, &type, owner, &rd);
+		p = eol + 1;
+		if (n < 0) {
+			/* Malformed entries are skipped */
+			continue;
+		}
+
+		c->rc = rwrap_fake_chunk_put(c, type, owner, n, &rd);
+	}
+
+	return NULL;
+}
+
+/* Returns the number of threads a hosts file of len bytes is parsed by */
+static size_t rwrap_fake_load_threads(size_t len)
+{
+	size_t threads = rwrap_config_get()->hosts_load_threads;
+	size_t max = len / RWRAP_FAKE_LOAD_CHUNK_MIN;
+
+	if (threads == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = n > 0 ? MIN((size_t)n, RWRAP_FAKE_LOAD_MAX_THREADS) : 1;
+	}
+
+	return max > 1 ? MIN(threads, max) : 1;
+}
+
+/*
+ * Splits the text at line boundaries into chunks which are parsed in
+ * parallel. The interning is not thread safe, so the entries are added to
+ * the builder here, in the order of the file.
+ */
+static int rwrap_fake_builder_parse_chunks(struct rwrap_fake_builder *b,
+					   const char *text,
+					   size_t text_len,
+					   size_t nchunks)
+{
+	struct rwrap_fake_chunk *chunks;
+	const char *end = text + text_len;
+	const char *p = text;
+	size_t i;
+	int rc = 0;
+
+	chunks = calloc(nchunks, sizeof(struct rwrap_fake_chunk));
+	if (chunks == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < nchunks; i++) {
+		const char *next = end;
+
+		if (i + 1 < nchunks) {
+			next = text + (i + 1) * (text_len / nchunks);
+			if (next < p) {
+				next = p;
+			}
+			next = memchr(next, '\n', end - next);
+			next = next == NULL ? end : next + 1;
+		}
+
+		chunks[i].text = p;
+		chunks[i].text_len = next - p;
+		p = next;
+	}
+
+	/* The first chunk is parsed by this thread */
+	for (i = 1; i < nchunks; i++) {
+		chunks[i].started = pthread_create(&chunks[i].thread,
+						   NULL,
+						   rwrap_fake_chunk_parse,
+						   &chunks[i]) == 0;
+	}
+	rwrap_fake_chunk_parse(&chunks[0]);
+
+	for (i = 0; i < nchunks; i++) {
+		struct rwrap_fake_chunk *c = &chunks[i];
+		const uint8_t *e = c->entries;
+
+		if (c->started) {
+			pthread_join(c->thread, NULL);
+		} else if (i > 0) {
+			rwrap_fake_chunk_parse(c);
+		}
+		if (rc == 0) {
+			rc = c->rc;
+		}
+
+		while (rc == 0 && e < c->entries + c->len) {
+			uint16_t type;
+			uint16_t owner_len;
+			uint16_t rdlen;
+
+			NS_GET16(type, e);
+			NS_GET16(owner_len, e);
+			NS_GET16(rdlen, e);
+
+			if (owner_len == 0) {
+				rc = rwrap_fake_builder_pattern(b, type,
+								e, rdlen);
+			} else {
+				rc = rwrap_fake_builder_add(b, type, e,
+							    e + owner_len,
+							    rdlen);
+			}
+			e += owner_len + rdlen;
+		}
+
+		free(c->entries);
+	}
+	free(chunks);
+
+	return rc;
+}
+
+/* Parses a hosts file in the text format into the builder */
+static int rwrap_fake_builder_parse(struct rwrap_fake_builder *b,
+				    const char *text,
+				    size_t text_len)
+{
+	const char *p = text;
+	const char *end = text + text_len;
+	size_t nchunks;
+	int rc;
+
+	rc = rwrap_fake_builder_init(b);
+	if (rc != 0) {
+		return rc;
+	}
+
+	nchunks = rwrap_fake_load_threads(text_len);
+	if (nchunks > 1) {
+		RWRAP_LOG(RWRAP_LOG_TRACE,
+			  "Parsing %zu bytes in %zu chunks\n",
+			  text_len, nchunks);
+		rc = rwrap_fake_builder_parse_chunks(b, text, text_len, nchunks);
+		if (rc != 0) {
+			RWRAP_LOG(RWRAP_LOG_ERROR,
+				  "Failed to build the fake hosts index\n");
+		}
+		return rc;
+	}
+
+	while (p < end) {
+		struct rwrap_fake_rdata rd;
+		uint8_t owner[NS_MAXCDNAME];
+		const char *eol;
+		ssize_t n;
+		int type;
+
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		n = rwrap_fake_parse_line(p, eol, &type, owner, &rd);
+		p = eol + 1;
+		if (n < 0) {
+			/* Malformed entries are skipped */
+			continue;
+		}
+
+		if (n == 0) {
+			rc = rwrap_fake_builder_pattern(b, type,
+							rd.data, rd.len);
+		} else {
+			rc = rwrap_fake_builder_add(b, type, owner,
+						    rd.data, rd.len);
+		}
+		if (rc != 0) {
+			RWRAP_LOG(RWRAP_LOG_ERROR,
+				  "Failed to add a record to the fake hosts "
+				  "index\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+struct rwrap_fake_mph_owner {
+	uint32_t hash;
+	uint32_t id;
+};
+
+/* A perfect hash over the distinct hashes of the names owning records */
+struct rwrap_fake_mph {
+	struct rwrap_fake_mph_owner *owners; /* sorted by hash and id */
+	uint32_t nowners;
+	uint32_t nhashes;
+
+	uint32_t *disp;
+	uint32_t ndisp;
+	uint32_t *bucket; /* of each distinct hash */
+};
+
+static void rwrap_fake_mph_free(struct rwrap_fake_mph *mph)
+{
+	free(mph->owners);
+	free(mph->disp);
+	free(mph->bucket);
+	memset(mph, 0, sizeof(struct rwrap_fake_mph));
+}
+
+/*
+ * Builds a minimal perfect hash over nhashes distinct hashes, in the way of
+ * CHD: the hashes are grouped by their displacement and the biggest groups
+ * are placed first, trying one seed after the other until all hashes of a
+ * group land in free buckets. Groups of one hash take the remaining buckets
+ * directly.
+ */
+static int rwrap_fake_mph_build(struct rwrap_fake_mph *mph,
+				const uint32_t *hashes,
+				uint32_t nhashes)
+{
+	uint32_t ndisp = (nhashes + RWRAP_FAKE_MPH_HASHES_PER_DISP - 1) /
+			 RWRAP_FAKE_MPH_HASHES_PER_DISP;
+	uint32_t *start = NULL;
+	uint32_t *fill = NULL;
+	uint32_t *order = NULL;
+	uint32_t *groups = NULL;
+	uint32_t *nsize = NULL;
+	uint8_t *taken = NULL;
+	uint32_t max_size = 0;
+	uint32_t free_bucket = 0;
+	uint32_t i;
+	uint32_t j;
+	int rc = -1;
+
+	mph->disp = calloc(ndisp, sizeof(uint32_t));
+	mph->bucket = calloc(nhashes, sizeof(uint32_t));
+	start = calloc(ndisp + 1, sizeof(uint32_t));
+	fill = calloc(ndisp, sizeof(uint32_t));
+	order = calloc(nhashes, sizeof(uint32_t));
+	groups = calloc(ndisp, sizeof(uint32_t));
+	taken = calloc(nhashes, sizeof(uint8_t));
+	if (mph->disp == NULL || mph->bucket == NULL || start == NULL ||
+	    fill == NULL || order == NULL || groups == NULL || taken == NULL) {
+		goto done;
+	}
+
+	/* Counting sort of the hashes by displacement */
+	for (i = 0; i < nhashes; i++) {
+		start[rwrap_fake_mph_disp(hashes[i], ndisp) + 1]++;
+	}
+	for (i = 0; i < ndisp; i++) {
+		if (start[i + 1] > max_size) {
+			max_size = start[i + 1];
+		}
+		start[i + 1] += start[i];
+	}
+	for (i = 0; i < nhashes; i++) {
+		uint32_t g = rwrap_fake_mph_disp(hashes[i], ndisp);
+
+		order[start[g] + fill[g]++] = i;
+	}
+
+	/* And of the displacements by the size of their group, biggest first */
+	nsize = calloc(max_size + 2, sizeof(uint32_t));
+	if (nsize == NULL) {
+		goto done;
+	}
+	for (i = 0; i < ndisp; i++) {
+		nsize[max_size - (start[i + 1] - start[i]) + 1]++;
+	}
+	for (i = 0; i <= max_size; i++) {
+		nsize[i + 1] += nsize[i];
+	}
+	for (i = 0; i < ndisp; i++) {
+		groups[nsize[max_size - (start[i + 1] - start[i])]++] = i;
+	}
+
+	for (i = 0; i < ndisp; i++) {
+		uint32_t g = groups[i];
+		const uint32_t *group = &order[start[g]];
+		uint32_t size = start[g + 1] - start[g];
+		uint32_t d;
+
+		if (size == 0) {
+			break;
+		}
+
+		if (size == 1) {
+			while (taken[free_bucket]) {
+				free_bucket++;
+			}
+			taken[free_bucket] = 1;
+			mph->bucket[group[0]] = free_bucket;
+			mph->disp[g] = RWRAP_FAKE_MPH_DIRECT | free_bucket;
+			continue;
+		}
+
+		for (d = 0; d < RWRAP_FAKE_MPH_MAX_TRIES; d++) {
+			for (j = 0; j < size; j++) {
+				uint32_t b = rwrap_fake_mph_bucket(
+						hashes[group[j]], d, nhashes);
+
+				if (taken[b]) {
+					break;
+				}
+				taken[b] = 1;
+				mph->bucket[group[j]] = b;
+			}
+			if (j == size) {
+				break;
+			}
+			while (j-- > 0) {
+				taken[mph->bucket[group[j]]] = 0;
+			}
+		}
+		if (d == RWRAP_FAKE_MPH_MAX_TRIES) {
+			goto done;
+		}
+		mph->disp[g] = d;
+	}
+
+	mph->ndisp = ndisp;
+	rc = 0;
+done:
+	free(start);
+	free(fill);
+	free(order);
+	free(groups);
+	free(nsize);
+	free(taken);
+
+	return rc;
+}
+
+static int rwrap_fake_mph_owner_cmp(const void *a, const void *b)
+{
+	const struct rwrap_fake_mph_owner *o1 = a;
+	const struct rwrap_fake_mph_owner *o2 = b;
+
+	if (o1->hash != o2->hash) {
+		return o1->hash < o2->hash ? -1 : 1;
+	}
+	if (o1->id != o2->id) {
+		return o1->id < o2->id ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/* Builds the perfect hash over the names which exist */
+static int rwrap_fake_builder_mph(struct rwrap_fake_builder *b,
+				  const uint32_t *cuts,
+				  struct rwrap_fake_mph *mph)
+{
+	uint32_t *hashes = NULL;
+	size_t i;
+	int rc = -1;
+
+	memset(mph, 0, sizeof(struct rwrap_fake_mph));
+
+	for (i = 1; i < b->nnames; i++) {
+		mph->nowners += (cuts[i] & RWRAP_FAKE_CUT_EXISTS) != 0;
+	}
+	if (mph->nowners == 0) {
+		goto done;
+	}
+
+	mph->owners = calloc(mph->nowners,
+			     sizeof(struct rwrap_fake_mph_owner));
+	hashes = calloc(mph->nowners, sizeof(uint32_t));
+	if (mph->owners == NULL || hashes == NULL) {
+		goto done;
+	}
+
+	mph->nowners = 0;
+	for (i = 1; i < b->nnames; i++) {
+		if ((cuts[i] & RWRAP_FAKE_CUT_EXISTS) != 0) {
+			mph->owners[mph->nowners].hash = b->slots[i].hash;
+			mph->owners[mph->nowners].id = i;
+			mph->nowners++;
+		}
+	}
+	qsort(mph->owners, mph->nowners, sizeof(struct rwrap_fake_mph_owner),
+	      rwrap_fake_mph_owner_cmp);
+
+	/* Names with the same hash are chained in its bucket */
+	for (i = 0; i < mph->nowners; i++) {
+		if (i == 0 || mph->owners[i].hash != mph->owners[i - 1].hash) {
+			hashes[mph->nhashes++] = mph->owners[i].hash;
+		}
+	}
+
+	rc = rwrap_fake_mph_build(mph, hashes, mph->nhashes);
+done:
+	if (rc != 0) {
+		rwrap_fake_mph_free(mph);
+	}
+	free(hashes);
+
+	return rc;
+}
+
+/*
+ * Returns the zone cut of every name with RWRAP_FAKE_CUT_EXISTS set for the
+ * names which exist. A parent has a lower id than its children, so the cut
+ * is inherited from it unless the name owns an SOA record itself.
+ */
+static uint32_t *rwrap_fake_builder_cuts(struct rwrap_fake_builder *b)
+{
+	uint32_t *cuts;
+	size_t i;
+
+	cuts = calloc(b->nnames, sizeof(uint32_t));
+	if (cuts == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < b->nrecords; i++) {
+		uint32_t id = b->records[i].name;
+
+		if (b->records[i].type == ns_t_soa) {
+			cuts[id] |= id + 1;
+		}
+
+		for (; id != RWRAP_FAKE_NAME_ROOT &&
+		       (cuts[id] & RWRAP_FAKE_CUT_EXISTS) == 0;
+		     id = b->names[id].parent) {
+			cuts[id] |= RWRAP_FAKE_CUT_EXISTS;
+		}
+	}
+
+	for (i = 1; i < b->nnames; i++) {
+		if ((cuts[i] & ~RWRAP_FAKE_CUT_EXISTS) == 0) {
+			cuts[i] |= cuts[b->names[i].parent] &
+				   ~RWRAP_FAKE_CUT_EXISTS;
+		}
+	}
+
+	return cuts;
+}
+
+/*
+ * Builds the index of the names which exist in the zone, the owners and
+ * their parents, by their label and parent. It is only needed to find the
+ * closest encloser of a wildcard, so *size is 0 without wildcard owners.
+ */
+static int rwrap_fake_builder_trie(struct rwrap_fake_builder *b,
+				   const uint32_t *cuts,
+				   uint32_t **trie,
+				   size_t *size)
+{
+	bool wildcards = false;
+	size_t nexist = 0;
+	size_t n = RWRAP_FAKE_DB_MIN_BUCKETS;
+	size_t i;
+
+	*trie = NULL;
+	*size = 0;
+
+	for (i = 1; i < b->nnames; i++) {
+		const uint8_t *label =
+			(const uint8_t *)b->data + b->names[i].label;
+
+		if ((cuts[i] & RWRAP_FAKE_CUT_EXISTS) == 0) {
+			continue;
+		}
+		if (label[0] == 1 && label[1] == '*') {
+			wildcards = true;
+		}
+		nexist++;
+	}
+
+	if (!wildcards) {
+		return 0;
+	}
+
+	while (n < 2 * nexist) {
+		n *= 2;
+	}
+
+	*trie = calloc(n, sizeof(uint32_t));
+	if (*trie == NULL) {
+		return -1;
+	}
+
+	for (i = 1; i < b->nnames; i++) {
+		const uint8_t *label =
+			(const uint8_t *)b->data + b->names[i].label;
+		size_t h;
+
+		if ((cuts[i] & RWRAP_FAKE_CUT_EXISTS) == 0) {
+			continue;
+		}
+
+		h = rwrap_fake_intern_hash(label, b->names[i].parent);
+		for (h &= n - 1; (*trie)[h] != 0; h = (h + 1) & (n - 1));
+		(*trie)[h] = i;
+	}
+	*size = n;
+
+	return 0;
+}
+
+/*
+ * Packs an address RRset again at the end of the data blob, if its records
+ * are not next to each other because their lines are not.
+ */
+static int rwrap_fake_builder_pack(struct rwrap_fake_builder *b,
+				   struct rwrap_fake_record *rrset,
+				   size_t n)
+{
+	uint8_t rr[RWRAP_FAKE_RR_HDR + RWRAP_FAKE_RDATA_MAX];
+	size_t size = RWRAP_FAKE_RR_HDR + rrset[0].rdlen;
+	uint32_t off;
+	size_t i;
+	int rc;
+
+	for (i = 1; i < n; i++) {
+		if (rrset[i].rdata != rrset[i - 1].rdata + size) {
+			break;
+		}
+	}
+	if (i == n) {
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		memcpy(rr, b->data + rrset[i].rdata - RWRAP_FAKE_RR_HDR, size);
+
+		rc = rwrap_fake_builder_data(b, rr, size, &off);
+		if (rc != 0) {
+			return rc;
+		}
+		rrset[i].rdata = off + RWRAP_FAKE_RR_HDR;
+	}
+
+	return 0;
+}
+
+/*
+ * Groups the records by their owner and then by type into RRsets, in the
+ * order the types first appear. Both keep the file order.
+ */
+static int rwrap_fake_builder_group(struct rwrap_fake_builder *b)
+{
+	struct rwrap_fake_name *names = b->names;
+	struct rwrap_fake_record *sorted;
+	uint32_t *rank; /* by type, 1 + the RRset of a name, 0 if none */
+	uint32_t *start; /* by RRset, where it starts */
+	size_t i;
+	size_t j;
+	int rc = 0;
+
+	/* Counting sort of the records by owner */
+	for (i = 0; i < b->nrecords; i++) {
+		struct rwrap_fake_name *name = &names[b->records[i].name];
+
+		if (name->nrecords == UINT16_MAX) {
+			RWRAP_LOG(RWRAP_LOG_ERROR,
+				  "Too many records of one name\n");
+			return -1;
+		}
+		name->nrecords++;
+	}
+
+	for (i = 0, j = 0; i < b->nnames; i++) {
+		names[i].records = j;
+		j += names[i].nrecords;
+		names[i].nrecords = 0;
+	}
+
+	sorted = calloc(b->nrecords + 1, sizeof(struct rwrap_fake_record));
+	if (sorted == NULL) {
+		return -1;
+	}
+	for (i = 0; i < b->nrecords; i++) {
+		struct rwrap_fake_name *name = &names[b->records[i].name];
+
+		sorted[name->records + name->nrecords++] = b->records[i];
+	}
+
+	rank = calloc(2 * (UINT16_MAX + 1), sizeof(uint32_t));
+	if (rank == NULL) {
+		free(sorted);
+		return -1;
+	}
+	start = rank + UINT16_MAX + 1;
+
+	/* Counting sort of the records of every name by their RRset */
+	for (i = 0; i < b->nnames && rc == 0; i++) {
+		const struct rwrap_fake_record *rec = &sorted[names[i].records];
+		struct rwrap_fake_record *out = &b->records[names[i].records];
+		size_t n = names[i].nrecords;
+		uint32_t nrrsets = 0;
+		uint32_t pos = 0;
+		size_t end;
+
+		for (j = 0; j < n; j++) {
+			if (rank[rec[j].type] == 0) {
+				rank[rec[j].type] = ++nrrsets;
+				start[nrrsets - 1] = 0;
+			}
+			start[rank[rec[j].type] - 1]++;
+		}
+
+		for (j = 0; j < nrrsets; j++) {
+			uint32_t count = start[j];
+
+			start[j] = pos;
+			pos += count;
+		}
+
+		for (j = 0; j < n; j++) {
+			out[start[rank[rec[j].type] - 1]++] = rec[j];
+		}
+
+		for (j = 0; j < n; j++) {
+			rank[rec[j].type] = 0;
+		}
+
+		for (j = 0; j < n && rc == 0; j = end) {
+			for (end = j + 1; end < n; end++) {
+				if (out[end].type != out[j].type) {
+					break;
+				}
+			}
+
+			if (rwrap_fake_type_packed(out[j].type)) {
+				rc = rwrap_fake_builder_pack(b, &out[j],
+							     end - j);
+			}
+		}
+	}
+	free(rank);
+	free(sorted);
+
+	return rc;
+}
+
+struct rwrap_fake_ptr_entry {
+	struct rwrap_fake_ptr ptr;
+	uint32_t order; /* the PTR records come first */
+};
+
+static int rwrap_fake_ptr_entry_cmp(const void *a, const void *b)
+{
+	const struct rwrap_fake_ptr_entry *x = a;
+	const struct rwrap_fake_ptr_entry *y = b;
+	int rc;
+
+	rc = rwrap_fake_ptr_cmp(&x->ptr, &y->ptr);
+	if (rc != 0) {
+		return rc;
+	}
+
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/*
+ * Builds the reverse index from the PTR records and every A and AAAA record
+ * which is not a wildcard, before the records are grouped. An address with
+ * PTR records only gets those, otherwise it points to the owners of its
+ * address records in file order.
+ */
+static int rwrap_fake_builder_ptrs(struct rwrap_fake_builder *b,
+				   struct rwrap_fake_ptr **ptrs,
+				   size_t *nptrs)
+{
+	struct rwrap_fake_ptr_entry *e;
+	size_t n = b->nptrs;
+	size_t start = 0;
+	size_t i;
+	size_t j;
+	size_t w;
+
+	for (i = 0; i < b->nrecords; i++) {
+		n += rwrap_fake_type_packed(b->records[i].type);
+	}
+
+	*ptrs = NULL;
+	*nptrs = 0;
+	if (n == 0) {
+		return 0;
+	}
+	if (n > UINT32_MAX) {
+		return -1;
+	}
+
+	e = calloc(n, sizeof(struct rwrap_fake_ptr_entry));
+	if (e == NULL) {
+		return -1;
+	}
+
+	for (n = 0; n < b->nptrs; n++) {
+		e[n].ptr = b->ptrs[n];
+		e[n].order = n;
+	}
+	for (i = 0; i < b->nrecords; i++) {
+		const struct rwrap_fake_record *rec = &b->records[i];
+		const uint8_t *label =
+			(const uint8_t *)b->data + b->names[rec->name].label;
+
+		if (!rwrap_fake_type_packed(rec->type) ||
+		    (label[0] == 1 && label[1] == '*')) {
+			continue;
+		}
+
+		memcpy(e[n].ptr.addr, b->data + rec->rdata, rec->rdlen);
+		e[n].ptr.len = rec->rdlen;
+		e[n].ptr.target = rec->name;
+		e[n].order = n;
+		n++;
+	}
+
+	qsort(e, n, sizeof(struct rwrap_fake_ptr_entry),
+	      rwrap_fake_ptr_entry_cmp);
+
+	/* Drop the names an address already has, in place */
+	for (i = 0, w = 0; i < n; i++) {
+		if (w == 0 || rwrap_fake_ptr_cmp(&e[i].ptr,
+						 &e[start].ptr) != 0) {
+			start = w;
+		} else if (e[start].order < b->nptrs &&
+			   e[i].order >= b->nptrs) {
+			continue;
+		}
+
+		for (j = start; j < w; j++) {
+			if (e[j].ptr.target == e[i].ptr.target) {
+				break;
+			}
+		}
+		if (j == w) {
+			e[w++] = e[i];
+		}
+	}
+
+	*ptrs = calloc(w, sizeof(struct rwrap_fake_ptr));
+	if (*ptrs == NULL) {
+		free(e);
+		return -1;
+	}
+	for (i = 0; i < w; i++) {
+		(*ptrs)[i] = e[i].ptr;
+	}
+	*nptrs = w;
+	free(e);
+
+	return 0;
+}
+
+/*
+ * Serializes the builder into a single image. The reverse index is built and
+ * the records are grouped into RRsets first, the names which exist are
+ * hashed into the buckets backwards, so that a chain goes from lower to
+ * higher ids, and added to the Bloom filter. With
+ * RESOLV_WRAPPER_HOSTS_PERFECT_HASH the buckets are placed by a perfect hash
+ * instead.
+ */
+static uint8_t *rwrap_fake_builder_image(struct rwrap_fake_builder *b,
+					 size_t *image_len)
+{
+	struct rwrap_fake_db_header hdr;
+	struct rwrap_fake_slot *slots;
+	struct rwrap_fake_name *names;
+	struct rwrap_fake_record *records;
+	struct rwrap_fake_mph mph;
+	struct rwrap_fake_ptr *ptrs;
+	size_t nptrs;
+	uint32_t *buckets;
+	uint32_t *bloom;
+	uint32_t *cuts;
+	uint32_t *trie;
+	size_t trie_size;
+	uint8_t *image;
+	size_t nbuckets = RWRAP_FAKE_DB_MIN_BUCKETS;
+	size_t nbits = RWRAP_FAKE_BLOOM_MIN_BITS;
+	size_t len;
+	size_t i;
+	size_t j;
+
+	if (rwrap_fake_builder_ptrs(b, &ptrs, &nptrs) != 0) {
+		return NULL;
+	}
+	if (rwrap_fake_builder_group(b) != 0) {
+		free(ptrs);
+		return NULL;
+	}
+	cuts = rwrap_fake_builder_cuts(b);
+	if (cuts == NULL) {
+		free(ptrs);
+		return NULL;
+	}
+	if (rwrap_fake_builder_trie(b, cuts, &trie, &trie_size) != 0) {
+		free(cuts);
+		free(ptrs);
+		return NULL;
+	}
+
+	memset(&mph, 0, sizeof(mph));
+	if (rwrap_config_get()->hosts_perfect_hash &&
+	    rwrap_fake_builder_mph(b, cuts, &mph) != 0) {
+		RWRAP_LOG(RWRAP_LOG_WARN,
+			  "Failed to build a perfect hash, "
+			  "using hash chains\n");
+	}
+
+	if (mph.ndisp != 0) {
+		RWRAP_LOG(RWRAP_LOG_TRACE,
+			  "Built a perfect hash over %u names\n",
+			  mph.nowners);
+		nbuckets = mph.nhashes;
+	}
+	while (mph.ndisp == 0 && nbuckets < b->nnames) {
+		nbuckets *= 2;
+	}
+
+	while (nbits < b->nnames * RWRAP_FAKE_BLOOM_BITS_PER_NAME &&
+	       nbits < ((size_t)1 << 31)) {
+		nbits *= 2;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, RWRAP_FAKE_DB_MAGIC, sizeof(RWRAP_FAKE_DB_MAGIC));
+	hdr.version = RWRAP_FAKE_DB_VERSION;
+	hdr.byte_order = RWRAP_FAKE_DB_BYTE_ORDER;
+	hdr.nnames = b->nnames;
+	hdr.nrecords = b->nrecords;
+	hdr.nbuckets = nbuckets;
+	hdr.mph_size = mph.ndisp;
+	hdr.slots_off = sizeof(hdr);
+	hdr.names_off = hdr.slots_off +
+			b->nnames * sizeof(struct rwrap_fake_slot);
+	hdr.records_off = hdr.names_off +
+			  b->nnames * sizeof(struct rwrap_fake_name);
+	hdr.buckets_off = hdr.records_off +
+			  b->nrecords * sizeof(struct rwrap_fake_record);
+	hdr.mph_off = hdr.buckets_off + nbuckets * sizeof(uint32_t);
+	hdr.bloom_off = hdr.mph_off + mph.ndisp * sizeof(uint32_t);
+	hdr.bloom_bits = nbits;
+	hdr.trie_off = hdr.bloom_off + nbits / 8;
+	hdr.trie_size = trie_size;
+	hdr.patterns_off = hdr.trie_off + trie_size * sizeof(uint32_t);
+	hdr.npatterns = b->npatterns;
+	hdr.ptrs_off = hdr.patterns_off +
+		       b->npatterns * sizeof(struct rwrap_fake_pattern);
+	hdr.nptrs = nptrs;
+	hdr.cuts_off = hdr.ptrs_off + nptrs * sizeof(struct rwrap_fake_ptr);
+	hdr.data_off = hdr.cuts_off + b->nnames * sizeof(uint32_t);
+	hdr.data_len = b->data_len;
+
+	len = (size_t)hdr.data_off + hdr.data_len;
+	if (len > UINT32_MAX) {
+		RWRAP_LOG(RWRAP_LOG_ERROR, "Fake hosts database too big\n");
+		rwrap_fake_mph_free(&mph);
+		free(trie);
+		free(cuts);
+		free(ptrs);
+		return NULL;
+	}
+
+	image = calloc(1, len);
+	if (image == NULL) {
+		rwrap_fake_mph_free(&mph);
+		free(trie);
+		free(cuts);
+		free(ptrs);
+		return NULL;
+	}
+
+	memcpy(image, &hdr, sizeof(hdr));
+
+	slots = (struct rwrap_fake_slot *)(image + hdr.slots_off);
+	memcpy(slots, b->slots, b->nnames * sizeof(struct rwrap_fake_slot));
+
+	names = (struct rwrap_fake_name *)(image + hdr.names_off);
+	memcpy(names, b->names, b->nnames * sizeof(struct rwrap_fake_name));
+
+	records = (struct rwrap_fake_record *)(image + hdr.records_off);
+	memcpy(records, b->records,
+	       b->nrecords * sizeof(struct rwrap_fake_record));
+
+	buckets = (uint32_t *)(image + hdr.buckets_off);
+	bloom = (uint32_t *)(image + hdr.bloom_off);
+	for (i = b->nnames - 1; i > RWRAP_FAKE_NAME_ROOT; i--) {
+		uint32_t probes[RWRAP_FAKE_BLOOM_PROBES];
+
+		if ((cuts[i] & RWRAP_FAKE_CUT_EXISTS) == 0) {
+			continue;
+		}
+
+		if (mph.ndisp == 0) {
+			uint32_t *head = &buckets[slots[i].hash & (nbuckets - 1)];
+
+			slots[i].next = *head;
+			*head = i;
+		}
+
+		rwrap_fake_bloom_probes(slots[i].hash, nbits, probes);
+		for (j = 0; j < RWRAP_FAKE_BLOOM_PROBES; j++) {
+			bloom[probes[j] / 32] |= 1U << (probes[j] % 32);
+		}
+	}
+
+	/* The owners are sorted by hash, each new hash takes its bucket */
+	for (i = 0, j = 0; i < mph.nowners; i++) {
+		const struct rwrap_fake_mph_owner *o = &mph.owners[i];
+
+		if (i > 0 && o->hash == o[-1].hash) {
+			slots[o[-1].id].next = o->id;
+		} else {
+			buckets[mph.bucket[j++]] = o->id;
+		}
+	}
+	if (mph.ndisp != 0) {
+		memcpy(image + hdr.mph_off, mph.disp,
+		       mph.ndisp * sizeof(uint32_t));
+	}
+	rwrap_fake_mph_free(&mph);
+
+	if (trie_size != 0) {
+		memcpy(image + hdr.trie_off, trie, trie_size * sizeof(uint32_t));
+	}
+	free(trie);
+
+	if (b->npatterns != 0) {
+		memcpy(image + hdr.patterns_off, b->patterns,
+		       b->npatterns * sizeof(struct rwrap_fake_pattern));
+	}
+	if (nptrs != 0) {
+		memcpy(image + hdr.ptrs_off, ptrs,
+		       nptrs * sizeof(struct rwrap_fake_ptr));
+	}
+	free(ptrs);
+	memcpy(image + hdr.cuts_off, cuts, b->nnames * sizeof(uint32_t));
+	free(cuts);
+	memcpy(image + hdr.data_off, b->data, b->data_len);
+
+	*image_len = len;
+	return image;
+}
+
+/* Checks the RDATA the encoder looks into */
+static bool rwrap_fake_rdata_valid(const struct rwrap_fake_record *rec,
+				   const uint8_t *rdata)
+{
+	const struct rwrap_rr_type *t = rwrap_rr_type_get(rec->type);
+
+	if (t == NULL) {
+		return false;
+	}
+
+	if (t->target >= 0) {
+		return rec->rdlen == t->target &&
+		       rec->target != RWRAP_FAKE_NAME_ROOT;
+	}
+
+	return t->valid == NULL || t->valid(rdata, rec->rdlen);
+}
+
+/*
+ * Checks a name, its parent has a lower id and was checked already. This
+ * also makes sure that the names do not loop.
+ */
+static bool rwrap_fake_name_valid(const struct rwrap_fake_db_header *hdr,
+				  const struct rwrap_fake_slot *slots,
+				  const struct rwrap_fake_name *names,
+				  const uint8_t *data,
+				  uint32_t id)
+{
+	const struct rwrap_fake_name *name = &names[id];
+	uint8_t label_len;
+
+	if (name->label >= hdr->data_len ||
+	    (size_t)name->records + name->nrecords > hdr->nrecords ||
+	    (slots[id].next != 0 &&
+	     (slots[id].next <= id || slots[id].next >= hdr->nnames))) {
+		return false;
+	}
+
+	if (id == RWRAP_FAKE_NAME_ROOT) {
+		return name->len == 1 && name->nrecords == 0;
+	}
+
+	label_len = data[name->label];
+	return name->parent < id &&
+	       label_len > 0 && label_len <= NS_MAXLABEL &&
+	       (size_t)name->label + label_len < hdr->data_len &&
+	       name->len == names[name->parent].len + label_len + 1 &&
+	       name->len <= NS_MAXCDNAME;
+}
+
+/* Sets up the pointers into a database image after checking its layout */
+static int rwrap_fake_db_open_image(struct rwrap_fake_db *db,
+				    const uint8_t *image,
+				    size_t len)
+{
+	const struct rwrap_fake_db_header *hdr;
+	const struct rwrap_fake_slot *slots;
+	const struct rwrap_fake_name *names;
+	const struct rwrap_fake_record *records;
+	const uint32_t *buckets;
+	const uint32_t *mph;
+	const uint32_t *bloom;
+	const uint32_t *trie;
+	const struct rwrap_fake_pattern *patterns;
+	const struct rwrap_fake_ptr *ptrs;
+	const uint32_t *cuts;
+	const uint8_t *data;
+	bool trie_free = false;
+	size_t i;
+
+	hdr = (const struct rwrap_fake_db_header *)image;
+	if (len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, RWRAP_FAKE_DB_MAGIC,
+		   sizeof(RWRAP_FAKE_DB_MAGIC)) != 0) {
+		return -1;
+	}
+
+	if (hdr->version != RWRAP_FAKE_DB_VERSION ||
+	    hdr->byte_order != RWRAP_FAKE_DB_BYTE_ORDER) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Unsupported fake hosts database version %u, "
+			  "recompile %s\n",
+			  hdr->version, db->path);
+		return -1;
+	}
+
+	if (hdr->nnames == 0 ||
+	    hdr->nbuckets == 0 ||
+	    (hdr->mph_size == 0 &&
+	     (hdr->nbuckets & (hdr->nbuckets - 1)) != 0) ||
+	    hdr->slots_off != sizeof(*hdr) ||
+	    hdr->names_off != hdr->slots_off +
+			(size_t)hdr->nnames * sizeof(struct rwrap_fake_slot) ||
+	    hdr->records_off != hdr->names_off +
+			(size_t)hdr->nnames * sizeof(struct rwrap_fake_name) ||
+	    hdr->buckets_off != hdr->records_off +
+			(size_t)hdr->nrecords * sizeof(struct rwrap_fake_record) ||
+	    hdr->bloom_bits < 32 ||
+	    (hdr->bloom_bits & (hdr->bloom_bits - 1)) != 0 ||
+	    hdr->mph_off != hdr->buckets_off +
+			(size_t)hdr->nbuckets * sizeof(uint32_t) ||
+	    hdr->bloom_off != hdr->mph_off +
+			(size_t)hdr->mph_size * sizeof(uint32_t) ||
+	    hdr->trie_off != hdr->bloom_off + (size_t)hdr->bloom_bits / 8 ||
+	    (hdr->trie_size & (hdr->trie_size - 1)) != 0 ||
+	    hdr->patterns_off != hdr->trie_off +
+			(size_t)hdr->trie_size * sizeof(uint32_t) ||
+	    hdr->ptrs_off != hdr->patterns_off +
+		(size_t)hdr->npatterns * sizeof(struct rwrap_fake_pattern) ||
+	    hdr->cuts_off != hdr->ptrs_off +
+		(size_t)hdr->nptrs * sizeof(struct rwrap_fake_ptr) ||
+	    hdr->data_off != hdr->cuts_off +
+		(size_t)hdr->nnames * sizeof(uint32_t) ||
+	    hdr->data_len == 0 ||
+	    (size_t)hdr->data_off + hdr->data_len != len) {
+		goto corrupt;
+	}
+
+	slots = (const struct rwrap_fake_slot *)(image + hdr->slots_off);
+	names = (const struct rwrap_fake_name *)(image + hdr->names_off);
+	records = (const struct rwrap_fake_record *)(image + hdr->records_off);
+	buckets = (const uint32_t *)(image + hdr->buckets_off);
+	mph = (const uint32_t *)(image + hdr->mph_off);
+	bloom = (const uint32_t *)(image + hdr->bloom_off);
+	trie = (const uint32_t *)(image + hdr->trie_off);
+	patterns = (const struct rwrap_fake_pattern *)
+		   (image + hdr->patterns_off);
+	ptrs = (const struct rwrap_fake_ptr *)(image + hdr->ptrs_off);
+	cuts = (const uint32_t *)(image + hdr->cuts_off);
+	data = image + hdr->data_off;
+
+	for (i = 0; i < hdr->nbuckets; i++) {
+		if (buckets[i] >= hdr->nnames) {
+			goto corrupt;
+		}
+	}
+
+	/* A lookup stops at the first free slot */
+	for (i = 0; i < hdr->trie_size; i++) {
+		if (trie[i] >= hdr->nnames) {
+			goto corrupt;
+		}
+		trie_free |= trie[i] == RWRAP_FAKE_NAME_ROOT;
+	}
+	if (hdr->trie_size != 0 && !trie_free) {
+		goto corrupt;
+	}
+
+	for (i = 0; i < hdr->mph_size; i++) {
+		if ((mph[i] & RWRAP_FAKE_MPH_DIRECT) != 0 &&
+		    (mph[i] & ~RWRAP_FAKE_MPH_DIRECT) >= hdr->nbuckets) {
+			goto corrupt;
+		}
+	}
+
+	/* The encoder copies the names without checking them */
+	for (i = 0; i < hdr->nnames; i++) {
+		if (!rwrap_fake_name_valid(hdr, slots, names, data, i)) {
+			goto corrupt;
+		}
+	}
+
+	for (i = 0; i < hdr->nrecords; i++) {
+		const struct rwrap_fake_record *rec = &records[i];
+
+		if (rec->name >= hdr->nnames ||
+		    rec->target >= hdr->nnames ||
+		    rec->chain > hdr->nrecords ||
+		    (size_t)rec->rdata + rec->rdlen > hdr->data_len ||
+		    (rwrap_fake_type_packed(rec->type) &&
+		     rec->rdata < RWRAP_FAKE_RR_HDR) ||
+		    !rwrap_fake_rdata_valid(rec, data + rec->rdata)) {
+			goto corrupt;
+		}
+	}
+
+	/* The sources are checked when they are compiled */
+	for (i = 0; i < hdr->npatterns; i++) {
+		const struct rwrap_fake_pattern *pat = &patterns[i];
+
+		if ((size_t)pat->source + pat->source_len > hdr->data_len ||
+		    (size_t)pat->value + pat->value_len > hdr->data_len ||
+		    rwrap_rr_type_get(pat->type) == NULL) {
+			goto corrupt;
+		}
+	}
+
+	for (i = 0; i < hdr->nptrs; i++) {
+		if (ptrs[i].target == RWRAP_FAKE_NAME_ROOT ||
+		    ptrs[i].target >= hdr->nnames ||
+		    (ptrs[i].len != sizeof(struct in_addr) &&
+		     ptrs[i].len != sizeof(struct in6_addr))) {
+			goto corrupt;
+		}
+	}
+
+	/* The SOA of a zone cut is looked up on the name itself or a parent */
+	for (i = 0; i < hdr->nnames; i++) {
+		if ((cuts[i] & ~RWRAP_FAKE_CUT_EXISTS) > i + 1) {
+			goto corrupt;
+		}
+	}
+
+	db->hdr = hdr;
+	db->slots = slots;
+	db->names = names;
+	db->records = records;
+	db->buckets = buckets;
+	db->mph = mph;
+	db->bloom = bloom;
+	db->trie = trie;
+	db->patterns = patterns;
+	db->ptrs = ptrs;
+	db->cuts = cuts;
+	db->data = (const char *)data;
+
+	return 0;
+
+corrupt:
+	RWRAP_LOG(RWRAP_LOG_ERROR,
+		  "Corrupt fake hosts database %s\n", db->path);
+	return -1;
+}
+
+/*
+ * Compiles the pattern records into a single DFA. If it needs too many
+ * states, the patterns are tried one after another instead.
+ */
+static int rwrap_fake_db_compile_patterns(struct rwrap_fake_db *db)
+{
+	struct rwrap_fake_matcher *m;
+	uint32_t i;
+
+	if (db->hdr->npatterns == 0) {
+		return 0;
+	}
+
+	m = calloc(1, sizeof(struct rwrap_fake_matcher));
+	if (m == NULL) {
+		return -1;
+	}
+	db->matcher = m;
+
+	m->re = calloc(db->hdr->npatterns, sizeof(struct rwrap_re));
+	if (m->re == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < db->hdr->npatterns; i++) {
+		const struct rwrap_fake_pattern *pat = &db->patterns[i];
+
+		if (rwrap_re_compile(&m->re[i], db->data + pat->source,
+				     pat->source_len) != 0) {
+			RWRAP_LOG(RWRAP_LOG_ERROR,
+				  "Failed to compile pattern %u of %s\n",
+				  i, db->path);
+			return -1;
+		}
+		m->n++;
+	}
+
+	if (rwrap_fake_dfa_build(m) != 0) {
+		RWRAP_LOG(RWRAP_LOG_WARN,
+			  "Failed to build a DFA of %zu patterns, "
+			  "trying them one after another\n",
+			  m->n);
+		return 0;
+	}
+
+	RWRAP_LOG(RWRAP_LOG_TRACE,
+		  "Compiled %zu patterns into a DFA of %u states\n",
+		  m->n, m->nstates);
+
+	return 0;
+}
+
+/*********************************************************
+ * RWRAP ANSWER CACHE
+ *********************************************************/
+
+static void rwrap_answer_cache_init(struct rwrap_answer_cache *cache,
+				    size_t limit)
+{
+	size_t i;
+
+	for (i = 0; i < RWRAP_ANSWER_CACHE_SHARDS; i++) {
+		struct rwrap_answer_shard *shard = &cache->shards[i];
+
+		memset(shard, 0, sizeof(*shard));
+		pthread_rwlock_init(&shard->lock, NULL);
+		shard->limit = limit / RWRAP_ANSWER_CACHE_SHARDS;
+	}
+}
+
+static void rwrap_answer_cache_free(struct rwrap_answer_cache *cache)
+{
+	size_t i;
+	size_t j;
+
+	for (i = 0; i < RWRAP_ANSWER_CACHE_SHARDS; i++) {
+		struct rwrap_answer_shard *shard = &cache->shards[i];
+
+		for (j = 0; j < shard->nentries; j++) {
+			free(shard->ring[j]);
+		}
+		free(shard->ring);
+		free(shard->buckets);
+		pthread_rwlock_destroy(&shard->lock);
+	}
+}
+
+static struct rwrap_answer_shard *rwrap_answer_shard(
+					struct rwrap_answer_cache *cache,
+					uint32_t hash)
+{
+	return &cache->shards[hash >> 28];
+}
+
+/*
+ * Copies the case of the question name as it was asked into a cached
+ * answer. The name is the first thing after the header and is never
+ * compressed.
+ */
+static void rwrap_answer_patch_qname(uint8_t *answer,
+				     size_t len,
+				     const char *query)
+{
+	uint8_t *p = answer + NS_HFIXEDSZ;
+	uint8_t *end = answer + len;
+
+	if (strchr(query, '\\') != NULL) {
+		return;
+	}
+
+	while (p < end && *p != 0) {
+		uint8_t label_len = *p++;
+		uint8_t i;
+
+		for (i = 0; i < label_len && p < end && *query != '\0'; i++) {
+			*p++ = *query++;
+		}
+		if (*query == '.') {
+			query++;
+		}
+	}
+}
+
+/*
+ * Copies a cached answer for the query into the buffer and gives it a new
+ * ID. Returns the length, 0 if there is no cached answer or -1 if the buffer
+ * is too small.
+ */
+static ssize_t rwrap_answer_cache_get(struct rwrap_answer_cache *cache,
+				      const char *key,
+				      const char *query,
+				      int type,
+				      uint8_t *answer,
+				      size_t anslen)
+{
+	struct rwrap_answer_shard *shard;
+	struct rwrap_answer_entry *e;
+	uint32_t hash = rwrap_fake_hash(key, strlen(key), type);
+	ssize_t len = 0;
+
+	shard = rwrap_answer_shard(cache, hash);
+	if (shard->limit == 0) {
+		return 0;
+	}
+
+	pthread_rwlock_rdlock(&shard->lock);
+	if (shard->buckets != NULL) {
+		e = shard->buckets[hash & (shard->nbuckets - 1)];
+		for (; e != NULL; e = e->next) {
+			if (e->hash == hash && e->type == type &&
+			    strcmp(e->name, key) == 0) {
+				break;
+			}
+		}
+
+		if (e != NULL) {
+			/* Other hits may hold the lock as well */
+			if (!__atomic_load_n(&e->referenced,
+					     __ATOMIC_RELAXED)) {
+				__atomic_store_n(&e->referenced, true,
+						 __ATOMIC_RELAXED);
+			}
+			if (e->len > anslen) {
+				RWRAP_LOG(RWRAP_LOG_ERROR, "Buffer too small\n");
+				len = -1;
+			} else {
+				memcpy(answer, e->answer, e->len);
+				len = e->len;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&shard->lock);
+
+	if (len > 0) {
+		HEADER *h = (HEADER *)answer;
+
+		h->id = rwrap_random_id();
+		rwrap_answer_patch_qname(answer, len, query);
+	}
+
+	return len;
+}
+
+static void rwrap_answer_unlink(struct rwrap_answer_shard *shard,
+				struct rwrap_answer_entry *victim)
+{
+	struct rwrap_answer_entry **pp;
+
+	pp = &shard->buckets[victim->hash & (shard->nbuckets - 1)];
+	while (*pp != victim) {
+		pp = &(*pp)->next;
+	}
+	*pp = victim->next;
+
+	shard->size -= victim->size;
+	free(victim);
+}
+
+/* Evicts the first entry the clock hand finds unreferenced */
+static void rwrap_answer_evict(struct rwrap_answer_shard *shard)
+{
+	struct rwrap_answer_entry *victim;
+
+	for (;;) {
+		if (shard->hand >= shard->nentries) {
+			shard->hand = 0;
+		}
+
+		victim = shard->ring[shard->hand];
+		if (!victim->referenced) {
+			break;
+		}
+		victim->referenced = false;
+		shard->hand++;
+	}
+
+	shard->ring[shard->hand] = shard->ring[shard->nentries - 1];
+	shard->nentries--;
+
+	rwrap_answer_unlink(shard, victim);
+}
+
+static int rwrap_answer_shard_alloc(struct rwrap_answer_shard *shard)
+{
+	/* Assume answers of about 128 bytes for sizing the table */
+	size_t n = 16;
+
+	while (n < shard->limit / 128) {
+		n *= 2;
+	}
+
+	shard->buckets = calloc(n, sizeof(struct rwrap_answer_entry *));
+	if (shard->buckets == NULL) {
+		return -1;
+	}
+	shard->nbuckets = n;
+
+	shard->ring = calloc(n, sizeof(struct rwrap_answer_entry *));
+	if (shard->ring == NULL) {
+		SAFE_FREE(shard->buckets);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void rwrap_answer_cache_put(struct rwrap_answer_cache *cache,
+				   const char *key,
+				   int type,
+				   const uint8_t *answer,
+				   size_t len)
+{
+	struct rwrap_answer_shard *shard;
+	struct rwrap_answer_entry *e;
+	struct rwrap_answer_entry **head;
+	uint32_t hash = rwrap_fake_hash(key, strlen(key), type);
+	size_t key_len = strlen(key) + 1;
+	size_t size;
+	int rc;
+
+	shard = rwrap_answer_shard(cache, hash);
+
+	size = sizeof(struct rwrap_answer_entry) + len + key_len;
+	if (size > shard->limit) {
+		return;
+	}
+
+	e = malloc(size);
+	if (e == NULL) {
+		return;
+	}
+	e->hash = hash;
+	e->type = type;
+	e->referenced = false;
+	e->size = size;
+	e->len = len;
+	memcpy(e->answer, answer, len);
+	e->name = (char *)e->answer + len;
+	memcpy(e->name, key, key_len);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	if (shard->buckets == NULL) {
+		rc = rwrap_answer_shard_alloc(shard);
+		if (rc != 0) {
+			pthread_rwlock_unlock(&shard->lock);
+			free(e);
+			return;
+		}
+	}
+
+	head = &shard->buckets[hash & (shard->nbuckets - 1)];
+	if (*head != NULL) {
+		struct rwrap_answer_entry *cur;
+
+		/* Another thread was faster */
+		for (cur = *head; cur != NULL; cur = cur->next) {
+			if (cur->hash == hash && cur->type == type &&
+			    strcmp(cur->name, key) == 0) {
+				pthread_rwlock_unlock(&shard->lock);
+				free(e);
+				return;
+			}
+		}
+	}
+
+	while (shard->nentries > 0 &&
+	       (shard->size + size > shard->limit ||
+		shard->nentries == shard->nbuckets)) {
+		rwrap_answer_evict(shard);
+	}
+
+	e->next = *head;
+	*head = e;
+	shard->ring[shard->nentries++] = e;
+	shard->size += size;
+	pthread_rwlock_unlock(&shard->lock);
+}
+
+static void rwrap_fake_db_free(struct rwrap_fake_db *db)
+{
+	if (db == NULL) {
+		return;
+	}
+
+	rwrap_answer_cache_free(&db->cache);
+	rwrap_fake_matcher_free(db->matcher);
+
+	if (db->map != NULL) {
+		munmap(db->map, db->map_len);
+	}
+	free(db->image);
+	free(db->path);
+	free(db);
+}
+
+static int rwrap_fake_db_link(struct rwrap_fake_db *db,
+			      struct rwrap_fake_record *records);
+
+static struct rwrap_fake_db *rwrap_fake_db_load(const char *hostfile)
+{
+	struct rwrap_fake_db *db;
+	struct rwrap_fake_builder b;
+	struct stat sb;
+	size_t image_len = 0;
+	void *map = NULL;
+	int fd;
+	int rc;
+
+	RWRAP_LOG(RWRAP_LOG_TRACE,
+		  "Loading fake hosts file %s\n", hostfile);
+
+	db = calloc(1, sizeof(struct rwrap_fake_db));
+	if (db == NULL) {
+		return NULL;
+	}
+
+	rwrap_answer_cache_init(&db->cache, rwrap_fake.cache_size);
+
+	db->path = strdup(hostfile);
+	if (db->path == NULL) {
+		rwrap_fake_db_free(db);
+		return NULL;
+	}
+
+	fd = open(hostfile, O_RDONLY);
+	if (fd == -1) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Opening %s failed: %s",
+			  hostfile, strerror(errno));
+		rwrap_fake_db_free(db);
+		return NULL;
+	}
+
+	rc = fstat(fd, &sb);
+	if (rc != 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Reading from %s failed: %s",
+			  hostfile, strerror(errno));
+		close(fd);
+		rwrap_fake_db_free(db);
+		return NULL;
+	}
+	db->st = sb;
+
+	if (sb.st_size > 0) {
+		map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			RWRAP_LOG(RWRAP_LOG_ERROR,
+				  "Mapping %s failed: %s",
+				  hostfile, strerror(errno));
+			close(fd);
+			rwrap_fake_db_free(db);
+			return NULL;
+		}
+	}
+	close(fd);
+
+	/* A compiled database is used as it is */
+	if (map != NULL &&
+	    (size_t)sb.st_size >= sizeof(RWRAP_FAKE_DB_MAGIC) &&
+	    memcmp(map, RWRAP_FAKE_DB_MAGIC,
+		   sizeof(RWRAP_FAKE_DB_MAGIC)) == 0) {
+		db->map = map;
+		db->map_len = sb.st_size;
+
+		rc = rwrap_fake_db_open_image(db, map, sb.st_size);
+		if (rc == 0) {
+			rc = rwrap_fake_db_compile_patterns(db);
+		}
+		if (rc != 0) {
+			rwrap_fake_db_free(db);
+			return NULL;
+		}
+
+		RWRAP_TRACE(RWRAP_TRACE_FAKE_LOAD, db->hdr->nrecords, 1, 0);
+		RWRAP_LOG(RWRAP_LOG_TRACE,
+			  "Mapped %u compiled records from %s\n",
+			  db->hdr->nrecords, hostfile);
+		return db;
+	}
+
+	memset(&b, 0, sizeof(b));
+	rc = rwrap_fake_builder_parse(&b, map, sb.st_size);
+	if (map != NULL) {
+		munmap(map, sb.st_size);
+	}
+	if (rc == 0) {
+		db->image = rwrap_fake_builder_image(&b, &image_len);
+	}
+	rwrap_fake_builder_free(&b);
+	if (db->image == NULL) {
+		rwrap_fake_db_free(db);
+		return NULL;
+	}
+
+	rc = rwrap_fake_db_open_image(db, db->image, image_len);
+	if (rc != 0) {
+		rwrap_fake_db_free(db);
+		return NULL;
+	}
+
+	rc = rwrap_fake_db_link(db, (struct rwrap_fake_record *)
+				    (db->image + db->hdr->records_off));
+	if (rc == 0) {
+		rc = rwrap_fake_db_compile_patterns(db);
+	}
+	if (rc != 0) {
+		rwrap_fake_db_free(db);
+		return NULL;
+	}
+
+	RWRAP_TRACE(RWRAP_TRACE_FAKE_LOAD, db->hdr->nrecords, 0, 0);
+	RWRAP_LOG(RWRAP_LOG_TRACE,
+		  "Loaded %u records from %s\n", db->hdr->nrecords, hostfile);
+
+	return db;
+}
+
+static bool rwrap_fake_db_stat_changed(struct rwrap_fake_db *db)
+{
+	struct stat sb;
+	int rc;
+
+	rc = stat(db->path, &sb);
+	if (rc != 0) {
+		return false;
+	}
+
+	return rwrap_stat_changed(&db->st, &sb);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+ * Watches the directory of the hosts file, so that replacing the file with
+ * rename() is noticed as well as rewriting it.
+ */
+static void rwrap_fake_db_watch(struct rwrap_fake_db *db)
+{
+	char *dir;
+	char *p;
+	int wd;
+
+	if (rwrap_fake.watch_fd != -1) {
+		close(rwrap_fake.watch_fd);
+		rwrap_fake.watch_fd = -1;
+	}
+
+	dir = strdup(db->path);
+	if (dir == NULL) {
+		return;
+	}
+	p = strrchr(dir, '/');
+	if (p == NULL) {
+		dir[0] = '.';
+		dir[1] = '\0';
+	} else if (p == dir) {
+		p[1] = '\0';
+	} else {
+		p[0] = '\0';
+	}
+
+	rwrap_fake.watch_pid = getpid();
+	rwrap_fake.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (rwrap_fake.watch_fd == -1) {
+		RWRAP_LOG(RWRAP_LOG_WARN,
+			  "inotify_init1 failed: %s", strerror(errno));
+		free(dir);
+		return;
+	}
+
+	wd = inotify_add_watch(rwrap_fake.watch_fd, dir,
+			       IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd == -1) {
+		RWRAP_LOG(RWRAP_LOG_WARN,
+			  "Watching %s failed: %s", dir, strerror(errno));
+		close(rwrap_fake.watch_fd);
+		rwrap_fake.watch_fd = -1;
+	}
+
+	free(dir);
+}
+
+static bool rwrap_fake_db_changed(struct rwrap_fake_db *db)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const char *base;
+	bool changed = false;
+	ssize_t n;
+
+	/*
+	 * After fork() parent and child would read each other's events from
+	 * the inherited descriptor. The child watches on its own and compares
+	 * the file once, as it may have missed an event.
+	 */
+	if (rwrap_fake.watch_pid != getpid()) {
+		rwrap_fake_db_watch(db);
+		return rwrap_fake_db_stat_changed(db);
+	}
+
+	/* Without inotify, e.g. out of instances, the file is compared */
+	if (rwrap_fake.watch_fd == -1) {
+		return rwrap_fake_db_stat_changed(db);
+	}
+
+	base = strrchr(db->path, '/');
+	base = base == NULL ? db->path : base + 1;
+
+	while ((n = read(rwrap_fake.watch_fd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *ev;
+		char *p;
+
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->len > 0 && strcmp(ev->name, base) == 0) {
+				changed = true;
+			}
+		}
+	}
+
+	return changed;
+}
+#else /* HAVE_SYS_INOTIFY_H */
+static void rwrap_fake_db_watch(struct rwrap_fake_db *db)
+{
+	(void)db; /* unused */
+}
+
+static bool rwrap_fake_db_changed(struct rwrap_fake_db *db)
+{
+	return rwrap_fake_db_stat_changed(db);
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/*
+ * Returns true if the check interval has passed since the last check. Of the
+ * threads which notice it only the one which moves the time of the last
+ * check on does the check.
+ */
+static bool rwrap_check_due(unsigned int *last_check, int interval)
+{
+	struct timespec ts;
+	unsigned int now;
+	unsigned int last;
+
+	if (interval == 0) {
+		return true;
+	}
+
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	now = (unsigned int)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	last = __atomic_load_n(last_check, __ATOMIC_RELAXED);
+	if (now - last < (unsigned int)interval) {
+		return false;
+	}
+
+	return __atomic_compare_exchange_n(last_check, &last, now,
+					   false, __ATOMIC_RELAXED,
+					   __ATOMIC_RELAXED);
+}
+
+/* Waits until all readers which might still use the old snapshot are done */
+static void rwrap_fake_db_synchronize(void)
+{
+	unsigned int epoch;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		epoch = __atomic_fetch_add(&rwrap_fake.epoch, 1,
+					   __ATOMIC_SEQ_CST);
+
+		while (__atomic_load_n(&rwrap_fake.readers[epoch & 1],
+				       __ATOMIC_SEQ_CST) != 0) {
+			sched_yield();
+		}
+	}
+}
+
+/* Has to be called with rwrap_fake.lock held */
+static void rwrap_fake_db_publish(struct rwrap_fake_db *db)
+{
+	struct rwrap_fake_db *old;
+
+	old = __atomic_exchange_n(&rwrap_fake.db, db, __ATOMIC_SEQ_CST);
+	if (old != NULL) {
+		rwrap_fake_db_synchronize();
+		rwrap_fake_db_free(old);
+	}
+}
+
+/*
+ * Loads the database if there is none for hostfile yet and reloads it if
+ * the file has changed. A failed reload keeps the old snapshot.
+ */
+static int rwrap_fake_db_refresh(const char *hostfile)
+{
+	struct rwrap_config *c;
+	struct rwrap_fake_db *db;
+	bool changed;
+	int interval;
+	int rc;
+
+	db = __atomic_load_n(&rwrap_fake.db, __ATOMIC_SEQ_CST);
+	if (db != NULL && strcmp(db->path, hostfile) == 0) {
+		interval = __atomic_load_n(&rwrap_fake.check_interval,
+					   __ATOMIC_RELAXED);
+		if (interval < 0 ||
+		    !rwrap_check_due(&rwrap_fake.last_check, interval)) {
+			return 0;
+		}
+
+		/* Somebody else is checking already, use what we have */
+		rc = pthread_mutex_trylock(&rwrap_fake.lock);
+		if (rc != 0) {
+			return 0;
+		}
+	} else {
+		pthread_mutex_lock(&rwrap_fake.lock);
+	}
+
+	c = rwrap_config_get();
+	__atomic_store_n(&rwrap_fake.check_interval, c->hosts_check_interval,
+			 __ATOMIC_RELAXED);
+	rwrap_fake.cache_size = c->answer_cache_size;
+
+	db = rwrap_fake.db;
+	if (db != NULL && strcmp(db->path, hostfile) == 0) {
+		changed = rwrap_fake_db_changed(db);
+		if (!changed) {
+			pthread_mutex_unlock(&rwrap_fake.lock);
+			return 0;
+		}
+
+		RWRAP_LOG(RWRAP_LOG_DEBUG,
+			  "Fake hosts file %s changed, reloading\n", hostfile);
+
+		db = rwrap_fake_db_load(hostfile);
+		if (db != NULL) {
+			rwrap_fake_db_publish(db);
+		}
+		pthread_mutex_unlock(&rwrap_fake.lock);
+		return 0;
+	}
+
+	db = rwrap_fake_db_load(hostfile);
+	if (db == NULL) {
+		pthread_mutex_unlock(&rwrap_fake.lock);
+		return -1;
+	}
+
+	if (rwrap_fake.check_interval >= 0) {
+		rwrap_fake_db_watch(db);
+	}
+	rwrap_fake_db_publish(db);
+	pthread_mutex_unlock(&rwrap_fake.lock);
+
+	return 0;
+}
+
+/*
+ * Returns the current snapshot of the fake hosts database for hostfile. The
+ * snapshot stays valid until it is released with rwrap_fake_db_put().
+ */
+static struct rwrap_fake_db *rwrap_fake_db_get(const char *hostfile,
+					       unsigned int *idx)
+{
+	struct rwrap_fake_db *db;
+	int rc;
+
+	rc = rwrap_fake_db_refresh(hostfile);
+	if (rc != 0) {
+		return NULL;
+	}
+
+	*idx = __atomic_load_n(&rwrap_fake.epoch, __ATOMIC_SEQ_CST) & 1;
+	__atomic_fetch_add(&rwrap_fake.readers[*idx], 1, __ATOMIC_SEQ_CST);
+
+	db = __atomic_load_n(&rwrap_fake.db, __ATOMIC_SEQ_CST);
+	if (db == NULL || strcmp(db->path, hostfile) != 0) {
+		/* Replaced by a different file in the meantime */
+		__atomic_fetch_sub(&rwrap_fake.readers[*idx], 1,
+				   __ATOMIC_SEQ_CST);
+		return rwrap_fake_db_get(hostfile, idx);
+	}
+
+	return db;
+}
+
+static void rwrap_fake_db_put(unsigned int idx)
+{
+	__atomic_fetch_sub(&rwrap_fake.readers[idx], 1, __ATOMIC_SEQ_CST);
+}
+
+/* Returns false if the name neither owns records nor is a parent of one */
+static bool rwrap_fake_db_may_contain(struct rwrap_fake_db *db,
+				      uint32_t name_hash)
+{
+	uint32_t probes[RWRAP_FAKE_BLOOM_PROBES];
+	size_t i;
+
+	rwrap_fake_bloom_probes(name_hash, db->hdr->bloom_bits, probes);
+	for (i = 0; i < RWRAP_FAKE_BLOOM_PROBES; i++) {
+		uint32_t bit = 1U << (probes[i] % 32);
+
+		if ((db->bloom[probes[i] / 32] & bit) == 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Writes the name in wire format to wire, which has NS_MAXCDNAME bytes */
+static size_t rwrap_fake_db_name_wire(struct rwrap_fake_db *db,
+				      uint32_t id,
+				      uint8_t *wire)
+{
+	size_t len = db->names[id].len;
+	uint8_t *p = wire;
+
+	for (; id != RWRAP_FAKE_NAME_ROOT; id = db->names[id].parent) {
+		const uint8_t *label =
+			(const uint8_t *)db->data + db->names[id].label;
+
+		memcpy(p, label, label[0] + 1);
+		p += label[0] + 1;
+	}
+	*p = 0;
+
+	return len;
+}
+
+#ifndef NDEBUG
+/* For log messages */
+static const char *rwrap_fake_db_name_str(struct rwrap_fake_db *db,
+					  uint32_t id,
+					  char *buf,
+					  size_t size)
+{
+	uint8_t wire[NS_MAXCDNAME];
+
+	rwrap_fake_db_name_wire(db, id, wire);
+	if (ns_name_ntop(wire, buf, size) < 0) {
+		snprintf(buf, size, "#%u", id);
+	}
+
+	return buf;
+}
+#endif /* NDEBUG */
+
+static bool rwrap_fake_db_name_equal(struct rwrap_fake_db *db,
+				     uint32_t id,
+				     const uint8_t *wire)
+{
+	for (; id != RWRAP_FAKE_NAME_ROOT; id = db->names[id].parent) {
+		const uint8_t *label =
+			(const uint8_t *)db->data + db->names[id].label;
+
+		if (memcmp(label, wire, label[0] + 1) != 0) {
+			return false;
+		}
+		wire += label[0] + 1;
+	}
+
+	return true;
+}
+
+/* Returns the bucket of the chain of names with the hash */
+static uint32_t rwrap_fake_db_bucket(struct rwrap_fake_db *db,
+				     uint32_t name_hash)
+{
+	const struct rwrap_fake_db_header *hdr = db->hdr;
+	uint32_t disp;
+
+	if (hdr->mph_size == 0) {
+		return name_hash & (hdr->nbuckets - 1);
+	}
+
+	disp = db->mph[rwrap_fake_mph_disp(name_hash, hdr->mph_size)];
+
+	return rwrap_fake_mph_bucket(name_hash, disp, hdr->nbuckets);
+}
+
+/* Returns the id of the name in wire format if it exists, or 0 */
+static uint32_t rwrap_fake_db_name(struct rwrap_fake_db *db,
+				   const uint8_t *wire,
+				   size_t len,
+				   uint32_t name_hash)
+{
+	uint32_t id;
+
+	if (!rwrap_fake_db_may_contain(db, name_hash)) {
+		return RWRAP_FAKE_NAME_ROOT;
+	}
+
+	for (id = db->buckets[rwrap_fake_db_bucket(db, name_hash)];
+	     id != RWRAP_FAKE_NAME_ROOT;
+	     id = db->slots[id].next) {
+		if (db->slots[id].hash == name_hash &&
+		    db->names[id].len == len &&
+		    rwrap_fake_db_name_equal(db, id, wire)) {
+			return id;
+		}
+	}
+
+	return RWRAP_FAKE_NAME_ROOT;
+}
+
+/* Returns the id of the child of parent with the label if it exists, or 0 */
+static uint32_t rwrap_fake_db_child(struct rwrap_fake_db *db,
+				    uint32_t parent,
+				    const uint8_t *label)
+{
+	uint32_t mask = db->hdr->trie_size - 1;
+	uint32_t i = rwrap_fake_intern_hash(label, parent) & mask;
+	uint32_t id;
+
+	for (; (id = db->trie[i]) != RWRAP_FAKE_NAME_ROOT; i = (i + 1) & mask) {
+		const struct rwrap_fake_name *name = &db->names[id];
+
+		if (name->parent == parent &&
+		    memcmp(db->data + name->label, label, label[0] + 1) == 0) {
+			return id;
+		}
+	}
+
+	return RWRAP_FAKE_NAME_ROOT;
+}
+
+/*
+ * Returns the id of the wildcard the records of a name in wire format are
+ * synthesized from (RFC 4592), or 0. The labels are looked up from the root
+ * down to the closest encloser, the longest existing ancestor of the name,
+ * and only its wildcard applies. A name which exists is not synthesized.
+ */
+static uint32_t rwrap_fake_db_wildcard(struct rwrap_fake_db *db,
+				       const uint8_t *wire)
+{
+	static const uint8_t asterisk[] = { 1, '*' };
+	const uint8_t *labels[NS_MAXCDNAME / 2];
+	size_t nlabels = 0;
+	const uint8_t *p;
+	uint32_t id = RWRAP_FAKE_NAME_ROOT;
+	uint32_t child;
+
+	if (db->hdr->trie_size == 0) {
+		return RWRAP_FAKE_NAME_ROOT;
+	}
+
+	for (p = wire; *p != 0; p += *p + 1) {
+		labels[nlabels++] = p;
+	}
+
+	for (;;) {
+		if (nlabels == 0) {
+			return RWRAP_FAKE_NAME_ROOT;
+		}
+
+		child = rwrap_fake_db_child(db, id, labels[nlabels - 1]);
+		if (child == RWRAP_FAKE_NAME_ROOT) {
+			break;
+		}
+		id = child;
+		nlabels--;
+	}
+
+	return rwrap_fake_db_child(db, id, asterisk);
+}
+
+/* Finds the record of the name a query for type is answered with */
+static const struct rwrap_fake_record *rwrap_fake_db_find(
+						struct rwrap_fake_db *db,
+						uint32_t id,
+						int type)
+{
+	const struct rwrap_fake_name *name = &db->names[id];
+	const struct rwrap_fake_record *rec;
+	uint32_t i;
+
+	/* ANY is answered with the whole group of records of the name */
+	if (type == ns_t_any) {
+		return name->nrecords > 0 ? &db->records[name->records] : NULL;
+	}
+
+	for (i = 0; i < name->nrecords; i++) {
+		rec = &db->records[name->records + i];
+
+		/* An A query is answered by the first A or CNAME line */
+		if (rec->type == type ||
+		    (type == ns_t_a && rec->type == ns_t_cname)) {
+			return rec;
+		}
+	}
+
+	return NULL;
+}
+
+/* Finds the record a target of a record of type with glue resolves to */
+static const struct rwrap_fake_record *rwrap_fake_db_resolve_target(
+						struct rwrap_fake_db *db,
+						uint32_t target,
+						int type)
+{
+	const struct rwrap_fake_record *next;
+
+	next = rwrap_fake_db_find(db, target, ns_t_a);
+	if (next == NULL) {
+		next = rwrap_fake_db_find(db, target, ns_t_aaaa);
+	}
+	if (next == NULL && type == ns_t_cname) {
+		next = rwrap_fake_db_find(db, target, ns_t_cname);
+	}
+
+	return next;
+}
+
+/* Finds the record the target of a record with glue resolves to */
+static const struct rwrap_fake_record *rwrap_fake_db_resolve(
+					struct rwrap_fake_db *db,
+					const struct rwrap_fake_record *rec)
+{
+	const struct rwrap_rr_type *t = rwrap_rr_type_get(rec->type);
+	uint32_t target = rec->target;
+
+	if (t == NULL || !t->glue) {
+		return NULL;
+	}
+
+	if (db->names[target].nrecords == 0 && db->hdr->trie_size != 0) {
+		uint8_t wire[NS_MAXCDNAME];
+		uint32_t id;
+
+		rwrap_fake_db_name_wire(db, target, wire);
+		id = rwrap_fake_db_wildcard(db, wire);
+		if (id != RWRAP_FAKE_NAME_ROOT) {
+			target = id;
+		}
+	}
+
+	return rwrap_fake_db_resolve_target(db, target, rec->type);
+}
+
+/*
+ * Returns the index of the first pattern record which matches the
+ * lower-cased name and answers a query for type, or -1. With ns_t_invalid
+ * a record of any type matches.
+ */
+static ssize_t rwrap_fake_db_pattern(struct rwrap_fake_db *db,
+				     const char *key,
+				     size_t len,
+				     int type)
+{
+	const struct rwrap_fake_matcher *m = db->matcher;
+	int16_t caps[2 * (RWRAP_RE_MAX_GROUPS + 1)];
+	uint32_t s = 1;
+	size_t i;
+
+#define RWRAP_PATTERN_ANSWERS(i) \
+	(type == ns_t_invalid || db->patterns[i].type == type || \
+	 (type == ns_t_a && db->patterns[i].type == ns_t_cname))
+
+	if (m == NULL) {
+		return -1;
+	}
+
+	if (m->next == NULL) {
+		for (i = 0; i < m->n; i++) {
+			if (RWRAP_PATTERN_ANSWERS(i) &&
+			    rwrap_re_match(&m->re[i], key, len, caps) == 0) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	for (i = 0; i < len && s != 0; i++) {
+		s = m->next[(size_t)s * m->nclasses +
+			    m->classes[(uint8_t)key[i]]];
+	}
+
+	for (i = m->accept_off[s]; i < m->accept_off[s + 1]; i++) {
+		if (RWRAP_PATTERN_ANSWERS(m->accept[i])) {
+			return m->accept[i];
+		}
+	}
+#undef RWRAP_PATTERN_ANSWERS
+
+	return -1;
+}
+
+/* Returns the first entry of the reverse index for the address and the count */
+static const struct rwrap_fake_ptr *rwrap_fake_db_ptrs(
+					struct rwrap_fake_db *db,
+					const struct rwrap_fake_ptr *key,
+					uint32_t *n)
+{
+	uint32_t lo = 0;
+	uint32_t hi = db->hdr->nptrs;
+	uint32_t mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rwrap_fake_ptr_cmp(&db->ptrs[mid], key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (hi = lo; hi < db->hdr->nptrs; hi++) {
+		if (rwrap_fake_ptr_cmp(&db->ptrs[hi], key) != 0) {
+			break;
+		}
+	}
+	*n = hi - lo;
+
+	return &db->ptrs[lo];
+}
+
+/*
+ * Resolves the target of every record with glue to the record it points
+ * to, so answers follow the chain without looking anything up. Every record
+ * has one successor at most, a loop of CNAMEs is reported once and cut where
+ * it closes.
+ */
+static int rwrap_fake_db_link(struct rwrap_fake_db *db,
+			      struct rwrap_fake_record *records)
+{
+	const struct rwrap_fake_record *next;
+	uint32_t nrecords = db->hdr->nrecords;
+	uint8_t *state;
+	uint32_t i;
+	uint32_t j;
+	uint32_t prev;
+
+	for (i = 0; i < nrecords; i++) {
+		next = rwrap_fake_db_resolve(db, &records[i]);
+		records[i].chain = next == NULL ? 0 : next - records + 1;
+	}
+
+	/* 0 is unvisited, 1 is on the current path, 2 is done */
+	state = calloc(nrecords, sizeof(uint8_t));
+	if (state == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < nrecords; i++) {
+		prev = 0;
+		for (j = i + 1; j != 0 && state[j - 1] == 0;
+		     j = records[j - 1].chain) {
+			state[j - 1] = 1;
+			prev = j;
+		}
+
+		if (j != 0 && state[j - 1] == 1) {
+#ifndef NDEBUG
+			char name[MAXDNAME];
+
+			RWRAP_LOG(RWRAP_LOG_ERROR,
+				  "CNAME loop at [%s] in %s\n",
+				  rwrap_fake_db_name_str(db,
+							 records[j - 1].name,
+							 name, sizeof(name)),
+				  db->path);
+#endif
+			records[prev - 1].chain = 0;
+		}
+
+		for (j = i + 1; j != 0 && state[j - 1] == 1;
+		     j = records[j - 1].chain) {
+			state[j - 1] = 2;
+		}
+	}
+
+	free(state);
+
+	return 0;
+}
+
+int rwrap_fake_hosts_compile(const char *hostfile, const char *dbfile);
+
+/*
+ * Writes the database of hostfile to dbfile, this is used by rwrap_compile.
+ * The file is replaced atomically so it can be compiled while it is in use.
+ */
+int rwrap_fake_hosts_compile(const char *hostfile, const char *dbfile)
+{
+	struct rwrap_fake_db *db;
+	const uint8_t *image;
+	unsigned int idx;
+	size_t len;
+	char *tmp;
+	size_t written = 0;
+	int fd;
+	int rc = -1;
+
+	rwrap_config_hold(&idx);
+	db = rwrap_fake_db_load(hostfile);
+	rwrap_config_put(idx);
+	if (db == NULL) {
+		return -1;
+	}
+
+	image = (const uint8_t *)db->hdr;
+	len = (size_t)db->hdr->data_off + db->hdr->data_len;
+
+	tmp = malloc(strlen(dbfile) + sizeof(".XXXXXX"));
+	if (tmp == NULL) {
+		rwrap_fake_db_free(db);
+		return -1;
+	}
+	sprintf(tmp, "%s.XXXXXX", dbfile);
+
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Creating %s failed: %s", tmp, strerror(errno));
+		goto done;
+	}
+
+	while (written < len) {
+		ssize_t n = write(fd, image + written, len - written);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		written += n;
+	}
+
+	if (written != len || fchmod(fd, 0644) != 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Writing %s failed: %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		goto done;
+	}
+	close(fd);
+
+	rc = rename(tmp, dbfile);
+	if (rc != 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Renaming %s failed: %s", tmp, strerror(errno));
+		unlink(tmp);
+	}
+
+done:
+	free(tmp);
+	rwrap_fake_db_free(db);
+	return rc;
+}
+
+/*
+ * Builds a DNS message in the buffer of the caller. Names are written from
+ * their wire format and compressed against the names written before, the
+ * offsets of all labels which can be pointed to are kept for the whole
+ * message.
+ */
+#define RWRAP_MSG_LABELS 64
+
+struct rwrap_msg {
+	uint8_t *buf;
+	size_t size;
+	size_t len;
+
+	uint16_t labels[RWRAP_MSG_LABELS];
+	size_t nlabels;
+
+	/* the name of the question in wire format */
+	uint8_t qname[NS_MAXCDNAME];
+
+	/* RRsets start at this record with RESOLV_WRAPPER_RRSET_ORDER=cyclic */
+	bool cyclic;
+	unsigned int rotate;
+	bool rotated;
+};
+
+static void rwrap_msg_init(struct rwrap_msg *msg, uint8_t *buf, size_t size)
+{
+	msg->buf = buf;
+	msg->size = size;
+	msg->len = 0;
+	msg->nlabels = 0;
+	msg->cyclic = false;
+	msg->rotate = 0;
+	msg->rotated = false;
+}
+
+static bool rwrap_msg_space(struct rwrap_msg *msg, size_t n)
+{
+	if (msg->size - msg->len < n) {
+		RWRAP_LOG(RWRAP_LOG_ERROR, "Buffer too small!\n");
+		return false;
+	}
+
+	return true;
+}
+
+static int rwrap_msg_put(struct rwrap_msg *msg, const void *data, size_t n)
+{
+	if (!rwrap_msg_space(msg, n)) {
+		return -1;
+	}
+
+	memcpy(msg->buf + msg->len, data, n);
+	msg->len += n;
+
+	return 0;
+}
+
+static int rwrap_msg_put16(struct rwrap_msg *msg, uint16_t val)
+{
+	uint8_t *p = msg->buf + msg->len;
+
+	if (!rwrap_msg_space(msg, NS_INT16SZ)) {
+		return -1;
+	}
+
+	NS_PUT16(val, p);
+	msg->len += NS_INT16SZ;
+
+	return 0;
+}
+
+static int rwrap_msg_put32(struct rwrap_msg *msg, uint32_t val)
+{
+	uint8_t *p = msg->buf + msg->len;
+
+	if (!rwrap_msg_space(msg, NS_INT32SZ)) {
+		return -1;
+	}
+
+	NS_PUT32(val, p);
+	msg->len += NS_INT32SZ;
+
+	return 0;
+}
+
+/*
+ * Compares the name in wire format with the name written to the message at
+ * off, ignoring the case. Pointers in the message only come from
+ * rwrap_msg_name() and always point back to a label.
+ */
+static bool rwrap_msg_name_equal(struct rwrap_msg *msg,
+				 const uint8_t *name,
+				 size_t off)
+{
+	const uint8_t *buf = msg->buf;
+	uint8_t len;
+	uint8_t i;
+
+	for (;;) {
+		len = buf[off];
+		while ((len & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+			off = ((len & ~NS_CMPRSFLGS) << 8) | buf[off + 1];
+			len = buf[off];
+		}
+
+		if (len != *name) {
+			return false;
+		}
+		if (len == 0) {
+			return true;
+		}
+
+		for (i = 1; i <= len; i++) {
+			if (RWRAP_TOLOWER(buf[off + i]) !=
+			    RWRAP_TOLOWER(name[i])) {
+				return false;
+			}
+		}
+
+		name += len + 1;
+		off += len + 1;
+	}
+}
+
+/*
+ * Writes an uncompressed name in wire format. The longest suffix which is
+ * already in the message is replaced by a pointer to it, the labels in front
+ * of it are remembered for the names which follow.
+ */
+static int rwrap_msg_name(struct rwrap_msg *msg, const uint8_t *name)
+{
+	const uint8_t *suffix;
+	const uint8_t *p;
+	size_t prefix_len;
+	size_t ptr = 0;
+	size_t i;
+
+	for (suffix = name; *suffix != 0; suffix += *suffix + 1) {
+		for (i = 0; i < msg->nlabels; i++) {
+			if (rwrap_msg_name_equal(msg, suffix, msg->labels[i])) {
+				ptr = msg->labels[i];
+				goto found;
+			}
+		}
+	}
+
+found:
+	prefix_len = suffix - name;
+	if (!rwrap_msg_space(msg, prefix_len + (ptr != 0 ? NS_INT16SZ : 1))) {
+		return -1;
+	}
+
+	for (p = name; p < suffix; p += *p + 1) {
+		size_t off = msg->len + (p - name);
+
+		if (off >= 0x4000 || msg->nlabels == RWRAP_MSG_LABELS) {
+			break;
+		}
+		msg->labels[msg->nlabels++] = off;
+	}
+
+	memcpy(msg->buf + msg->len, name, prefix_len);
+	msg->len += prefix_len;
+
+	if (ptr != 0) {
+		/* the header comes first, so 0 is never a name */
+		msg->buf[msg->len++] = NS_CMPRSFLGS | (ptr >> 8);
+		msg->buf[msg->len++] = ptr & 0xff;
+	} else {
+		msg->buf[msg->len++] = 0;
+	}
+
+	return 0;
+}
+
+static int rwrap_msg_header(struct rwrap_msg *msg,
+			    size_t ancount,
+			    size_t arcount)
+{
+	HEADER *h;
+
+	if (!rwrap_msg_space(msg, NS_HFIXEDSZ)) {
+		return -1;
+	}
+
+	h = (HEADER *)(msg->buf + msg->len);
+	memset(h, 0, NS_HFIXEDSZ);
+
+	h->id = rwrap_random_id();	/* random query ID */
+	h->qr = 1;			/* response flag */
+	h->rd = 1;			/* recursion desired */
+	h->ra = 1;			/* resursion available */
+
+	h->qdcount = htons(1);		/* no. of questions */
+	h->ancount = htons(ancount);	/* no. of answers */
+	h->arcount = htons(arcount);	/* no. of add'tl records */
+
+	msg->len += NS_HFIXEDSZ;
+
+	return 0;
+}
+
+/* Sets the counts of the header once the records are written */
+static void rwrap_msg_counts(struct rwrap_msg *msg,
+			     size_t ancount,
+			     size_t arcount)
+{
+	HEADER *h = (HEADER *)msg->buf;
+
+	h->ancount = htons(ancount);
+	h->arcount = htons(arcount);
+}
+
+/* The question is the only name which is not encoded in the database */
+static int rwrap_msg_question(struct rwrap_msg *msg,
+			      const char *question,
+			      uint16_t type)
+{
+	int n;
+
+	n = ns_name_compress(question, msg->qname, sizeof(msg->qname),
+			     NULL, NULL);
+	if (n < 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Failed to compress [%s]\n", question);
+		return -1;
+	}
+
+	if (rwrap_msg_name(msg, msg->qname) != 0 ||
+	    rwrap_msg_put16(msg, type) != 0 ||
+	    rwrap_msg_put16(msg, ns_c_in) != 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes everything of a RR up to the RDATA. The RDATA length is filled in
+ * by rwrap_msg_rr_end() once the RDATA is written.
+ */
+static int rwrap_msg_rr_begin(struct rwrap_msg *msg,
+			      const uint8_t *owner,
+			      uint16_t type,
+			      size_t *rdlen_off)
+{
+	if (rwrap_msg_name(msg, owner) != 0 ||
+	    rwrap_msg_put16(msg, type) != 0 ||
+	    rwrap_msg_put16(msg, ns_c_in) != 0 ||
+	    rwrap_msg_put32(msg, RWRAP_DEFAULT_FAKE_TTL) != 0) {
+		return -1;
+	}
+
+	*rdlen_off = msg->len;
+
+	return rwrap_msg_put16(msg, 0);
+}
+
+static void rwrap_msg_rr_end(struct rwrap_msg *msg, size_t rdlen_off)
+{
+	uint8_t *p = msg->buf + rdlen_off;
+
+	NS_PUT16(msg->len - rdlen_off - NS_INT16SZ, p);
+}
+
+/*
+ * Writes the names at the start of a stored RDATA compressed, they were
+ * checked by rwrap_fake_rdata_valid() when the database was loaded.
+ */
+static int rwrap_msg_rdata_names(struct rwrap_msg *msg,
+				 const uint8_t *rdata,
+				 size_t rdlen,
+				 int nnames)
+{
+	const uint8_t *p = rdata;
+	const uint8_t *end = rdata + rdlen;
+	int i;
+
+	for (i = 0; i < nnames; i++) {
+		if (rwrap_msg_name(msg, p) != 0) {
+			return -1;
+		}
+		while (*p != 0) {
+			p += *p + 1;
+		}
+		p++;
+	}
+
+	/* The rest are integers */
+	return rwrap_msg_put(msg, p, end - p);
+}
+
+/* The RDATA is stored in wire format already */
+static int rwrap_rr_encode_rdata(struct rwrap_msg *msg,
+				 const uint8_t *rdata,
+				 size_t rdlen,
+				 const uint8_t *target)
+{
+	(void)target; /* unused */
+
+	return rwrap_msg_put(msg, rdata, rdlen);
+}
+
+/* The RDATA ends with the target, which is compressed */
+static int rwrap_rr_encode_name(struct rwrap_msg *msg,
+				const uint8_t *rdata,
+				size_t rdlen,
+				const uint8_t *target)
+{
+	if (rwrap_msg_put(msg, rdata, rdlen) != 0) {
+		return -1;
+	}
+
+	return rwrap_msg_name(msg, target);
+}
+
+static int rwrap_rr_encode_srv(struct rwrap_msg *msg,
+			       const uint8_t *rdata,
+			       size_t rdlen,
+			       const uint8_t *target)
+{
+	const uint8_t *p;
+
+	if (rwrap_msg_put(msg, rdata, rdlen) != 0) {
+		return -1;
+	}
+
+	for (p = target; *p != 0; p += *p + 1) {
+		;
+	}
+
+	return rwrap_msg_put(msg, target, p - target + 1);
+}
+
+static int rwrap_rr_encode_soa(struct rwrap_msg *msg,
+			       const uint8_t *rdata,
+			       size_t rdlen,
+			       const uint8_t *target)
+{
+	(void)target; /* unused */
+
+	return rwrap_msg_rdata_names(msg, rdata, rdlen, 2);
+}
+
+/*
+ * Adds a record with the owner in wire format. The owner is not the name of
+ * the record when it was synthesized from a wildcard.
+ */
+static int rwrap_msg_add_rr(struct rwrap_msg *msg,
+			    struct rwrap_fake_db *db,
+			    const uint8_t *owner,
+			    const struct rwrap_fake_record *rec)
+{
+	const uint8_t *rdata = (const uint8_t *)db->data + rec->rdata;
+	const uint8_t *target = NULL;
+	size_t rdlen_off;
+	int rc;
+
+	uint8_t wire[NS_MAXCDNAME];
+
+	RWRAP_LOG(RWRAP_LOG_TRACE, "Adding RR of type %d", rec->type);
+
+	rc = rwrap_msg_rr_begin(msg, owner, rec->type, &rdlen_off);
+	if (rc != 0) {
+		return -1;
+	}
+
+	if (rec->target != RWRAP_FAKE_NAME_ROOT) {
+		rwrap_fake_db_name_wire(db, rec->target, wire);
+		target = wire;
+	}
+
+	/* The type was checked when the database was loaded */
+	rc = rwrap_rr_type_get(rec->type)->encode(msg, rdata, rec->rdlen,
+						  target);
+	if (rc != 0) {
+		return -1;
+	}
+
+	rwrap_msg_rr_end(msg, rdlen_off);
+
+	return 0;
+}
+
+static const struct rwrap_fake_record *rwrap_fake_next(
+					struct rwrap_fake_db *db,
+					const struct rwrap_fake_record *rec)
+{
+	return rec->chain == 0 ? NULL : &db->records[rec->chain - 1];
+}
+
+/* Returns the number of records of the RRset which starts with rec */
+static uint32_t rwrap_fake_rrset_len(struct rwrap_fake_db *db,
+				     const struct rwrap_fake_record *rec)
+{
+	const struct rwrap_fake_name *name = &db->names[rec->name];
+	const struct rwrap_fake_record *end =
+		&db->records[name->records + name->nrecords];
+	const struct rwrap_fake_record *p;
+
+	/* A name has a single CNAME (RFC 2181), the others are ignored */
+	if (rec->type == ns_t_cname) {
+		return 1;
+	}
+
+	for (p = rec + 1; p < end && p->type == rec->type; p++) {
+		;
+	}
+
+	return p - rec;
+}
+
+/* Whether the chain which starts with rr has a record of the type */
+static bool rwrap_fake_chain_has(struct rwrap_fake_db *db,
+				 const struct rwrap_fake_record *rr,
+				 int type)
+{
+	for (; rr != NULL; rr = rwrap_fake_next(db, rr)) {
+		if (rr->type == type) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Adds the RRset which starts with rr from the record msg->rotate points
+ * to. A packed RRset is copied in one go, only its first owner is written
+ * as a name and the others point to it. Returns the number of records.
+ */
+static int rwrap_msg_add_rrset(struct rwrap_msg *msg,
+			       struct rwrap_fake_db *db,
+			       const uint8_t *owner,
+			       const struct rwrap_fake_record *rr)
+{
+	uint32_t n = rwrap_fake_rrset_len(db, rr);
+	uint32_t first = msg->rotate % n;
+	size_t size = RWRAP_FAKE_RR_HDR + rr->rdlen;
+	size_t start = msg->len;
+	const uint8_t *block;
+	uint16_t ptr;
+	uint8_t *p;
+	uint32_t i;
+
+	if (n > 1 && msg->cyclic) {
+		msg->rotated = true;
+	}
+
+	if (n == 1 || !rwrap_fake_type_packed(rr->type) ||
+	    rr[n - 1].rdlen != rr->rdlen ||
+	    (int64_t)rr[n - 1].rdata - rr->rdata != (int64_t)((n - 1) * size) ||
+	    start >= 0x4000) {
+		for (i = 0; i < n; i++) {
+			if (rwrap_msg_add_rr(msg, db, owner,
+					     &rr[(first + i) % n]) != 0) {
+				return -1;
+			}
+		}
+		return n;
+	}
+
+	if (rwrap_msg_name(msg, owner) != 0) {
+		return -1;
+	}
+	if (msg->len - start == NS_INT16SZ) {
+		ptr = msg->buf[start] << 8 | msg->buf[start + 1];
+	} else {
+		ptr = NS_CMPRSFLGS << 8 | start;
+	}
+
+	block = (const uint8_t *)db->data + rr->rdata - RWRAP_FAKE_RR_HDR;
+	if (rwrap_msg_put(msg, block + first * size + NS_INT16SZ,
+			  size - NS_INT16SZ) != 0 ||
+	    rwrap_msg_put(msg, block + (first + 1) * size,
+			  (n - first - 1) * size) != 0 ||
+	    rwrap_msg_put(msg, block, first * size) != 0) {
+		return -1;
+	}
+
+	/* The packed owners point to the question */
+	if (ptr != RWRAP_FAKE_RR_QNAME) {
+		p = msg->buf + msg->len - (n - 1) * size;
+		for (i = 1; i < n; i++) {
+			uint8_t *q = p;
+
+			NS_PUT16(ptr, q);
+			p += size;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Adds the RRsets of the name of rr in one walk over its group of records,
+ * only the addresses if addrs is set. Returns the number of records.
+ */
+static int rwrap_msg_add_group(struct rwrap_msg *msg,
+			       struct rwrap_fake_db *db,
+			       const uint8_t *owner,
+			       const struct rwrap_fake_record *rr,
+			       bool addrs)
+{
+	const struct rwrap_fake_name *name = &db->names[rr->name];
+	const struct rwrap_fake_record *end =
+		&db->records[name->records + name->nrecords];
+	const struct rwrap_fake_record *p;
+	int count = 0;
+	int n;
+
+	for (rr = &db->records[name->records]; rr < end; rr = p) {
+		for (p = rr + 1; p < end && p->type == rr->type; p++) {
+			;
+		}
+		if (addrs && rr->type != ns_t_a && rr->type != ns_t_aaaa) {
+			continue;
+		}
+
+		n = rwrap_msg_add_rrset(msg, db, owner, rr);
+		if (n < 0) {
+			return -1;
+		}
+		count += n;
+	}
+
+	return count;
+}
+
+/*
+ * Adds the RRsets along the chain which starts with rr, owned by owner. If
+ * answers is set they are answers up to the RRset of the queried type, the
+ * others are additional records. Every record of an SRV RRset brings the
+ * A and AAAA RRsets of its target. The chain and the one of every target
+ * may have at most left records, else the answer fails.
+ */
+static int rwrap_msg_add_chain(struct rwrap_msg *msg,
+			       struct rwrap_fake_db *db,
+			       const uint8_t *owner,
+			       const struct rwrap_fake_record *rr,
+			       int type,
+			       bool answers,
+			       unsigned int left,
+			       int *ancount,
+			       int *arcount)
+{
+	uint8_t wire[NS_MAXCDNAME];
+	int n;
+	int i;
+	int j;
+
+	for (; rr != NULL; rr = rwrap_fake_next(db, rr)) {
+		if (left-- == 0) {
+			RWRAP_LOG(RWRAP_LOG_ERROR,
+				  "Chain is longer than %u records\n",
+				  rwrap_config_get()->max_chain_length);
+			return -1;
+		}
+
+		/* A target brings both its A and AAAA RRsets */
+		if (!answers &&
+		    (rr->type == ns_t_a || rr->type == ns_t_aaaa)) {
+			n = rwrap_msg_add_group(msg, db, owner, rr, true);
+		} else {
+			n = rwrap_msg_add_rrset(msg, db, owner, rr);
+		}
+		if (n < 0) {
+			return -1;
+		}
+
+		if (answers) {
+			*ancount += n;
+		} else {
+			*arcount += n;
+		}
+		if (rr->type == type) {
+			answers = false;
+		}
+
+		/* The chain of the first record is followed below */
+		for (i = 1; rwrap_rr_type_get(rr->type)->glue && i < n; i++) {
+			for (j = 0; j < i; j++) {
+				if (rr[j].target == rr[i].target) {
+					break;
+				}
+			}
+			if (j < i) {
+				continue;
+			}
+
+			rwrap_fake_db_name_wire(db, rr[i].target, wire);
+			if (rwrap_msg_add_chain(msg, db, wire,
+						rwrap_fake_next(db, &rr[i]),
+						type, false, left,
+						ancount, arcount) != 0) {
+				return -1;
+			}
+		}
+
+		/* The next record in the chain is owned by the target */
+		rwrap_fake_db_name_wire(db, rr->target, wire);
+		owner = wire;
+	}
+
+	return 0;
+}
+
+/* Picks the record RRsets start at, with RESOLV_WRAPPER_RRSET_ORDER=cyclic */
+static void rwrap_msg_rotate(struct rwrap_msg *msg, struct rwrap_fake_db *db)
+{
+	if (rwrap_config_get()->rrset_cyclic) {
+		msg->cyclic = true;
+		msg->rotate = __atomic_fetch_add(&db->rotation, 1,
+						 __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Finds the first record of the answer to a query, the rest is its chain.
+ * The key is the lower-cased query name.
+ */
+static int rwrap_get_record(struct rwrap_fake_db *db,
+			    const char *key, size_t len, int type,
+			    const struct rwrap_fake_record **rr)
+{
+	uint8_t wire[NS_MAXCDNAME];
+	ssize_t wire_len;
+	uint32_t id;
+
+	wire_len = rwrap_fake_key_wire(key, len, wire);
+	if (wire_len < 0) {
+		return ENOENT;
+	}
+
+	id = rwrap_fake_db_name(db, wire, wire_len,
+				rwrap_fake_name_hash((const char *)wire,
+						     wire_len));
+	if (id == RWRAP_FAKE_NAME_ROOT) {
+		id = rwrap_fake_db_wildcard(db, wire);
+	}
+	if (id == RWRAP_FAKE_NAME_ROOT) {
+		return ENOENT;
+	}
+
+	*rr = rwrap_fake_db_find(db, id, type);
+	if (*rr == NULL) {
+		return ENOENT;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the id of the longest suffix of a name in wire format which
+ * exists, and whether it is the name itself. A wildcard the name is
+ * synthesized from counts as the name.
+ */
+static uint32_t rwrap_fake_db_encloser(struct rwrap_fake_db *db,
+				       const uint8_t *wire,
+				       size_t len,
+				       bool *exact)
+{
+	const uint8_t *p;
+	uint32_t id;
+
+	*exact = true;
+	id = rwrap_fake_db_name(db, wire, len,
+				rwrap_fake_name_hash((const char *)wire, len));
+	if (id == RWRAP_FAKE_NAME_ROOT) {
+		id = rwrap_fake_db_wildcard(db, wire);
+	}
+	if (id != RWRAP_FAKE_NAME_ROOT) {
+		return id;
+	}
+
+	*exact = false;
+	for (p = wire + *wire + 1; *p != 0; p += *p + 1) {
+		size_t n = len - (p - wire);
+
+		id = rwrap_fake_db_name(db, p, n,
+					rwrap_fake_name_hash((const char *)p,
+							     n));
+		if (id != RWRAP_FAKE_NAME_ROOT) {
+			break;
+		}
+	}
+
+	return id;
+}
+
+/*
+ * Answers a query the file has no record for (RFC 2308). If the name does
+ * not exist, not even as a pattern or an address of the reverse index, the
+ * answer is NXDOMAIN, otherwise NODATA. The SOA of the zone of the closest
+ * name which exists goes to the authority section, with its minimum as the
+ * TTL, so that resolvers cache the answer for as long as the zone says.
+ */
+static ssize_t rwrap_fake_negative(struct rwrap_fake_db *db,
+				   const char *key,
+				   size_t len,
+				   const char *question,
+				   int type,
+				   uint8_t *answer,
+				   size_t anslen)
+{
+	const struct rwrap_fake_record *soa = NULL;
+	const uint8_t *rdata;
+	struct rwrap_fake_ptr addr;
+	struct rwrap_msg msg;
+	uint8_t wire[NS_MAXCDNAME];
+	uint8_t *ttl;
+	ssize_t wire_len;
+	size_t rdlen_off;
+	uint32_t id = RWRAP_FAKE_NAME_ROOT;
+	uint32_t cut;
+	uint32_t n = 0;
+	bool exists = false;
+	HEADER *h;
+
+	wire_len = rwrap_fake_key_wire(key, len, wire);
+	if (wire_len > 1) {
+		id = rwrap_fake_db_encloser(db, wire, wire_len, &exists);
+		if (!exists && rwrap_fake_ptr_addr(wire, &addr) == 0) {
+			rwrap_fake_db_ptrs(db, &addr, &n);
+			exists = n > 0;
+		}
+		if (!exists) {
+			exists = rwrap_fake_db_pattern(db, key, len,
+						       ns_t_invalid) >= 0;
+		}
+	}
+
+	cut = db->cuts[id] & ~RWRAP_FAKE_CUT_EXISTS;
+	if (cut != 0) {
+		soa = rwrap_fake_db_find(db, cut - 1, ns_t_soa);
+	}
+
+	rwrap_msg_init(&msg, answer, anslen);
+
+	if (rwrap_msg_header(&msg, 0, 0) != 0 ||
+	    rwrap_msg_question(&msg, question, type) != 0) {
+		return -1;
+	}
+
+	h = (HEADER *)msg.buf;
+	if (!exists) {
+		h->rcode = ns_r_nxdomain;
+	}
+	if (soa == NULL) {
+		return msg.len;
+	}
+
+	rwrap_fake_db_name_wire(db, cut - 1, wire);
+	rdata = (const uint8_t *)db->data + soa->rdata;
+	if (rwrap_msg_rr_begin(&msg, wire, ns_t_soa, &rdlen_off) != 0 ||
+	    rwrap_rr_encode_soa(&msg, rdata, soa->rdlen, NULL) != 0) {
+		return -1;
+	}
+	rwrap_msg_rr_end(&msg, rdlen_off);
+
+	/* The minimum is the last field of the RDATA */
+	ttl = msg.buf + rdlen_off - NS_INT32SZ;
+	NS_PUT32(MIN(RWRAP_DEFAULT_FAKE_TTL,
+		     ns_get32(rdata + soa->rdlen - NS_INT32SZ)), ttl);
+	h->nscount = htons(1);
+
+	return msg.len;
+}
+
+/*
+ * Answers a query with the chain which starts with rr, or with all records
+ * of its name for ANY. Sets rotated if an RRset was rotated, the answer is
+ * then not cached.
+ */
+static ssize_t rwrap_fake_answer(struct rwrap_fake_db *db,
+				 const struct rwrap_fake_record *rr,
+				 const char *question,
+				 int type,
+				 uint8_t *answer,
+				 size_t anslen,
+				 bool *rotated)
+{
+	struct rwrap_msg msg;
+	int ancount = 0;
+	int arcount = 0;
+
+	rwrap_msg_init(&msg, answer, anslen);
+	rwrap_msg_rotate(&msg, db);
+
+	if (rwrap_msg_header(&msg, 0, 0) != 0 ||
+	    rwrap_msg_question(&msg, question, type) != 0) {
+		return -1;
+	}
+
+	if (type == ns_t_any) {
+		/* The chains of the records are not followed */
+		ancount = rwrap_msg_add_group(&msg, db, msg.qname, rr, false);
+		if (ancount < 0) {
+			return -1;
+		}
+	} else if (rwrap_msg_add_chain(&msg, db, msg.qname, rr, type,
+				       rwrap_fake_chain_has(db, rr, type),
+				       rwrap_config_get()->max_chain_length,
+				       &ancount, &arcount) != 0) {
+		return -1;
+	}
+
+	RWRAP_LOG(RWRAP_LOG_TRACE,
+		  "Got %d answers and %d additional records\n", ancount, arcount);
+	rwrap_msg_counts(&msg, ancount, arcount);
+	*rotated = msg.rotated;
+
+	return msg.len;
+}
+
+/*
+ * Answers a query the file has no record for from the first pattern record
+ * which matches the lower-cased name. Returns 0 if there is none. The target
+ * of a record with glue is resolved against the records of the file.
+ */
+static ssize_t rwrap_fake_pattern_answer(struct rwrap_fake_db *db,
+					 const char *key,
+					 size_t len,
+					 const char *question,
+					 int type,
+					 uint8_t *answer,
+					 size_t anslen,
+					 bool *rotated)
+{
+	const struct rwrap_fake_pattern *pat;
+	const struct rwrap_fake_record *next = NULL;
+	const struct rwrap_rr_type *t;
+	int16_t caps[2 * (RWRAP_RE_MAX_GROUPS + 1)];
+	struct rwrap_fake_rdata rd;
+	struct rwrap_msg msg;
+	char value[MAXDNAME];
+	uint8_t *target = NULL;
+	ssize_t target_len;
+	ssize_t value_len;
+	size_t rdlen_off;
+	size_t rdlen;
+	ssize_t i;
+	uint32_t id;
+	bool answers;
+	int ancount = 0;
+	int arcount = 0;
+
+	i = rwrap_fake_db_pattern(db, key, len, type);
+	if (i < 0) {
+		return 0;
+	}
+	pat = &db->patterns[i];
+
+	RWRAP_LOG(RWRAP_LOG_TRACE,
+		  "[%s] matches pattern [%.*s]\n",
+		  key, (int)pat->source_len, db->data + pat->source);
+
+	/* The DFA does not know the groups, they are only matched if used */
+	memset(caps, 0xff, sizeof(caps));
+	if (memchr(db->data + pat->value, '$', pat->value_len) != NULL &&
+	    rwrap_re_match(&db->matcher->re[i], key, len, caps) != 0) {
+		return -1;
+	}
+
+	value_len = rwrap_fake_pattern_expand(db->data + pat->value,
+					      pat->value_len, key, caps,
+					      value, sizeof(value));
+	if (value_len < 0 ||
+	    rwrap_fake_rdata_parse(pat->type, value, value_len, &rd) != 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Failed to expand [%.*s] for [%s]\n",
+			  (int)pat->value_len, db->data + pat->value, key);
+		return -1;
+	}
+
+	t = rwrap_rr_type_get(pat->type);
+	rdlen = rd.len;
+	if (t->target >= 0) {
+		target = rd.data + t->target;
+		rdlen = t->target;
+	}
 
-	/* Include all RRs in the stack until the sought type
-	 * in the answer section. This is the case i.e. when looking
-	 * up an A record but the name points to a CNAME
-	 */
-	for (i = 0; i < RWRAP_MAX_RECURSION; i++) {
-		ancount++;
+	if (target != NULL && t->glue) {
+		rwrap_wire_tolower(target);
+		target_len = rwrap_wire_name_len(target, rd.data + rd.len);
+		if (target_len < 0) {
+			return -1;
+		}
 
-		if (rwrap_known_type(rrs[i].type) &&
-		    rrs[i].type == qtype) {
-			break;
+		id = rwrap_fake_db_name(db, target, target_len,
+					rwrap_fake_name_hash(
+						(const char *)target,
+						target_len));
+		if (id == RWRAP_FAKE_NAME_ROOT) {
+			id = rwrap_fake_db_wildcard(db, target);
+		}
+		if (id != RWRAP_FAKE_NAME_ROOT) {
+			next = rwrap_fake_db_resolve_target(db, id, pat->type);
 		}
 	}
 
-	/* Return 0 records if the sought type wasn't in the stack */
-	return i < RWRAP_MAX_RECURSION ? ancount : 0;
-}
+	answers = pat->type != type && rwrap_fake_chain_has(db, next, type);
+	if (pat->type == type || answers) {
+		ancount = 1;
+	} else {
+		arcount = 1;
+	}
 
-static int rwrap_arcount(struct rwrap_fake_rr *rrs, int ancount)
-{
-	int i;
-	int arcount = 0;
+	rwrap_msg_init(&msg, answer, anslen);
+	rwrap_msg_rotate(&msg, db);
 
-	/* start from index ancount */
-	for (i = ancount; i < RWRAP_MAX_RECURSION; i++) {
-		if (rwrap_known_type(rrs[i].type)) {
-			arcount++;
-		}
+	if (rwrap_msg_header(&msg, 0, 0) != 0 ||
+	    rwrap_msg_question(&msg, question, type) != 0 ||
+	    rwrap_msg_rr_begin(&msg, msg.qname, pat->type, &rdlen_off) != 0) {
+		return -1;
 	}
 
-	return arcount;
-}
-
-static ssize_t rwrap_add_rr(struct rwrap_fake_rr *rr,
-			    uint8_t *answer,
-			    size_t anslen)
-{
-	ssize_t resp_data;
+	if (t->encode(&msg, rd.data, rdlen, target) != 0) {
+		return -1;
+	}
+	rwrap_msg_rr_end(&msg, rdlen_off);
 
-	switch (rr->type) {
-	case ns_t_a:
-		resp_data = rwrap_fake_a(rr, answer, anslen);
-		break;
-	case ns_t_aaaa:
-		resp_data = rwrap_fake_aaaa(rr, answer, anslen);
-		break;
-	case ns_t_srv:
-		resp_data = rwrap_fake_srv(rr, answer, anslen);
-		break;
-	case ns_t_soa:
-		resp_data = rwrap_fake_soa(rr, answer, anslen);
-		break;
-	case ns_t_cname:
-		resp_data = rwrap_fake_cname(rr, answer, anslen);
-		break;
-	default:
+	/* The record of the pattern is the first one of the chain */
+	if (rwrap_msg_add_chain(&msg, db, target, next, type, answers,
+				rwrap_config_get()->max_chain_length - 1,
+				&ancount, &arcount) != 0) {
 		return -1;
 	}
 
-	return resp_data;
-}
+	rwrap_msg_counts(&msg, ancount, arcount);
+	*rotated = msg.rotated;
 
-static ssize_t rwrap_fake_answer(struct rwrap_fake_rr *rrs,
-				 int type,
-				 uint8_t *answer,
-				 size_t anslen)
+	return msg.len;
+}
 
+/*
+ * Answers a PTR query for a lower-cased name under in-addr.arpa or ip6.arpa
+ * from the reverse index. Returns 0 if the address is not in it.
+ */
+static ssize_t rwrap_fake_ptr_answer(struct rwrap_fake_db *db,
+				     const char *key,
+				     size_t len,
+				     const char *question,
+				     int type,
+				     uint8_t *answer,
+				     size_t anslen,
+				     bool *rotated)
 {
-	ssize_t resp_data;
-	ssize_t rrlen;
-	size_t remaining = anslen;
-	int ancount;
-	int arcount;
-	int i;
+	const struct rwrap_fake_ptr *ptrs;
+	struct rwrap_fake_ptr addr;
+	struct rwrap_msg msg;
+	uint8_t wire[NS_MAXCDNAME];
+	size_t rdlen_off;
+	uint32_t first;
+	uint32_t n;
+	uint32_t i;
+
+	if (type != ns_t_ptr || db->hdr->nptrs == 0 ||
+	    rwrap_fake_key_wire(key, len, wire) < 0 ||
+	    rwrap_fake_ptr_addr(wire, &addr) != 0) {
+		return 0;
+	}
 
-	ancount = rwrap_ancount(rrs, type);
-	arcount = rwrap_arcount(rrs, ancount);
-	RWRAP_LOG(RWRAP_LOG_TRACE,
-		  "Got %d answers and %d additional records\n", ancount, arcount);
+	ptrs = rwrap_fake_db_ptrs(db, &addr, &n);
+	if (n == 0) {
+		return 0;
+	}
 
-	resp_data = rwrap_fake_header(&answer, remaining, ancount, arcount);
-	if (resp_data < 0) {
-		return -1;
+	rwrap_msg_init(&msg, answer, anslen);
+	rwrap_msg_rotate(&msg, db);
+	if (n > 1 && msg.cyclic) {
+		msg.rotated = true;
 	}
-	remaining -= resp_data;
 
-	resp_data += rwrap_fake_question(rrs->key, rrs->type, &answer, remaining);
-	if (resp_data < 0) {
+	if (rwrap_msg_header(&msg, n, 0) != 0 ||
+	    rwrap_msg_question(&msg, question, type) != 0) {
 		return -1;
 	}
-	remaining -= resp_data;
 
-	/* answer */
-	for (i = 0; i < ancount; i++) {
-		rrlen = rwrap_add_rr(&rrs[i], answer, remaining);
-		if (rrlen < 0) {
+	first = msg.rotate % n;
+	for (i = 0; i < n; i++) {
+		rwrap_fake_db_name_wire(db, ptrs[(first + i) % n].target, wire);
+		if (rwrap_msg_rr_begin(&msg, msg.qname, type, &rdlen_off) != 0 ||
+		    rwrap_msg_name(&msg, wire) != 0) {
 			return -1;
 		}
-		remaining -= rrlen;
-		answer += rrlen;
-		resp_data += rrlen;
+		rwrap_msg_rr_end(&msg, rdlen_off);
 	}
 
-	/* add authoritative NS here? */
-
-	/* additional records */
-	for (i = ancount; i < ancount + arcount; i++) {
-		rrlen = rwrap_add_rr(&rrs[i], answer, remaining);
-		if (rrlen < 0) {
-			return -1;
-		}
-		remaining -= rrlen;
-		answer += rrlen;
-		resp_data += rrlen;
-	}
+	*rotated = msg.rotated;
 
-	return resp_data;
+	return msg.len;
 }
 
-/* Reads in a file in the following format:
+/* Answers a query from the fake hosts file. The file is in the following
+ * format:
  * TYPE RDATA
  *
- * Malformed entried are silently skipped.
- * Allocates answer buffer of size anslen that has to be freed after use.
+ * Malformed entried are silently skipped. The file can also be a database
+ * compiled by rwrap_compile. It is only loaded on the first query,
+ * subsequent queries are answered from the in-memory index.
  */
 static int rwrap_res_fake_hosts(const char *hostfile,
 				const char *query,
@@ -921,10 +7249,13 @@ static int rwrap_res_fake_hosts(const char *hostfile,
 				size_t anslen)
 {
 	int rc = ENOENT;
-	char *query_name = NULL;
 	size_t qlen = strlen(query);
-	struct rwrap_fake_rr rrs[RWRAP_MAX_RECURSION];
+	const struct rwrap_fake_record *rr;
+	char key[MAXDNAME];
+	struct rwrap_fake_db *db;
+	unsigned int idx;
 	ssize_t resp_size;
+	bool rotated = false;
 
 	RWRAP_LOG(RWRAP_LOG_TRACE,
 		  "Searching in fake hosts file %s\n", hostfile);
@@ -933,45 +7264,83 @@ static int rwrap_res_fake_hosts(const char *hostfile,
 		qlen--;
 	}
 
-	query_name = strndup(query, qlen);
-	if (query_name == NULL) {
+	if (qlen >= sizeof(key)) {
+		return -1;
+	}
+	rwrap_fold_name(key, query, qlen);
+	key[qlen] = '\0';
+
+	db = rwrap_fake_db_get(hostfile, &idx);
+	if (db == NULL) {
 		return -1;
 	}
 
-	rwrap_fake_rr_init(rrs, RWRAP_MAX_RECURSION);
+	resp_size = rwrap_answer_cache_get(&db->cache, key, query, type,
+					   answer, anslen);
+	if (resp_size != 0) {
+		RWRAP_TRACE(RWRAP_TRACE_FAKE_CACHED, type, resp_size, 0);
+		RWRAP_LOG(RWRAP_LOG_TRACE,
+			  "Cached answer for [%s]\n", query);
+		rwrap_fake_db_put(idx);
+		return resp_size;
+	}
 
-	rc = rwrap_get_record(hostfile, 0, query_name, type, rrs);
+	rc = rwrap_get_record(db, key, qlen, type, &rr);
 	switch (rc) {
 	case 0:
 		RWRAP_LOG(RWRAP_LOG_TRACE,
-				"Found record for [%s]\n", query_name);
-		resp_size = rwrap_fake_answer(rrs, type, answer, anslen);
+				"Found record for [%s]\n", query);
+		resp_size = rwrap_fake_answer(db, rr, query, type,
+					      answer, anslen, &rotated);
+		RWRAP_TRACE(RWRAP_TRACE_FAKE_FOUND, type, resp_size, 0);
+		if (resp_size > 0 && !rotated) {
+			rwrap_answer_cache_put(&db->cache, key, type,
+					       answer, resp_size);
+		}
 		break;
 	case ENOENT:
-		RWRAP_LOG(RWRAP_LOG_TRACE,
-				"No record for [%s]\n", query_name);
-		resp_size = rwrap_fake_empty(type, rrs->key, answer, anslen);
+		resp_size = rwrap_fake_ptr_answer(db, key, qlen, query, type,
+						  answer, anslen, &rotated);
+		if (resp_size == 0) {
+			resp_size = rwrap_fake_pattern_answer(db, key, qlen,
+							      query, type,
+							      answer, anslen,
+							      &rotated);
+		}
+		if (resp_size != 0) {
+			RWRAP_TRACE(RWRAP_TRACE_FAKE_FOUND, type, resp_size, 0);
+		} else {
+			RWRAP_LOG(RWRAP_LOG_TRACE,
+					"No record for [%s]\n", query);
+			resp_size = rwrap_fake_negative(db, key, qlen, query,
+							type, answer, anslen);
+			RWRAP_TRACE(RWRAP_TRACE_FAKE_NOTFOUND, type, 0, 0);
+		}
+		if (resp_size > 0 && !rotated) {
+			rwrap_answer_cache_put(&db->cache, key, type,
+					       answer, resp_size);
+		}
 		break;
 	default:
 		RWRAP_LOG(RWRAP_LOG_ERROR,
-				"Error searching for [%s]\n", query_name);
-		free(query_name);
+				"Error searching for [%s]\n", query);
+		rwrap_fake_db_put(idx);
 		return -1;
 	}
+	rwrap_fake_db_put(idx);
 
 	switch (resp_size) {
 	case -1:
 		RWRAP_LOG(RWRAP_LOG_ERROR,
-				"Error faking answer for [%s]\n", query_name);
+				"Error faking answer for [%s]\n", query);
 		break;
 	default:
 		RWRAP_LOG(RWRAP_LOG_TRACE,
 				"Successfully faked answer for [%s]\n",
-				query_name);
+				query);
 		break;
 	}
 
-	free(query_name);
 	return resp_size;
 }
 
@@ -981,6 +7350,7 @@ static int rwrap_res_fake_hosts(const char *hostfile,
 
 #include <dlfcn.h>
 
+typedef struct __res_state *(*__libc___res_state)(void);
 typedef int (*__libc_res_ninit)(struct __res_state *state);
 typedef int (*__libc___res_ninit)(struct __res_state *state);
 typedef void (*__libc_res_nclose)(struct __res_state *state);
@@ -1017,6 +7387,7 @@ typedef int (*__libc___res_nsearch)(struct __res_state *state,
 	} _libc_##i
 
 struct rwrap_libc_symbols {
+	RWRAP_SYMBOL_ENTRY(__res_state);
 	RWRAP_SYMBOL_ENTRY(res_ninit);
 	RWRAP_SYMBOL_ENTRY(__res_ninit);
 	RWRAP_SYMBOL_ENTRY(res_nclose);
@@ -1178,6 +7549,15 @@ static void *_rwrap_bind_symbol(enum rwrap_lib lib, const char *fn_name)
  * So we need load each function at the point it is called the first time.
  */
 
+#ifdef HAVE___RES_STATE
+static struct __res_state *libc___res_state(void)
+{
+	rwrap_bind_symbol_libc(__res_state);
+
+	return rwrap.libc.symbols._libc___res_state.f();
+}
+#endif
+
 static int libc_res_ninit(struct __res_state *state)
 {
 #if !defined(res_ninit) && defined(HAVE_RES_NINIT)
@@ -1290,12 +7670,50 @@ static int libc_res_nsearch(struct __res_state *state,
  *   RES_HELPER
  ***************************************************************************/
 
-static int rwrap_parse_resolv_conf(struct __res_state *state,
-				   const char *resolv_conf)
+#define RESOLV_MATCH(line, name) \
+	(strncmp(line, name, sizeof(name) - 1) == 0 && \
+	(line[sizeof(name) - 1] == ' ' || \
+	 line[sizeof(name) - 1] == '\t'))
+
+struct rwrap_nameserver {
+	int family;
+	union {
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+	} addr;
+};
+
+/*
+ * The nameservers from RESOLV_WRAPPER_CONF are parsed once and kept here.
+ * Every initialization only stats the file to see if it changed, the
+ * generation is bumped whenever the list is parsed again. The states of the
+ * threads read the generation without the lock and check the file at most
+ * every hosts check interval.
+ */
+static struct {
+	pthread_mutex_t lock;
+
+	char *path;
+	struct stat st;
+
+	/* Read with atomics, written with the lock held */
+	unsigned int generation;
+	unsigned int checked; /* serial of the snapshot checked last */
+	unsigned int last_check; /* ms of the monotonic clock, wraps */
+
+	struct rwrap_nameserver ns[MAXNS];
+	size_t nns;
+} rwrap_resolv_conf = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int rwrap_parse_resolv_conf(const char *resolv_conf,
+				   struct rwrap_nameserver *ns,
+				   size_t *pnns)
 {
 	FILE *fp;
 	char buf[BUFSIZ];
-	int nserv = 0;
+	size_t nserv = 0;
 
 	fp = fopen(resolv_conf, "r");
 	if (fp == NULL) {
@@ -1333,14 +7751,14 @@ static int rwrap_parse_resolv_conf(struct __res_state *state,
 
 			ok = inet_pton(AF_INET, p, &a);
 			if (ok) {
-				state->nsaddr_list[state->nscount] = (struct sockaddr_in) {
+				ns[nserv].family = AF_INET;
+				ns[nserv].addr.in = (struct sockaddr_in) {
 					.sin_family = AF_INET,
 					.sin_addr = a,
 					.sin_port = htons(53),
 					.sin_zero = { 0 },
 				};
 
-				state->nscount++;
 				nserv++;
 			} else {
 #ifdef HAVE_RESOLV_IPV6_NSADDRS
@@ -1350,22 +7768,14 @@ static int rwrap_parse_resolv_conf(struct __res_state *state,
 				if (ok) {
 					struct sockaddr_in6 *sa6;
 
-					sa6 = malloc(sizeof(*sa6));
-					if (sa6 == NULL) {
-						fclose(fp);
-						return -1;
-					}
-
+					sa6 = &ns[nserv].addr.in6;
+					memset(sa6, 0, sizeof(*sa6));
 					sa6->sin6_family = AF_INET6;
 					sa6->sin6_port = htons(53);
 					sa6->sin6_flowinfo = 0;
 					sa6->sin6_addr = a6;
 
-					state->_u._ext.nsaddrs[state->_u._ext.nscount] = sa6;
-					state->_u._ext.nssocks[state->_u._ext.nscount] = -1;
-					state->_u._ext.nsmap[state->_u._ext.nscount] = MAXNS + 1;
-
-					state->_u._ext.nscount++;
+					ns[nserv].family = AF_INET6;
 					nserv++;
 				} else {
 					RWRAP_LOG(RWRAP_LOG_ERROR,
@@ -1397,44 +7807,187 @@ static int rwrap_parse_resolv_conf(struct __res_state *state,
 	}
 
 	fclose(fp);
+
+	*pnns = nserv;
 	return 0;
 }
 
-/****************************************************************************
- *   RES_NINIT
- ***************************************************************************/
-
-static int rwrap_res_ninit(struct __res_state *state)
+/*
+ * Returns the cached nameservers of the file of the snapshot, parsing it
+ * again if it is a different file or it changed. The nameservers are copied
+ * to ns if it is not NULL.
+ */
+static int rwrap_resolv_conf_get(const struct rwrap_config *c,
+				 struct rwrap_nameserver *ns,
+				 size_t *pnns,
+				 unsigned int *generation)
 {
+	const char *resolv_conf = c->resolv_conf;
+	struct rwrap_nameserver parsed[MAXNS];
+	size_t nparsed = 0;
+	struct stat sb;
+	char *path;
 	int rc;
 
-	rc = libc_res_ninit(state);
-	if (rc == 0) {
-		const char *resolv_conf = getenv("RESOLV_WRAPPER_CONF");
+	rc = stat(resolv_conf, &sb);
+	if (rc != 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Opening %s failed: %s",
+			  resolv_conf, strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_lock(&rwrap_resolv_conf.lock);
+
+	if (rwrap_resolv_conf.path == NULL ||
+	    strcmp(rwrap_resolv_conf.path, resolv_conf) != 0 ||
+	    rwrap_stat_changed(&rwrap_resolv_conf.st, &sb)) {
+		RWRAP_LOG(RWRAP_LOG_TRACE,
+			  "Parsing resolv.conf %s\n", resolv_conf);
 
-		if (resolv_conf != NULL) {
-			uint16_t i;
+		rc = rwrap_parse_resolv_conf(resolv_conf, parsed, &nparsed);
+		if (rc != 0) {
+			pthread_mutex_unlock(&rwrap_resolv_conf.lock);
+			return -1;
+		}
+
+		path = strdup(resolv_conf);
+		if (path == NULL) {
+			pthread_mutex_unlock(&rwrap_resolv_conf.lock);
+			return -1;
+		}
+		free(rwrap_resolv_conf.path);
+		rwrap_resolv_conf.path = path;
+		rwrap_resolv_conf.st = sb;
+		__atomic_store_n(&rwrap_resolv_conf.generation,
+				 rwrap_resolv_conf.generation + 1,
+				 __ATOMIC_RELEASE);
+
+		memcpy(rwrap_resolv_conf.ns, parsed, sizeof(parsed));
+		rwrap_resolv_conf.nns = nparsed;
+	}
+	__atomic_store_n(&rwrap_resolv_conf.checked, c->serial,
+			 __ATOMIC_RELEASE);
+
+	if (ns != NULL) {
+		memcpy(ns, rwrap_resolv_conf.ns, sizeof(rwrap_resolv_conf.ns));
+		*pnns = rwrap_resolv_conf.nns;
+	}
+	if (generation != NULL) {
+		*generation = rwrap_resolv_conf.generation;
+	}
+
+	pthread_mutex_unlock(&rwrap_resolv_conf.lock);
+	return 0;
+}
+
+/*
+ * Returns the generation of the nameservers of the file. Unless forced the
+ * file is not checked again and no lock is taken until the check interval
+ * has passed.
+ */
+static int rwrap_resolv_conf_generation(const struct rwrap_config *c,
+					bool force,
+					unsigned int *generation)
+{
+	int interval = c->hosts_check_interval;
+	unsigned int checked;
+
+	checked = __atomic_load_n(&rwrap_resolv_conf.checked,
+				  __ATOMIC_ACQUIRE);
+	if (!force && checked == c->serial &&
+	    (interval < 0 ||
+	     !rwrap_check_due(&rwrap_resolv_conf.last_check, interval))) {
+		*generation = __atomic_load_n(&rwrap_resolv_conf.generation,
+					      __ATOMIC_ACQUIRE);
+		return 0;
+	}
+
+	return rwrap_resolv_conf_get(c, NULL, NULL, generation);
+}
+
+static int rwrap_res_set_nameservers(struct __res_state *state,
+				     const struct rwrap_nameserver *ns,
+				     size_t nns)
+{
+	size_t i;
 
-			(void)i; /* maybe unused */
+	/* Delete name servers */
+	state->nscount = 0;
+	memset(state->nsaddr_list, 0, sizeof(state->nsaddr_list));
 
-			/* Delete name servers */
-			state->nscount = 0;
-			memset(state->nsaddr_list, 0, sizeof(state->nsaddr_list));
+	state->_u._ext.nscount = 0;
+#ifdef HAVE_RESOLV_IPV6_NSADDRS
+	for (i = 0; i < state->_u._ext.nscount; i++) {
+		SAFE_FREE(state->_u._ext.nsaddrs[i]);
+	}
+#endif
 
-			state->_u._ext.nscount = 0;
+	for (i = 0; i < nns; i++) {
+		if (ns[i].family == AF_INET) {
+			state->nsaddr_list[state->nscount] = ns[i].addr.in;
+			state->nscount++;
+			continue;
+		}
 #ifdef HAVE_RESOLV_IPV6_NSADDRS
-			for (i = 0; i < state->_u._ext.nscount; i++) {
-				SAFE_FREE(state->_u._ext.nsaddrs[i]);
+		{
+			struct sockaddr_in6 *sa6;
+
+			sa6 = malloc(sizeof(*sa6));
+			if (sa6 == NULL) {
+				return -1;
 			}
+			*sa6 = ns[i].addr.in6;
+
+			state->_u._ext.nsaddrs[state->_u._ext.nscount] = sa6;
+			state->_u._ext.nssocks[state->_u._ext.nscount] = -1;
+			state->_u._ext.nsmap[state->_u._ext.nscount] = MAXNS + 1;
+
+			state->_u._ext.nscount++;
+		}
 #endif
+	}
 
-			rc = rwrap_parse_resolv_conf(state, resolv_conf);
+	return 0;
+}
+
+/****************************************************************************
+ *   RES_NINIT
+ ***************************************************************************/
+
+/* Initializes the state with the nameservers of the held snapshot */
+static int rwrap_res_ninit_config(struct __res_state *state,
+				  const struct rwrap_config *c)
+{
+	int rc;
+
+	rc = libc_res_ninit(state);
+	if (rc == 0 && c->resolv_conf != NULL) {
+		struct rwrap_nameserver ns[MAXNS];
+		size_t nns = 0;
+
+		rc = rwrap_resolv_conf_get(c, ns, &nns, NULL);
+		if (rc == 0) {
+			rc = rwrap_res_set_nameservers(state, ns, nns);
 		}
 	}
 
 	return rc;
 }
 
+static int rwrap_res_ninit(struct __res_state *state)
+{
+	struct rwrap_config *c;
+	unsigned int idx;
+	int rc;
+
+	c = rwrap_config_hold(&idx);
+	rc = rwrap_res_ninit_config(state, c);
+	rwrap_config_put(idx);
+
+	return rc;
+}
+
 #if !defined(res_ninit) && defined(HAVE_RES_NINIT)
 int res_ninit(struct __res_state *state)
 #elif defined(HAVE___RES_NINIT)
@@ -1448,15 +8001,140 @@ int __res_ninit(struct __res_state *state)
  *   RES_INIT
  ***************************************************************************/
 
-static struct __res_state rwrap_res_state;
+/*
+ * The functions without an explicit state use a state of the calling
+ * thread. It is allocated and initialized on the first use and closed when
+ * the thread exits. Later queries reuse it as long as the nameservers from
+ * RESOLV_WRAPPER_CONF stay the same.
+ */
+struct rwrap_res_thread {
+	struct __res_state state;
+	bool initialized;
+	unsigned int conf_generation;
+};
 
-static int rwrap_res_init(void)
+static pthread_key_t rwrap_res_state_key;
+static pthread_once_t rwrap_res_state_once = PTHREAD_ONCE_INIT;
+static bool rwrap_res_state_key_ok;
+
+static void rwrap_res_nclose(struct __res_state *state);
+
+static void rwrap_res_thread_free(void *ptr)
+{
+	struct rwrap_res_thread *t = (struct rwrap_res_thread *)ptr;
+
+	if (t->initialized) {
+		rwrap_res_nclose(&t->state);
+	}
+	free(t);
+}
+
+static void rwrap_res_state_key_init(void)
+{
+	int rc;
+
+	rc = pthread_key_create(&rwrap_res_state_key, rwrap_res_thread_free);
+	if (rc != 0) {
+		RWRAP_LOG(RWRAP_LOG_ERROR,
+			  "Failed to create the resolver state key: %s\n",
+			  strerror(rc));
+		return;
+	}
+	rwrap_res_state_key_ok = true;
+}
+
+static struct rwrap_res_thread *rwrap_res_thread(bool create)
 {
+	struct rwrap_res_thread *t;
 	int rc;
 
-	rc = rwrap_res_ninit(&rwrap_res_state);
+	pthread_once(&rwrap_res_state_once, rwrap_res_state_key_init);
+	if (!rwrap_res_state_key_ok) {
+		return NULL;
+	}
+
+	t = (struct rwrap_res_thread *)pthread_getspecific(rwrap_res_state_key);
+	if (t != NULL || !create) {
+		return t;
+	}
 
-	return rc;
+	t = calloc(1, sizeof(struct rwrap_res_thread));
+	if (t == NULL) {
+		return NULL;
+	}
+
+	rc = pthread_setspecific(rwrap_res_state_key, t);
+	if (rc != 0) {
+		free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+/* Initializes the state of the thread unless it is current already */
+static struct __res_state *rwrap_res_thread_init(struct rwrap_res_thread *t,
+						 const struct rwrap_config *c,
+						 bool force)
+{
+	unsigned int generation = 0;
+	int rc;
+
+	if (c->resolv_conf != NULL) {
+		rc = rwrap_resolv_conf_generation(c, force, &generation);
+		if (rc != 0) {
+			return NULL;
+		}
+	}
+
+	if (t->initialized) {
+		if (!force && generation == t->conf_generation) {
+			return &t->state;
+		}
+
+		rwrap_res_nclose(&t->state);
+		memset(&t->state, 0, sizeof(t->state));
+		t->initialized = false;
+	}
+
+	rc = rwrap_res_ninit_config(&t->state, c);
+	if (rc != 0) {
+		return NULL;
+	}
+	t->initialized = true;
+	t->conf_generation = generation;
+
+	return &t->state;
+}
+
+/* Returns the initialized state of the calling thread */
+static struct __res_state *rwrap_res_state(bool force)
+{
+	struct rwrap_res_thread *t = rwrap_res_thread(true);
+	struct __res_state *state;
+	struct rwrap_config *c;
+	unsigned int idx;
+
+	if (t == NULL) {
+		return NULL;
+	}
+
+	c = rwrap_config_hold(&idx);
+	state = rwrap_res_thread_init(t, c, force);
+	rwrap_config_put(idx);
+
+	return state;
+}
+
+static int rwrap_res_init(void)
+{
+	struct __res_state *state = rwrap_res_state(true);
+
+	if (state == NULL) {
+		return -1;
+	}
+
+	return 0;
 }
 
 #if !defined(res_ninit) && defined(HAVE_RES_INIT)
@@ -1468,6 +8146,23 @@ int __res_init(void)
 	return rwrap_res_init();
 }
 
+#ifdef HAVE___RES_STATE
+/*
+ * _res is the state this returns, so a program which reads or changes _res
+ * gets the state the calling thread queries with.
+ */
+struct __res_state *__res_state(void)
+{
+	struct rwrap_res_thread *t = rwrap_res_thread(true);
+
+	if (t == NULL) {
+		return libc___res_state();
+	}
+
+	return &t->state;
+}
+#endif
+
 /****************************************************************************
  *   RES_NCLOSE
  ***************************************************************************/
@@ -1504,7 +8199,13 @@ void __res_nclose(struct __res_state *state)
 
 static void rwrap_res_close(void)
 {
-	rwrap_res_nclose(&rwrap_res_state);
+	struct rwrap_res_thread *t = rwrap_res_thread(false);
+
+	if (t != NULL && t->initialized) {
+		rwrap_res_nclose(&t->state);
+		memset(&t->state, 0, sizeof(t->state));
+		t->initialized = false;
+	}
 }
 
 #if defined(HAVE_RES_CLOSE)
@@ -1516,6 +8217,47 @@ void __res_close(void)
 	rwrap_res_close();
 }
 
+/*
+ * Fails a query with a negative answer like libc does. The answer stays in
+ * the buffer, h_errno tells why there are no records.
+ */
+static int rwrap_res_negative(struct __res_state *state,
+			      const unsigned char *answer,
+			      int len)
+{
+	const HEADER *h = (const HEADER *)answer;
+	int err;
+
+	if (len < (int)sizeof(HEADER) ||
+	    (h->rcode == ns_r_noerror && ntohs(h->ancount) > 0)) {
+		return len;
+	}
+
+	switch (h->rcode) {
+	case ns_r_nxdomain:
+		err = HOST_NOT_FOUND;
+		break;
+	case ns_r_servfail:
+		err = TRY_AGAIN;
+		break;
+	case ns_r_noerror:
+		err = NO_DATA;
+		break;
+	default:
+		err = NO_RECOVERY;
+		break;
+	}
+
+#ifdef HAVE_RES_STATE_RES_H_ERRNO
+	state->res_h_errno = err;
+#else
+	(void)state; /* unused */
+#endif
+	h_errno = err;
+
+	return -1;
+}
+
 /****************************************************************************
  *   RES_NQUERY
  ***************************************************************************/
@@ -1527,17 +8269,19 @@ static int rwrap_res_nquery(struct __res_state *state,
 			    unsigned char *answer,
 			    int anslen)
 {
+	struct rwrap_config *c;
+	unsigned int idx;
 	int rc;
-	const char *fake_hosts;
 #ifndef NDEBUG
 	int i;
 #endif
 
+	RWRAP_TRACE(RWRAP_TRACE_QUERY, type, class, 0);
 	RWRAP_LOG(RWRAP_LOG_TRACE,
 		  "Resolve the domain name [%s] - class=%d, type=%d",
 		  dname, class, type);
 #ifndef NDEBUG
-	for (i = 0; i < state->nscount; i++) {
+	for (i = 0; rwrap_log_enabled(RWRAP_LOG_TRACE) && i < state->nscount; i++) {
 		char ip[INET6_ADDRSTRLEN];
 
 		inet_ntop(AF_INET, &state->nsaddr_list[i].sin_addr, ip, sizeof(ip));
@@ -1547,14 +8291,18 @@ static int rwrap_res_nquery(struct __res_state *state,
 	}
 #endif
 
-	fake_hosts = getenv("RESOLV_WRAPPER_HOSTS");
-	if (fake_hosts != NULL) {
-		rc = rwrap_res_fake_hosts(fake_hosts, dname, type, answer, anslen);
+	c = rwrap_config_hold(&idx);
+	if (c->hosts != NULL) {
+		rc = rwrap_res_fake_hosts(c->hosts, dname, type, answer, anslen);
+		rwrap_config_put(idx);
+		rc = rwrap_res_negative(state, answer, rc);
 	} else {
+		rwrap_config_put(idx);
 		rc = libc_res_nquery(state, dname, class, type, answer, anslen);
 	}
 
 
+	RWRAP_TRACE(RWRAP_TRACE_ANSWER, type, rc, 0);
 	RWRAP_LOG(RWRAP_LOG_TRACE,
 		  "The returned response length is: %d",
 		  rc);
@@ -1591,14 +8339,14 @@ static int rwrap_res_query(const char *dname,
 			   unsigned char *answer,
 			   int anslen)
 {
+	struct __res_state *state = rwrap_res_state(false);
 	int rc;
 
-	rc = rwrap_res_ninit(&rwrap_res_state);
-	if (rc != 0) {
-		return rc;
+	if (state == NULL) {
+		return -1;
 	}
 
-	rc = rwrap_res_nquery(&rwrap_res_state,
+	rc = rwrap_res_nquery(state,
 			      dname,
 			      class,
 			      type,
@@ -1636,17 +8384,19 @@ static int rwrap_res_nsearch(struct __res_state *state,
 			     unsigned char *answer,
 			     int anslen)
 {
+	struct rwrap_config *c;
+	unsigned int idx;
 	int rc;
-	const char *fake_hosts;
 #ifndef NDEBUG
 	int i;
 #endif
 
+	RWRAP_TRACE(RWRAP_TRACE_QUERY, type, class, 1);
 	RWRAP_LOG(RWRAP_LOG_TRACE,
 		  "Resolve the domain name [%s] - class=%d, type=%d",
 		  dname, class, type);
 #ifndef NDEBUG
-	for (i = 0; i < state->nscount; i++) {
+	for (i = 0; rwrap_log_enabled(RWRAP_LOG_TRACE) && i < state->nscount; i++) {
 		char ip[INET6_ADDRSTRLEN];
 
 		inet_ntop(AF_INET, &state->nsaddr_list[i].sin_addr, ip, sizeof(ip));
@@ -1656,13 +8406,17 @@ static int rwrap_res_nsearch(struct __res_state *state,
 	}
 #endif
 
-	fake_hosts = getenv("RESOLV_WRAPPER_HOSTS");
-	if (fake_hosts != NULL) {
-		rc = rwrap_res_fake_hosts(fake_hosts, dname, type, answer, anslen);
+	c = rwrap_config_hold(&idx);
+	if (c->hosts != NULL) {
+		rc = rwrap_res_fake_hosts(c->hosts, dname, type, answer, anslen);
+		rwrap_config_put(idx);
+		rc = rwrap_res_negative(state, answer, rc);
 	} else {
+		rwrap_config_put(idx);
 		rc = libc_res_nsearch(state, dname, class, type, answer, anslen);
 	}
 
+	RWRAP_TRACE(RWRAP_TRACE_ANSWER, type, rc, 0);
 	RWRAP_LOG(RWRAP_LOG_TRACE,
 		  "The returned response length is: %d",
 		  rc);
@@ -1699,14 +8453,14 @@ static int rwrap_res_search(const char *dname,
 			    unsigned char *answer,
 			    int anslen)
 {
+	struct __res_state *state = rwrap_res_state(false);
 	int rc;
 
-	rc = rwrap_res_ninit(&rwrap_res_state);
-	if (rc != 0) {
-		return rc;
+	if (state == NULL) {
+		return -1;
 	}
 
-	rc = rwrap_res_nsearch(&rwrap_res_state,
+	rc = rwrap_res_nsearch(state,
 			       dname,
 			       class,
 			       type,
@@ -1732,3 +8486,38 @@ int __res_search(const char *dname,
 {
 	return rwrap_res_search(dname, class, type, answer, anslen);
 }
+
+/****************************************************************************
+ * CONSTRUCTOR AND DESTRUCTOR
+ ***************************************************************************/
+
+void rwrap_constructor(void) CONSTRUCTOR_ATTRIBUTE;
+void rwrap_destructor(void) DESTRUCTOR_ATTRIBUTE;
+
+void rwrap_constructor(void)
+{
+	resolv_wrapper_refresh_config();
+}
+
+/*
+ * This function is called when the library is unloaded and makes sure that
+ * resources are freed.
+ */
+void rwrap_destructor(void)
+{
+	rwrap_trace_flush_all();
+
+	/* Threads which are still in a lookup finish with the snapshot first */
+	pthread_mutex_lock(&rwrap_fake.lock);
+	rwrap_fake_db_publish(NULL);
+	if (rwrap_fake.watch_fd != -1) {
+		close(rwrap_fake.watch_fd);
+		rwrap_fake.watch_fd = -1;
+	}
+	pthread_mutex_unlock(&rwrap_fake.lock);
+
+	/* Other threads may still use the snapshot, it is left to the exit */
+	pthread_mutex_lock(&rwrap_config_lock);
+	rwrap_config_install_signal(0);
+	pthread_mutex_unlock(&rwrap_config_lock);
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) Jakub Hrozek 2014 <jakub.hrozek@posteo.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *	notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *	notice, this list of conditions and the following disclaimer in the
+ *	documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of its contributors
+ *	may be used to endorse or promote products derived from this software
+ *	without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measures how long it takes to answer a fake query. Run it with the wrapper
+ * preloaded and RESOLV_WRAPPER_HOSTS pointing to the test hosts file. Set
+ * RESOLV_WRAPPER_ANSWER_CACHE_SIZE=0 to measure the encoder and not the
+ * answer cache.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <resolv.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_LOOPS 100000
+
+/* The best round is reported, the others are disturbed by something else */
+#define ROUNDS 10
+
+static const struct {
+	const char *name;
+	int type;
+	const char *type_str;
+} queries[] = {
+	{ "cwrap.org", ns_t_a, "A" },
+	{ "rwrap.org", ns_t_a, "A" },
+	{ "_ldap._tcp.cwrap.org", ns_t_srv, "SRV" },
+	{ "cwrap.org", ns_t_soa, "SOA" },
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	struct __res_state dnsstate;
+	unsigned char answer[NS_PACKETSZ];
+	unsigned long loops = DEFAULT_LOOPS;
+	unsigned long i;
+	size_t q;
+	double start;
+	double best;
+	double t;
+	int round;
+	int rv;
+
+	if (argc > 1) {
+		loops = strtoul(argv[1], NULL, 10);
+	}
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	if (rv != 0) {
+		fprintf(stderr, "res_ninit failed\n");
+		return 1;
+	}
+
+	for (q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+		/* warm up, this also loads the hosts file */
+		rv = res_nquery(&dnsstate, queries[q].name, ns_c_in,
+				queries[q].type, answer, sizeof(answer));
+		if (rv < 0) {
+			fprintf(stderr, "Query for %s failed\n",
+				queries[q].name);
+			return 1;
+		}
+
+		best = 0;
+		for (round = 0; round < ROUNDS; round++) {
+			start = now_ns();
+			for (i = 0; i < loops; i++) {
+				res_nquery(&dnsstate, queries[q].name, ns_c_in,
+					   queries[q].type,
+					   answer, sizeof(answer));
+			}
+
+			t = (now_ns() - start) / loops;
+			if (round == 0 || t < best) {
+				best = t;
+			}
+		}
+
+		printf("%-24s %-5s %4d bytes %8.1f ns/query\n",
+		       queries[q].name, queries[q].type_str, rv, best);
+	}
+
+	res_nclose(&dnsstate);
+
+	return 0;
+}
@@ -47,6 +47,7 @@
 #include <arpa/nameser.h>
 #include <arpa/inet.h>
 #include <resolv.h>
+#include <netdb.h>
 
 #define ANSIZE 256
 
@@ -152,6 +153,49 @@ static void test_res_fake_a_query_trailing_dot(void **state)
 	res_nclose(&dnsstate);
 }
 
+static void test_res_fake_a_query_cached(void **state)
+{
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	unsigned char cached[ANSIZE];
+	int len;
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+
+	(void) state; /* unused */
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	len = res_nquery(&dnsstate, "www.cwrap.org", ns_c_in, ns_t_a,
+			 answer, sizeof(answer));
+	assert_in_range(len, 1, 100);
+
+	/* The second answer comes from the cache. It must be the same
+	 * except for the ID and the question has to be the one asked.
+	 */
+	rv = res_nquery(&dnsstate, "WWW.cwrap.ORG", ns_c_in, ns_t_a,
+			cached, sizeof(cached));
+	assert_int_equal(rv, len);
+	assert_memory_equal(answer + 2, cached + 2, NS_HFIXEDSZ - 2);
+
+	ns_initparse(cached, rv, &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_qd, 0, &rr), 0);
+	assert_string_equal(ns_rr_name(rr), "WWW.cwrap.ORG");
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_a);
+
+	/* A buffer which is too small is an error like without the cache */
+	rv = res_nquery(&dnsstate, "www.cwrap.org", ns_c_in, ns_t_a,
+			cached, len - 1);
+	assert_int_equal(rv, -1);
+
+	res_nclose(&dnsstate);
+}
+
 static void test_res_fake_a_query_notfound(void **state)
 {
 	int rv;
@@ -167,12 +211,15 @@ static void test_res_fake_a_query_notfound(void **state)
 
 	rv = res_nquery(&dnsstate, "nosuchentry.org", ns_c_in, ns_t_a,
 			answer, sizeof(answer));
-	assert_in_range(rv, 1, 100);
+	assert_int_equal(rv, -1);
+	assert_int_equal(h_errno, HOST_NOT_FOUND);
 
+	/* The answer is still there for a caller which looks at it */
 	ns_initparse(answer, sizeof(answer), &handle);
-	/* The query must finish w/o an error and have no answer */
-	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), ns_r_noerror);
+	/* The name does not exist and no zone of the file encloses it */
+	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), ns_r_nxdomain);
 	assert_int_equal(ns_msg_count(handle, ns_s_an), 0);
+	assert_int_equal(ns_msg_count(handle, ns_s_ns), 0);
 }
 
 static void test_res_fake_aaaa_query(void **state)
@@ -223,12 +270,15 @@ static void test_res_fake_aaaa_query_notfound(void **state)
 
 	rv = res_nquery(&dnsstate, "nosuchentry.org", ns_c_in, ns_t_aaaa,
 			answer, sizeof(answer));
-	assert_in_range(rv, 1, 100);
+	assert_int_equal(rv, -1);
+	assert_int_equal(h_errno, HOST_NOT_FOUND);
 
+	/* The answer is still there for a caller which looks at it */
 	ns_initparse(answer, sizeof(answer), &handle);
-	/* The query must finish w/o an error and have no answer */
-	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), ns_r_noerror);
+	/* The name does not exist and no zone of the file encloses it */
+	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), ns_r_nxdomain);
 	assert_int_equal(ns_msg_count(handle, ns_s_an), 0);
+	assert_int_equal(ns_msg_count(handle, ns_s_ns), 0);
 }
 
 static void test_res_fake_srv_query(void **state)
@@ -441,6 +491,12 @@ static void test_res_fake_cname_query(void **state)
 			answer, sizeof(answer));
 	assert_in_range(rv, 1, 256);
 
+	/*
+	 * The owners and the CNAME targets are compressed, uncompressed the
+	 * answer would be 132 bytes long.
+	 */
+	assert_in_range(rv, 1, 100);
+
 	ns_initparse(answer, 256, &handle);
 	ns_initparse(answer, sizeof(answer), &handle);
 
@@ -559,6 +615,631 @@ static void test_res_fake_a_via_cname(void **state)
 	assert_string_equal(addr, "127.0.0.22");
 }
 
+static void test_res_fake_a_via_wildcard(void **state)
+{
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	char addr[INET_ADDRSTRLEN];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+
+	(void) state; /* unused */
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	/* The record is synthesized from *.wild.cwrap.org for any name below
+	 * it which does not exist, it is owned by the queried name
+	 */
+	rv = res_nquery(&dnsstate, "a.b.wild.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_in_range(rv, 1, 100);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), ns_r_noerror);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_a);
+	assert_string_equal(ns_rr_name(rr), "a.b.wild.cwrap.org");
+	assert_non_null(inet_ntop(AF_INET, ns_rr_rdata(rr),
+			addr, sizeof(addr)));
+	assert_string_equal(addr, "127.0.0.24");
+}
+
+static void test_res_fake_wildcard_closest_encloser(void **state)
+{
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	ns_msg handle;
+
+	(void) state; /* unused */
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	/* sub.wild.cwrap.org exists as the parent of host.sub.wild.cwrap.org,
+	 * so it is the closest encloser and has no wildcard
+	 */
+	rv = res_nquery(&dnsstate, "x.sub.wild.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_int_equal(rv, -1);
+	assert_int_equal(h_errno, HOST_NOT_FOUND);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), ns_r_nxdomain);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 0);
+
+	/* A name which exists is never synthesized */
+	rv = res_nquery(&dnsstate, "sub.wild.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_int_equal(rv, -1);
+	assert_int_equal(h_errno, NO_DATA);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), ns_r_noerror);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 0);
+}
+
+static void test_res_fake_cname_to_wildcard(void **state)
+{
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	char addr[INET_ADDRSTRLEN];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+
+	(void) state; /* unused */
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	rv = res_nquery(&dnsstate, "tenant.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_in_range(rv, 1, ANSIZE);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), ns_r_noerror);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 2);
+
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_cname);
+
+	/* The target of the CNAME owns the synthesized record */
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 1, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_a);
+	assert_string_equal(ns_rr_name(rr), "tenant1.wild.cwrap.org");
+	assert_non_null(inet_ntop(AF_INET, ns_rr_rdata(rr),
+			addr, sizeof(addr)));
+	assert_string_equal(addr, "127.0.0.24");
+}
+
+static void test_res_fake_a_via_pattern(void **state)
+{
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	char addr[INET_ADDRSTRLEN];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+
+	(void) state; /* unused */
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	/* The groups of the pattern are substituted into the address */
+	rv = res_nquery(&dnsstate, "Node-17.RACK3.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_in_range(rv, 1, 100);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), ns_r_noerror);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_a);
+	assert_string_equal(ns_rr_name(rr), "Node-17.RACK3.cwrap.org");
+	assert_non_null(inet_ntop(AF_INET, ns_rr_rdata(rr),
+			addr, sizeof(addr)));
+	assert_string_equal(addr, "10.3.0.17");
+
+	/* The whole name has to match */
+	rv = res_nquery(&dnsstate, "node-17.rack3.cwrap.org.example",
+			ns_c_in, ns_t_a, answer, sizeof(answer));
+	assert_int_equal(rv, -1);
+	assert_int_equal(h_errno, HOST_NOT_FOUND);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 0);
+
+	rv = res_nquery(&dnsstate, "node-x.rack3.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_int_equal(rv, -1);
+	assert_int_equal(h_errno, HOST_NOT_FOUND);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 0);
+}
+
+static void test_res_fake_cname_via_pattern(void **state)
+{
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	char addr[INET_ADDRSTRLEN];
+	char target[MAXDNAME];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+
+	(void) state; /* unused */
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	rv = res_nquery(&dnsstate, "eu-www.pool.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_in_range(rv, 1, ANSIZE);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), ns_r_noerror);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 2);
+
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_cname);
+	assert_string_equal(ns_rr_name(rr), "eu-www.pool.cwrap.org");
+	rv = ns_name_uncompress(ns_msg_base(handle),
+				ns_msg_end(handle),
+				ns_rr_rdata(rr),
+				target, sizeof(target));
+	assert_int_not_equal(rv, -1);
+	assert_string_equal(target, "www.cwrap.org");
+
+	/* The target is resolved from the records of the file */
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 1, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_a);
+	assert_string_equal(ns_rr_name(rr), "www.cwrap.org");
+	assert_non_null(inet_ntop(AF_INET, ns_rr_rdata(rr),
+			addr, sizeof(addr)));
+	assert_string_equal(addr, "127.0.0.22");
+}
+
+static void assert_a_rrset(ns_msg *handle, ns_sect section, int first,
+			   const char *owner)
+{
+	const char *addrs[] = { "127.0.1.1", "127.0.1.2", "127.0.1.3" };
+	char addr[INET_ADDRSTRLEN];
+	ns_rr rr;   /* expanded resource record */
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		assert_int_equal(ns_parserr(handle, section, first + i, &rr), 0);
+		assert_int_equal(ns_rr_type(rr), ns_t_a);
+		assert_string_equal(ns_rr_name(rr), owner);
+		assert_non_null(inet_ntop(AF_INET, ns_rr_rdata(rr),
+				addr, sizeof(addr)));
+		assert_string_equal(addr, addrs[i]);
+	}
+}
+
+static void test_res_fake_a_rrset(void **state)
+{
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	ns_msg handle;
+
+	(void) state; /* unused */
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	/* All A records are returned in the order of the file, even though
+	 * an AAAA record is in between
+	 */
+	rv = res_nquery(&dnsstate, "pool.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_in_range(rv, 1, ANSIZE);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), ns_r_noerror);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 3);
+	assert_a_rrset(&handle, ns_s_an, 0, "pool.cwrap.org");
+
+	/* Behind a CNAME the RRset is owned by its target */
+	rv = res_nquery(&dnsstate, "alias.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_in_range(rv, 1, ANSIZE);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 4);
+	assert_a_rrset(&handle, ns_s_an, 1, "pool.cwrap.org");
+}
+
+static void test_res_fake_srv_rrset(void **state)
+{
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+	const uint8_t *rrdata;
+	int port;
+	int i;
+
+	(void) state; /* unused */
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	rv = res_nquery(&dnsstate, "_http._tcp.cwrap.org", ns_c_in, ns_t_srv,
+			answer, sizeof(answer));
+	assert_in_range(rv, 1, ANSIZE);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 3);
+
+	for (i = 0; i < 3; i++) {
+		assert_int_equal(ns_parserr(&handle, ns_s_an, i, &rr), 0);
+		assert_int_equal(ns_rr_type(rr), ns_t_srv);
+
+		rrdata = ns_rr_rdata(rr);
+		rrdata += 2 * NS_INT16SZ;
+		NS_GET16(port, rrdata);
+		assert_int_equal(port, i == 0 ? 80 : 8079 + i);
+	}
+
+	/* The A and AAAA records of both targets, the pool only once */
+	assert_int_equal(ns_msg_count(handle, ns_s_ar), 5);
+
+	assert_a_rrset(&handle, ns_s_ar, 0, "pool.cwrap.org");
+	assert_int_equal(ns_parserr(&handle, ns_s_ar, 3, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_aaaa);
+	assert_string_equal(ns_rr_name(rr), "pool.cwrap.org");
+	assert_int_equal(ns_parserr(&handle, ns_s_ar, 4, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_a);
+	assert_string_equal(ns_rr_name(rr), "www.cwrap.org");
+}
+
+/* Returns the number of answers to a PTR query, the first one in name */
+static int fake_ptr_query(const char *query, char *name, size_t size)
+{
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	rv = res_nquery(&dnsstate, query, ns_c_in, ns_t_ptr,
+			answer, sizeof(answer));
+	if (rv == -1) {
+		/* An address without names does not exist */
+		assert_int_equal(h_errno, HOST_NOT_FOUND);
+	} else {
+		assert_in_range(rv, 1, ANSIZE);
+	}
+
+	ns_initparse(answer, sizeof(answer), &handle);
+
+	rv = ns_msg_count(handle, ns_s_an);
+	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode),
+			 rv > 0 ? ns_r_noerror : ns_r_nxdomain);
+	if (rv > 0) {
+		assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+		assert_int_equal(ns_rr_type(rr), ns_t_ptr);
+		assert_int_not_equal(ns_name_uncompress(ns_msg_base(handle),
+							ns_msg_end(handle),
+							ns_rr_rdata(rr),
+							name, size), -1);
+	}
+
+	res_nclose(&dnsstate);
+
+	return rv;
+}
+
+static void test_res_fake_ptr_query(void **state)
+{
+	char name[MAXDNAME];
+
+	(void) state; /* unused */
+
+	/* Reverse lookups of A and AAAA records */
+	assert_int_equal(fake_ptr_query("22.0.0.127.in-addr.arpa",
+					name, sizeof(name)), 1);
+	assert_string_equal(name, "www.cwrap.org");
+
+	assert_int_equal(fake_ptr_query("3.6.0.0.0.0.0.0.0.0.0.0.0.0.0.0."
+					"1.0.C.0.3.1.0.4.0.5.4.1.0.0.A.2."
+					"ip6.arpa",
+					name, sizeof(name)), 1);
+	assert_string_equal(name, "cwrap6.org");
+
+	/* A PTR record replaces the names of the address */
+	assert_int_equal(fake_ptr_query("2.1.0.127.IN-ADDR.ARPA.",
+					name, sizeof(name)), 1);
+	assert_string_equal(name, "pool2.cwrap.org");
+
+	assert_int_equal(fake_ptr_query("3.1.0.127.in-addr.arpa",
+					name, sizeof(name)), 1);
+	assert_string_equal(name, "pool.cwrap.org");
+
+	/* Wildcards are not names of an address */
+	assert_int_equal(fake_ptr_query("24.0.0.127.in-addr.arpa",
+					name, sizeof(name)), 0);
+
+	/* Other PTR records are looked up by their name */
+	assert_int_equal(fake_ptr_query("_services._dns-sd._udp.cwrap.org",
+					name, sizeof(name)), 1);
+	assert_string_equal(name, "_http._tcp.cwrap.org");
+}
+
+/* Queries name for type and parses the answer into handle */
+static void fake_query(const char *name, int type,
+		       unsigned char *answer, size_t anslen,
+		       ns_msg *handle)
+{
+	int rv;
+	struct __res_state dnsstate;
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	rv = res_nquery(&dnsstate, name, ns_c_in, type, answer, anslen);
+	assert_in_range(rv, 1, anslen);
+
+	assert_int_equal(ns_initparse(answer, rv, handle), 0);
+	assert_int_equal(ns_msg_getflag(*handle, ns_f_rcode), ns_r_noerror);
+
+	res_nclose(&dnsstate);
+}
+
+static void test_res_fake_txt_query(void **state)
+{
+	unsigned char answer[1024];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+	const uint8_t *rrdata;
+	size_t i;
+
+	(void) state; /* unused */
+
+	fake_query("cwrap.org", ns_t_txt, answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_txt);
+
+	rrdata = ns_rr_rdata(rr);
+	assert_int_equal(ns_rr_rdlen(rr), 12 + 18);
+	assert_int_equal(rrdata[0], 11);
+	assert_memory_equal(rrdata + 1, "v=spf1 -all", 11);
+	assert_int_equal(rrdata[12], 17);
+	assert_memory_equal(rrdata + 13, "a \"quoted\" string", 17);
+
+	/* 300 characters are split into two strings */
+	fake_query("long.cwrap.org", ns_t_txt, answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+
+	rrdata = ns_rr_rdata(rr);
+	assert_int_equal(ns_rr_rdlen(rr), 302);
+	assert_int_equal(rrdata[0], 255);
+	assert_int_equal(rrdata[256], 45);
+	for (i = 0; i < 300; i++) {
+		assert_int_equal(rrdata[1 + i + i / 255], '0' + i % 10);
+	}
+}
+
+static void test_res_fake_mx_query(void **state)
+{
+	unsigned char answer[ANSIZE];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+	const uint8_t *rrdata;
+	char hostname[MAXDNAME];
+	int pref;
+
+	(void) state; /* unused */
+
+	fake_query("cwrap.org", ns_t_mx, answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 2);
+
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 1, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_mx);
+	rrdata = ns_rr_rdata(rr);
+	NS_GET16(pref, rrdata);
+	assert_int_equal(pref, 20);
+	assert_int_not_equal(ns_name_uncompress(ns_msg_base(handle),
+						ns_msg_end(handle),
+						rrdata,
+						hostname, MAXDNAME), -1);
+	assert_string_equal(hostname, "www.cwrap.org");
+
+	/* The addresses of both exchanges are glue */
+	assert_int_equal(ns_msg_count(handle, ns_s_ar), 2);
+	assert_int_equal(ns_parserr(&handle, ns_s_ar, 0, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_a);
+	assert_string_equal(ns_rr_name(rr), "www.cwrap.org");
+	assert_int_equal(ns_parserr(&handle, ns_s_ar, 1, &rr), 0);
+	assert_string_equal(ns_rr_name(rr), "mail.cwrap.org");
+
+	fake_query("cwrap.org", ns_t_ns, answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_ns);
+	assert_int_equal(ns_msg_count(handle, ns_s_ar), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_ar, 0, &rr), 0);
+	assert_string_equal(ns_rr_name(rr), "ns1.cwrap.org");
+}
+
+static void test_res_fake_naptr_uri_caa_query(void **state)
+{
+	unsigned char answer[ANSIZE];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+	const uint8_t *rrdata;
+	int order;
+	int pref;
+
+	(void) state; /* unused */
+
+	fake_query("cwrap.org", ns_t_naptr, answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_naptr);
+
+	rrdata = ns_rr_rdata(rr);
+	NS_GET16(order, rrdata);
+	NS_GET16(pref, rrdata);
+	assert_int_equal(order, 100);
+	assert_int_equal(pref, 10);
+	assert_memory_equal(rrdata, "\1S\7SIP+D2U\0"
+			    "\4_sip\4_udp\5cwrap\3org", 32);
+	assert_int_equal(ns_rr_rdlen(rr), 4 + 32);
+
+	fake_query("_http._tcp.cwrap.org", 256, answer, sizeof(answer),
+		   &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_rdlen(rr), 4 + 21);
+	assert_memory_equal(ns_rr_rdata(rr), "\0\12\0\1http://www.cwrap.org/",
+			    4 + 21);
+
+	fake_query("cwrap.org", 257, answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_rdlen(rr), 2 + 5 + 12);
+	assert_memory_equal(ns_rr_rdata(rr), "\0\5issueca.cwrap.org",
+			    2 + 5 + 12);
+}
+
+static void test_res_fake_any_query(void **state)
+{
+	const int types[] = {
+		ns_t_a, ns_t_soa, ns_t_txt, ns_t_mx, ns_t_mx, ns_t_ns,
+		ns_t_naptr, 257,
+	};
+	unsigned char answer[1024];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+	int i;
+
+	(void) state; /* unused */
+
+	/* Every RRset of the name, in the order the types appear in */
+	fake_query("cwrap.org", ns_t_any, answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 8);
+	assert_int_equal(ns_msg_count(handle, ns_s_ar), 0);
+	for (i = 0; i < 8; i++) {
+		assert_int_equal(ns_parserr(&handle, ns_s_an, i, &rr), 0);
+		assert_int_equal(ns_rr_type(rr), types[i]);
+		assert_string_equal(ns_rr_name(rr), "cwrap.org");
+	}
+
+	fake_query("pool.cwrap.org", ns_t_any, answer, sizeof(answer),
+		   &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 4);
+	assert_a_rrset(&handle, ns_s_an, 0, "pool.cwrap.org");
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 3, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_aaaa);
+
+	/* A CNAME is not followed */
+	fake_query("alias.cwrap.org", ns_t_any, answer, sizeof(answer),
+		   &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_cname);
+
+	/* The records of a wildcard are owned by the query name */
+	fake_query("any.wild.cwrap.org", ns_t_any, answer, sizeof(answer),
+		   &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_a);
+	assert_string_equal(ns_rr_name(rr), "any.wild.cwrap.org");
+}
+
+/* Checks a negative answer, with the SOA of cwrap.org if soa is set */
+static void assert_fake_negative(const char *name, int type, int rcode,
+				 int soa)
+{
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	rv = res_nquery(&dnsstate, name, ns_c_in, type, answer, sizeof(answer));
+	assert_int_equal(rv, -1);
+	assert_int_equal(h_errno,
+			 rcode == ns_r_nxdomain ? HOST_NOT_FOUND : NO_DATA);
+
+	/* The answer is left in the buffer, without its length */
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), rcode);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 0);
+	assert_int_equal(ns_msg_count(handle, ns_s_ns), soa ? 1 : 0);
+
+	if (soa) {
+		assert_int_equal(ns_parserr(&handle, ns_s_ns, 0, &rr), 0);
+		assert_int_equal(ns_rr_type(rr), ns_t_soa);
+		assert_string_equal(ns_rr_name(rr), "cwrap.org");
+		/* The minimum of the SOA record and its TTL */
+		assert_int_equal(ns_rr_ttl(rr), 600);
+	}
+
+	res_nclose(&dnsstate);
+}
+
+static void test_res_fake_negative(void **state)
+{
+	(void) state; /* unused */
+
+	/* NODATA for a name with records of other types */
+	assert_fake_negative("www.cwrap.org", ns_t_aaaa, ns_r_noerror, 1);
+
+	/* NXDOMAIN for a name in the zone which does not exist */
+	assert_fake_negative("nosuchentry.cwrap.org", ns_t_a,
+			     ns_r_nxdomain, 1);
+	assert_fake_negative("a.b.tenant.cwrap.org", ns_t_a,
+			     ns_r_nxdomain, 1);
+
+	/* A parent of an owner exists even though it has no records */
+	assert_fake_negative("_tcp.cwrap.org", ns_t_a, ns_r_noerror, 1);
+
+	/* A target only exists if it has records */
+	assert_fake_negative("ldap.cwrap.org", ns_t_a, ns_r_nxdomain, 1);
+
+	/* So do the names of wildcards and patterns */
+	assert_fake_negative("any.wild.cwrap.org", ns_t_txt,
+			     ns_r_noerror, 1);
+	assert_fake_negative("node-1.rack2.cwrap.org", ns_t_aaaa,
+			     ns_r_noerror, 1);
+
+	/* And the addresses of the reverse index */
+	assert_fake_negative("22.0.0.127.in-addr.arpa", ns_t_txt,
+			     ns_r_noerror, 0);
+	assert_fake_negative("99.0.0.127.in-addr.arpa", ns_t_ptr,
+			     ns_r_nxdomain, 0);
+}
+
 int main(void)
 {
 	int rc;
@@ -567,6 +1248,7 @@ int main(void)
 		cmocka_unit_test(test_res_fake_a_query),
 		cmocka_unit_test(test_res_fake_a_query_case_insensitive),
 		cmocka_unit_test(test_res_fake_a_query_trailing_dot),
+		cmocka_unit_test(test_res_fake_a_query_cached),
 		cmocka_unit_test(test_res_fake_a_query_notfound),
 		cmocka_unit_test(test_res_fake_aaaa_query),
 		cmocka_unit_test(test_res_fake_aaaa_query_notfound),
@@ -575,6 +1257,19 @@ int main(void)
 		cmocka_unit_test(test_res_fake_soa_query),
 		cmocka_unit_test(test_res_fake_cname_query),
 		cmocka_unit_test(test_res_fake_a_via_cname),
+		cmocka_unit_test(test_res_fake_a_via_wildcard),
+		cmocka_unit_test(test_res_fake_wildcard_closest_encloser),
+		cmocka_unit_test(test_res_fake_cname_to_wildcard),
+		cmocka_unit_test(test_res_fake_a_via_pattern),
+		cmocka_unit_test(test_res_fake_cname_via_pattern),
+		cmocka_unit_test(test_res_fake_a_rrset),
+		cmocka_unit_test(test_res_fake_srv_rrset),
+		cmocka_unit_test(test_res_fake_ptr_query),
+		cmocka_unit_test(test_res_fake_txt_query),
+		cmocka_unit_test(test_res_fake_mx_query),
+		cmocka_unit_test(test_res_fake_naptr_uri_caa_query),
+		cmocka_unit_test(test_res_fake_any_query),
+		cmocka_unit_test(test_res_fake_negative),
 	};
 
 	rc = cmocka_run_group_tests(fake_tests, NULL, NULL);
@@ -0,0 +1,599 @@
+/*
+ * Copyright (C) Jakub Hrozek 2014 <jakub.hrozek@posteo.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#ifdef TORTURE_FAIL_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <arpa/inet.h>
+#include <resolv.h>
+#include <netdb.h>
+
+#define ANSIZE 256
+
+#define RWRAP_HOSTS_TMPL "rwrap_fake_hosts_XXXXXX"
+
+#ifdef TORTURE_FAIL_INOTIFY
+/*
+ * Interposes the one of libc for the preloaded wrapper, which then has to
+ * notice changes of the hosts file without a watch.
+ */
+int inotify_init1(int flags)
+{
+	(void)flags; /* unused */
+
+	errno = EMFILE;
+	return -1;
+}
+#endif
+
+struct reload_test_state {
+	char *hosts_path;
+};
+
+static void write_hosts(const char *path, const char *name, const char *addr)
+{
+	FILE *fp;
+	int rc;
+
+	fp = fopen(path, "w");
+	assert_non_null(fp);
+
+	rc = fprintf(fp, "A %s %s\n", name, addr);
+	assert_int_not_equal(rc, -1);
+
+	rc = fclose(fp);
+	assert_int_equal(rc, 0);
+}
+
+static void write_hosts_text(const char *path, const char *text)
+{
+	FILE *fp;
+	int rc;
+
+	fp = fopen(path, "w");
+	assert_non_null(fp);
+
+	rc = fputs(text, fp);
+	assert_int_not_equal(rc, EOF);
+
+	rc = fclose(fp);
+	assert_int_equal(rc, 0);
+}
+
+static int setup(void **state)
+{
+	struct reload_test_state *test_state;
+	int fd;
+	int rc;
+
+	test_state = malloc(sizeof(struct reload_test_state));
+	assert_non_null(test_state);
+
+	test_state->hosts_path = strdup(RWRAP_HOSTS_TMPL);
+	assert_non_null(test_state->hosts_path);
+	fd = mkstemp(test_state->hosts_path);
+	assert_int_not_equal(fd, -1);
+	close(fd);
+
+	write_hosts(test_state->hosts_path, "reload.cwrap.org", "127.0.0.31");
+
+	rc = setenv("RESOLV_WRAPPER_HOSTS", test_state->hosts_path, 1);
+	assert_int_equal(rc, 0);
+	/* Every query checks for changes, as the tests reload right away */
+	rc = setenv("RESOLV_WRAPPER_HOSTS_CHECK_INTERVAL", "0", 1);
+	assert_int_equal(rc, 0);
+	torture_rwrap_refresh_config();
+
+	*state = test_state;
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	struct reload_test_state *test_state;
+
+	test_state = (struct reload_test_state *) *state;
+
+	if (test_state == NULL) return -1;
+
+	unsetenv("RESOLV_WRAPPER_HOSTS");
+	unsetenv("RESOLV_WRAPPER_HOSTS_CHECK_INTERVAL");
+	torture_rwrap_refresh_config();
+	unlink(test_state->hosts_path);
+	free(test_state->hosts_path);
+	free(test_state);
+
+	return 0;
+}
+
+static void assert_fake_a(const char *name, const char *expected)
+{
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	char addr[INET_ADDRSTRLEN];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	rv = res_nquery(&dnsstate, name, ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_in_range(rv, 1, 100);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_getflag(handle, ns_f_rcode), ns_r_noerror);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 1);
+	assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+	assert_int_equal(ns_rr_type(rr), ns_t_a);
+	assert_non_null(inet_ntop(AF_INET, ns_rr_rdata(rr),
+			addr, sizeof(addr)));
+	assert_string_equal(addr, expected);
+
+	res_nclose(&dnsstate);
+}
+
+static void test_res_fake_reload_rewrite(void **state)
+{
+	struct reload_test_state *test_state;
+
+	test_state = (struct reload_test_state *) *state;
+
+	assert_fake_a("reload.cwrap.org", "127.0.0.31");
+
+	/* Rewriting the file in place is picked up by the next query */
+	write_hosts(test_state->hosts_path, "reload.cwrap.org", "127.0.0.132");
+	assert_fake_a("reload.cwrap.org", "127.0.0.132");
+
+	/* Also within the same second and with the same size */
+	write_hosts(test_state->hosts_path, "reload.cwrap.org", "127.0.0.133");
+	assert_fake_a("reload.cwrap.org", "127.0.0.133");
+}
+
+/* Returns 0 if the first answer for name is the address, for a child */
+static int fake_a_is(const char *name, const char *expected)
+{
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	char addr[INET_ADDRSTRLEN];
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	if (res_ninit(&dnsstate) != 0) {
+		return -1;
+	}
+
+	rv = res_nquery(&dnsstate, name, ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	res_nclose(&dnsstate);
+	if (rv <= 0 ||
+	    ns_initparse(answer, rv, &handle) != 0 ||
+	    ns_parserr(&handle, ns_s_an, 0, &rr) != 0 ||
+	    inet_ntop(AF_INET, ns_rr_rdata(rr), addr, sizeof(addr)) == NULL) {
+		return -1;
+	}
+
+	return strcmp(addr, expected) == 0 ? 0 : -1;
+}
+
+static void test_res_fake_reload_fork(void **state)
+{
+	struct reload_test_state *test_state;
+	pid_t pid;
+	int status;
+
+	test_state = (struct reload_test_state *) *state;
+
+	assert_fake_a("reload.cwrap.org", "127.0.0.31");
+
+	/* The change is pending for the watch the child inherits */
+	write_hosts(test_state->hosts_path, "reload.cwrap.org", "127.0.0.135");
+
+	pid = fork();
+	assert_int_not_equal(pid, -1);
+	if (pid == 0) {
+		_exit(fake_a_is("reload.cwrap.org", "127.0.0.135") == 0 ? 0 : 1);
+	}
+
+	assert_int_equal(waitpid(pid, &status, 0), pid);
+	assert_true(WIFEXITED(status));
+	assert_int_equal(WEXITSTATUS(status), 0);
+
+	/* The child must not have taken the event of the parent */
+	assert_fake_a("reload.cwrap.org", "127.0.0.135");
+}
+
+static void test_res_fake_reload_rename(void **state)
+{
+	struct reload_test_state *test_state;
+	char *tmp;
+	int rc;
+
+	test_state = (struct reload_test_state *) *state;
+
+	assert_fake_a("reload.cwrap.org", "127.0.0.31");
+
+	/* Replacing the file atomically is picked up as well */
+	tmp = malloc(strlen(test_state->hosts_path) + sizeof(".new"));
+	assert_non_null(tmp);
+	snprintf(tmp, strlen(test_state->hosts_path) + sizeof(".new"),
+		 "%s.new", test_state->hosts_path);
+
+	write_hosts(tmp, "reload.cwrap.org", "127.0.0.33");
+	rc = rename(tmp, test_state->hosts_path);
+	assert_int_equal(rc, 0);
+	free(tmp);
+
+	assert_fake_a("reload.cwrap.org", "127.0.0.33");
+}
+
+static void test_res_fake_reload_notfound(void **state)
+{
+	struct reload_test_state *test_state;
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	ns_msg handle;
+
+	test_state = (struct reload_test_state *) *state;
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	rv = res_nquery(&dnsstate, "added.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_int_equal(rv, -1);
+	assert_int_equal(h_errno, HOST_NOT_FOUND);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 0);
+
+	res_nclose(&dnsstate);
+
+	/* The cached empty answer must not outlive the reload */
+	write_hosts(test_state->hosts_path, "added.cwrap.org", "127.0.0.34");
+	assert_fake_a("added.cwrap.org", "127.0.0.34");
+}
+
+static void test_res_fake_cname_loop(void **state)
+{
+	struct reload_test_state *test_state;
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	ns_msg handle;
+
+	test_state = (struct reload_test_state *) *state;
+
+	write_hosts_text(test_state->hosts_path,
+			 "CNAME a.loop.cwrap.org b.loop.cwrap.org\n"
+			 "CNAME b.loop.cwrap.org a.loop.cwrap.org\n");
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	/* The loop is cut when the file is loaded, each CNAME comes once */
+	rv = res_nquery(&dnsstate, "a.loop.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_int_equal(rv, -1);
+	assert_int_equal(h_errno, NO_DATA);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 0);
+	assert_int_equal(ns_msg_count(handle, ns_s_ar), 2);
+
+	res_nclose(&dnsstate);
+}
+
+static void test_res_fake_txt_empty(void **state)
+{
+	struct reload_test_state *test_state;
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	ns_msg handle;
+
+	test_state = (struct reload_test_state *) *state;
+
+	/* The value is empty up to the end of the file */
+	write_hosts_text(test_state->hosts_path,
+			 "A txt.cwrap.org 127.0.0.36\n"
+			 "TXT txt.cwrap.org ");
+
+	assert_fake_a("txt.cwrap.org", "127.0.0.36");
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	/* The malformed record is skipped */
+	rv = res_nquery(&dnsstate, "txt.cwrap.org", ns_c_in, ns_t_txt,
+			answer, sizeof(answer));
+	assert_int_equal(rv, -1);
+	assert_int_equal(h_errno, NO_DATA);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 0);
+
+	res_nclose(&dnsstate);
+}
+
+static void test_res_fake_chain_length(void **state)
+{
+	struct reload_test_state *test_state;
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	ns_msg handle;
+
+	test_state = (struct reload_test_state *) *state;
+
+	write_hosts_text(test_state->hosts_path,
+			 "CNAME c1.cwrap.org c2.cwrap.org\n"
+			 "CNAME c2.cwrap.org c3.cwrap.org\n"
+			 "CNAME c3.cwrap.org c4.cwrap.org\n"
+			 "CNAME c4.cwrap.org c5.cwrap.org\n"
+			 "CNAME c5.cwrap.org c6.cwrap.org\n"
+			 "A c6.cwrap.org 127.0.0.35\n");
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	/* Six records are one more than allowed by default */
+	rv = res_nquery(&dnsstate, "c1.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_int_equal(rv, -1);
+
+	rv = setenv("RESOLV_WRAPPER_MAX_CHAIN_LENGTH", "6", 1);
+	assert_int_equal(rv, 0);
+	torture_rwrap_refresh_config();
+
+	rv = res_nquery(&dnsstate, "c1.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_in_range(rv, 1, ANSIZE);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 6);
+
+	unsetenv("RESOLV_WRAPPER_MAX_CHAIN_LENGTH");
+	torture_rwrap_refresh_config();
+
+	res_nclose(&dnsstate);
+}
+
+static void test_res_fake_chain_length_glue(void **state)
+{
+	struct reload_test_state *test_state;
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+
+	test_state = (struct reload_test_state *) *state;
+
+	/* Only the target of the second SRV record has a long chain */
+	write_hosts_text(test_state->hosts_path,
+			 "SRV _ldap._tcp.cwrap.org s1.cwrap.org 389\n"
+			 "SRV _ldap._tcp.cwrap.org c1.cwrap.org 389\n"
+			 "A s1.cwrap.org 127.0.0.34\n"
+			 "CNAME c1.cwrap.org c2.cwrap.org\n"
+			 "CNAME c2.cwrap.org c3.cwrap.org\n"
+			 "CNAME c3.cwrap.org c4.cwrap.org\n"
+			 "CNAME c4.cwrap.org c5.cwrap.org\n"
+			 "A c5.cwrap.org 127.0.0.35\n");
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	/* With the SRV record the chain of c1 has six records */
+	rv = res_nquery(&dnsstate, "_ldap._tcp.cwrap.org", ns_c_in, ns_t_srv,
+			answer, sizeof(answer));
+	assert_int_equal(rv, -1);
+
+	rv = setenv("RESOLV_WRAPPER_MAX_CHAIN_LENGTH", "6", 1);
+	assert_int_equal(rv, 0);
+	torture_rwrap_refresh_config();
+
+	rv = res_nquery(&dnsstate, "_ldap._tcp.cwrap.org", ns_c_in, ns_t_srv,
+			answer, sizeof(answer));
+	assert_in_range(rv, 1, ANSIZE);
+
+	unsetenv("RESOLV_WRAPPER_MAX_CHAIN_LENGTH");
+	torture_rwrap_refresh_config();
+
+	res_nclose(&dnsstate);
+}
+
+#define BIG_HOSTS_LINES 100000
+
+static void test_res_fake_parallel_load(void **state)
+{
+	struct reload_test_state *test_state;
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	ns_msg handle;
+	FILE *fp;
+	int i;
+
+	test_state = (struct reload_test_state *) *state;
+
+	rv = setenv("RESOLV_WRAPPER_HOSTS_LOAD_THREADS", "4", 1);
+	assert_int_equal(rv, 0);
+	torture_rwrap_refresh_config();
+
+	/* Almost 4 MiB, which is split into three chunks */
+	fp = fopen(test_state->hosts_path, "w");
+	assert_non_null(fp);
+
+	rv = fprintf(fp, "CNAME first.big.cwrap.org host%d.big.cwrap.org\n",
+		     BIG_HOSTS_LINES - 1);
+	assert_int_not_equal(rv, -1);
+	for (i = 0; i < BIG_HOSTS_LINES; i++) {
+		rv = fprintf(fp, "A host%d.big.cwrap.org 127.%d.%d.%d\n",
+			     i, i >> 16, (i >> 8) & 0xff, i & 0xff);
+		assert_int_not_equal(rv, -1);
+	}
+	rv = fclose(fp);
+	assert_int_equal(rv, 0);
+
+	assert_fake_a("host0.big.cwrap.org", "127.0.0.0");
+	assert_fake_a("host50000.big.cwrap.org", "127.0.195.80");
+	assert_fake_a("host99999.big.cwrap.org", "127.1.134.159");
+
+	/* The target is parsed by another thread than the CNAME */
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	rv = res_nquery(&dnsstate, "first.big.cwrap.org", ns_c_in, ns_t_a,
+			answer, sizeof(answer));
+	assert_in_range(rv, 1, ANSIZE);
+
+	ns_initparse(answer, sizeof(answer), &handle);
+	assert_int_equal(ns_msg_count(handle, ns_s_an), 2);
+
+	res_nclose(&dnsstate);
+
+	unsetenv("RESOLV_WRAPPER_HOSTS_LOAD_THREADS");
+	torture_rwrap_refresh_config();
+}
+
+static void test_res_fake_rrset_cyclic(void **state)
+{
+	struct reload_test_state *test_state;
+	int rv;
+	struct __res_state dnsstate;
+	unsigned char answer[ANSIZE];
+	char addr[INET_ADDRSTRLEN];
+	char seen[3] = { 0 };
+	ns_msg handle;
+	ns_rr rr;   /* expanded resource record */
+	int i;
+
+	test_state = (struct reload_test_state *) *state;
+
+	write_hosts_text(test_state->hosts_path,
+			 "A rr.cwrap.org 127.0.0.41\n"
+			 "A rr.cwrap.org 127.0.0.42\n"
+			 "A rr.cwrap.org 127.0.0.43\n");
+
+	rv = setenv("RESOLV_WRAPPER_RRSET_ORDER", "cyclic", 1);
+	assert_int_equal(rv, 0);
+	torture_rwrap_refresh_config();
+
+	memset(&dnsstate, 0, sizeof(struct __res_state));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	/* Every record is first once in three answers */
+	for (i = 0; i < 3; i++) {
+		rv = res_nquery(&dnsstate, "rr.cwrap.org", ns_c_in, ns_t_a,
+				answer, sizeof(answer));
+		assert_in_range(rv, 1, ANSIZE);
+
+		ns_initparse(answer, sizeof(answer), &handle);
+		assert_int_equal(ns_msg_count(handle, ns_s_an), 3);
+		assert_int_equal(ns_parserr(&handle, ns_s_an, 0, &rr), 0);
+		assert_non_null(inet_ntop(AF_INET, ns_rr_rdata(rr),
+				addr, sizeof(addr)));
+		assert_in_range(addr[strlen(addr) - 1], '1', '3');
+		seen[addr[strlen(addr) - 1] - '1'] = 1;
+	}
+	assert_int_equal(seen[0] + seen[1] + seen[2], 3);
+
+	res_nclose(&dnsstate);
+
+	unsetenv("RESOLV_WRAPPER_RRSET_ORDER");
+	torture_rwrap_refresh_config();
+}
+
+int main(void)
+{
+	int rc;
+
+	const struct CMUnitTest reload_tests[] = {
+		cmocka_unit_test_setup_teardown(test_res_fake_reload_rewrite,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_res_fake_reload_rename,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_res_fake_reload_fork,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_res_fake_reload_notfound,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_res_fake_cname_loop,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_res_fake_txt_empty,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_res_fake_chain_length,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_res_fake_chain_length_glue,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_res_fake_parallel_load,
+						setup, teardown),
+		cmocka_unit_test_setup_teardown(test_res_fake_rrset_cyclic,
+						setup, teardown),
+	};
+
+	rc = cmocka_run_group_tests(reload_tests, NULL, NULL);
+
+	return rc;
+}
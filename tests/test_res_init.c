@@ -5,10 +5,13 @@
 #include <setjmp.h>
 #include <cmocka.h>
 
+#include "torture.h"
+
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <signal.h>
 
 #include <netinet/in.h>
 #include <arpa/nameser.h>
@@ -113,10 +116,12 @@ static void test_res_ninit(void **state)
 
 	rv = setenv("RESOLV_WRAPPER_CONF", test_state->resolv_conf_path, 1);
 	assert_int_equal(rv, 0);
+	torture_rwrap_refresh_config();
 
 	memset(&dnsstate, 0, sizeof(dnsstate));
 	rv = res_ninit(&dnsstate);
 	unsetenv("RESOLV_WRAPPER_CONF");
+	torture_rwrap_refresh_config();
 	assert_int_equal(rv, 0);
 
 	/*
@@ -179,6 +184,64 @@ static void test_res_ninit(void **state)
 	res_nclose(&dnsstate);
 }
 
+static void assert_first_nameserver(const char *expected)
+{
+	struct __res_state dnsstate;
+	char straddr[INET6_ADDRSTRLEN] = { '\0' };
+	int rv;
+
+	memset(&dnsstate, 0, sizeof(dnsstate));
+	rv = res_ninit(&dnsstate);
+	assert_int_equal(rv, 0);
+
+	assert_int_equal(dnsstate.nscount, 1);
+	assert_int_equal(dnsstate.nsaddr_list[0].sin_family, AF_INET);
+	inet_ntop(AF_INET, &(dnsstate.nsaddr_list[0].sin_addr),
+		  straddr, INET6_ADDRSTRLEN);
+	assert_string_equal(expected, straddr);
+
+	res_nclose(&dnsstate);
+}
+
+static void test_res_ninit_changed(void **state)
+{
+	struct resolv_conf_test_state *test_state;
+	FILE *fp;
+	int rv;
+
+	test_state = (struct resolv_conf_test_state *) *state;
+
+	fputs("nameserver 127.0.0.1\n", test_state->resolv_conf);
+	fflush(test_state->resolv_conf);
+
+	rv = setenv("RESOLV_WRAPPER_CONF", test_state->resolv_conf_path, 1);
+	assert_int_equal(rv, 0);
+	torture_rwrap_refresh_config();
+
+	/* The second time the parsed nameservers are reused */
+	assert_first_nameserver("127.0.0.1");
+	assert_first_nameserver("127.0.0.1");
+
+	/* A changed file is parsed again */
+	fp = fopen(test_state->resolv_conf_path, "w");
+	assert_non_null(fp);
+	fputs("nameserver 10.10.10.10\n", fp);
+	fclose(fp);
+
+	assert_first_nameserver("10.10.10.10");
+
+	/* Also within the same second and with the same size */
+	fp = fopen(test_state->resolv_conf_path, "w");
+	assert_non_null(fp);
+	fputs("nameserver 10.10.10.12\n", fp);
+	fclose(fp);
+
+	assert_first_nameserver("10.10.10.12");
+
+	unsetenv("RESOLV_WRAPPER_CONF");
+	torture_rwrap_refresh_config();
+}
+
 static void test_res_ninit_enoent(void **state)
 {
 	int rv;
@@ -188,20 +251,73 @@ static void test_res_ninit_enoent(void **state)
 
 	rv = setenv("RESOLV_WRAPPER_CONF", "/no/such/file", 1);
 	assert_int_equal(rv, 0);
+	torture_rwrap_refresh_config();
 
 	/* Just make sure we don't crash, error is fine */
 	memset(&dnsstate, 0, sizeof(dnsstate));
 	rv = res_ninit(&dnsstate);
 	unsetenv("RESOLV_WRAPPER_CONF");
+	torture_rwrap_refresh_config();
 	assert_int_equal(rv, -1);
 }
 
+static volatile sig_atomic_t app_signals;
+
+static void app_signal_handler(int signum)
+{
+	(void) signum; /* unused */
+
+	app_signals++;
+}
+
+static void test_res_ninit_signal(void **state)
+{
+	struct resolv_conf_test_state *test_state;
+	struct sigaction sa;
+	char signum[16];
+	int rv;
+
+	test_state = (struct resolv_conf_test_state *) *state;
+
+	/* The handler of the application is still called */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = app_signal_handler;
+	sigemptyset(&sa.sa_mask);
+	rv = sigaction(SIGUSR1, &sa, NULL);
+	assert_int_equal(rv, 0);
+
+	fputs("nameserver 10.10.10.11\n", test_state->resolv_conf);
+	fflush(test_state->resolv_conf);
+
+	snprintf(signum, sizeof(signum), "%d", SIGUSR1);
+	rv = setenv("RESOLV_WRAPPER_CONFIG_SIGNAL", signum, 1);
+	assert_int_equal(rv, 0);
+	torture_rwrap_refresh_config();
+
+	/* The signal makes the next call read the environment again */
+	rv = setenv("RESOLV_WRAPPER_CONF", test_state->resolv_conf_path, 1);
+	assert_int_equal(rv, 0);
+	rv = raise(SIGUSR1);
+	assert_int_equal(rv, 0);
+	assert_int_equal(app_signals, 1);
+
+	assert_first_nameserver("10.10.10.11");
+
+	unsetenv("RESOLV_WRAPPER_CONF");
+	unsetenv("RESOLV_WRAPPER_CONFIG_SIGNAL");
+	torture_rwrap_refresh_config();
+}
+
 int main(void) {
 	int rc;
 
 	const struct CMUnitTest init_tests[] = {
 		cmocka_unit_test_setup_teardown(test_res_ninit, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_res_ninit_changed,
+						setup, teardown),
 		cmocka_unit_test(test_res_ninit_enoent),
+		cmocka_unit_test_setup_teardown(test_res_ninit_signal,
+						setup, teardown),
 	};
 
 	rc = cmocka_run_group_tests(init_tests, NULL, NULL);
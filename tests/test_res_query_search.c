@@ -55,6 +55,7 @@ static int setup_dns_srv_ipv4(void **state)
 {
 	torture_setup_dns_srv_ipv4(state);
 	setenv("RESOLV_WRAPPER_CONF", torture_server_resolv_conf(state), 1);
+	torture_rwrap_refresh_config();
 
 	return 0;
 }
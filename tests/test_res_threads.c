@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) Jakub Hrozek 2014 <jakub.hrozek@posteo.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <arpa/inet.h>
+#include <resolv.h>
+
+#define ANSIZE 256
+
+#define NUM_THREADS 4
+#define NUM_QUERIES 20000
+
+#define RWRAP_RESOLV_CONF_TMPL "rwrap_resolv_conf_XXXXXX"
+
+struct fake_name {
+	const char *name;
+	const char *addr;
+};
+
+static const struct fake_name fake_names[] = {
+	{ "cwrap.org", "127.0.0.21" },
+	{ "www.cwrap.org", "127.0.0.22" },
+	{ "krb5.cwrap.org", "127.0.0.23" },
+	{ "rwrap.org", "127.0.0.22" },
+};
+
+#define NUM_NAMES (sizeof(fake_names) / sizeof(fake_names[0]))
+
+struct query_thread {
+	pthread_t tid;
+	int offset;
+	int nqueries;
+	const char *nameserver; /* of _res once the file was written last */
+	int errors;
+};
+
+static pthread_mutex_t conf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conf_cond = PTHREAD_COND_INITIALIZER;
+static bool conf_written;
+
+/* cmocka is not thread safe, the threads only count the errors */
+static int check_answer(const unsigned char *answer, int len,
+			const char *expected)
+{
+	char addr[INET_ADDRSTRLEN];
+	ns_msg handle;
+	ns_rr rr;
+	int i;
+
+	if (len <= 0 || ns_initparse(answer, len, &handle) != 0) {
+		return -1;
+	}
+
+	/* A name behind a CNAME has the A record last */
+	for (i = 0; i < ns_msg_count(handle, ns_s_an); i++) {
+		if (ns_parserr(&handle, ns_s_an, i, &rr) != 0) {
+			return -1;
+		}
+	}
+	if (i == 0 || ns_rr_type(rr) != ns_t_a) {
+		return -1;
+	}
+
+	if (inet_ntop(AF_INET, ns_rr_rdata(rr), addr, sizeof(addr)) == NULL ||
+	    strcmp(addr, expected) != 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Waits for the file to be written last and checks the state of the thread */
+static int check_nameserver(const char *expected)
+{
+	unsigned char answer[ANSIZE];
+	char addr[INET_ADDRSTRLEN];
+	int rv;
+
+	pthread_mutex_lock(&conf_lock);
+	while (!conf_written) {
+		pthread_cond_wait(&conf_cond, &conf_lock);
+	}
+	pthread_mutex_unlock(&conf_lock);
+
+	/* The query notices the change and initializes the state again */
+	rv = res_query(fake_names[0].name, ns_c_in, ns_t_a,
+		       answer, sizeof(answer));
+	if (check_answer(answer, rv, fake_names[0].addr) != 0) {
+		return -1;
+	}
+
+	if (_res.nscount != 1 ||
+	    inet_ntop(AF_INET, &_res.nsaddr_list[0].sin_addr,
+		      addr, sizeof(addr)) == NULL ||
+	    strcmp(addr, expected) != 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *query_thread_main(void *arg)
+{
+	struct query_thread *qt = (struct query_thread *)arg;
+	unsigned char answer[ANSIZE];
+	int rv;
+	int i;
+
+	for (i = 0; i < qt->nqueries; i++) {
+		const struct fake_name *fn;
+
+		fn = &fake_names[(qt->offset + i) % NUM_NAMES];
+
+		rv = res_query(fn->name, ns_c_in, ns_t_a,
+			       answer, sizeof(answer));
+		if (check_answer(answer, rv, fn->addr) != 0) {
+			qt->errors++;
+		}
+	}
+
+	if (qt->nameserver != NULL && check_nameserver(qt->nameserver) != 0) {
+		qt->errors++;
+	}
+
+	/* The state of this thread is closed when it exits */
+	return NULL;
+}
+
+static void start_query_threads(struct query_thread *qt,
+				int nthreads,
+				int nqueries,
+				const char *nameserver)
+{
+	int rc;
+	int i;
+
+	assert_in_range(nthreads, 1, NUM_THREADS);
+
+	for (i = 0; i < nthreads; i++) {
+		qt[i].offset = i;
+		qt[i].nqueries = nqueries;
+		qt[i].nameserver = nameserver;
+		qt[i].errors = 0;
+
+		rc = pthread_create(&qt[i].tid, NULL, query_thread_main, &qt[i]);
+		assert_int_equal(rc, 0);
+	}
+}
+
+static void join_query_threads(struct query_thread *qt, int nthreads)
+{
+	int rc;
+	int i;
+
+	for (i = 0; i < nthreads; i++) {
+		rc = pthread_join(qt[i].tid, NULL);
+		assert_int_equal(rc, 0);
+		assert_int_equal(qt[i].errors, 0);
+	}
+}
+
+/* Runs the queries in nthreads threads and returns the wall clock time */
+static double run_query_threads(int nthreads, int nqueries)
+{
+	struct query_thread qt[NUM_THREADS];
+	struct timespec start;
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	start_query_threads(qt, nthreads, nqueries, NULL);
+	join_query_threads(qt, nthreads);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) +
+	       (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void test_res_query_threads(void **state)
+{
+	(void) state; /* unused */
+
+	run_query_threads(NUM_THREADS, NUM_QUERIES / NUM_THREADS);
+}
+
+static void write_resolv_conf(const char *path, const char *nameserver)
+{
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	assert_non_null(fp);
+	fprintf(fp, "nameserver %s\n", nameserver);
+	fclose(fp);
+}
+
+/*
+ * The states of the threads check RESOLV_WRAPPER_CONF as well, rewriting
+ * it makes them initialize their states again while they query. At the end
+ * every thread has to have the nameserver written last.
+ */
+static void test_res_query_threads_conf(void **state)
+{
+	struct query_thread qt[NUM_THREADS];
+	char path[] = RWRAP_RESOLV_CONF_TMPL;
+	const char *last = NULL;
+	int fd;
+	int rv;
+	int i;
+
+	(void) state; /* unused */
+
+	fd = mkstemp(path);
+	assert_int_not_equal(fd, -1);
+	close(fd);
+	write_resolv_conf(path, "127.0.0.1");
+
+	rv = setenv("RESOLV_WRAPPER_CONF", path, 1);
+	assert_int_equal(rv, 0);
+	rv = setenv("RESOLV_WRAPPER_HOSTS_CHECK_INTERVAL", "0", 1);
+	assert_int_equal(rv, 0);
+	torture_rwrap_refresh_config();
+
+#ifdef HAVE___RES_STATE
+	/* Only then _res is the state of the thread */
+	last = "127.0.0.3";
+#endif
+
+	start_query_threads(qt, NUM_THREADS, NUM_QUERIES / NUM_THREADS, last);
+	for (i = 0; i < 100; i++) {
+		write_resolv_conf(path, i % 2 == 0 ? "127.0.0.2" : "10.0.0.1");
+	}
+	write_resolv_conf(path, "127.0.0.3");
+
+	pthread_mutex_lock(&conf_lock);
+	conf_written = true;
+	pthread_cond_broadcast(&conf_cond);
+	pthread_mutex_unlock(&conf_lock);
+
+	join_query_threads(qt, NUM_THREADS);
+
+	unsetenv("RESOLV_WRAPPER_CONF");
+	unsetenv("RESOLV_WRAPPER_HOSTS_CHECK_INTERVAL");
+	torture_rwrap_refresh_config();
+	unlink(path);
+}
+
+/* Replaced snapshots of the configuration are freed while the threads query */
+static void test_res_query_threads_refresh(void **state)
+{
+	struct query_thread qt[NUM_THREADS];
+	int i;
+
+	(void) state; /* unused */
+
+	start_query_threads(qt, NUM_THREADS, NUM_QUERIES / NUM_THREADS, NULL);
+	for (i = 0; i < 1000; i++) {
+		torture_rwrap_refresh_config();
+	}
+	join_query_threads(qt, NUM_THREADS);
+}
+
+static void test_res_query_threads_scaling(void **state)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double single;
+	double multi;
+
+	(void) state; /* unused */
+
+	/* Wall clock times are unreliable on a loaded machine, so opt in */
+	if (getenv("TORTURE_MEASURE_SCALING") == NULL) {
+		return;
+	}
+
+	if (ncpus < NUM_THREADS) {
+		/* Nothing to measure on this machine */
+		return;
+	}
+
+	/* Warm up the fake hosts database and the answer cache */
+	run_query_threads(1, NUM_QUERIES / 10);
+
+	single = run_query_threads(1, NUM_QUERIES);
+	multi = run_query_threads(NUM_THREADS, NUM_QUERIES);
+
+	/*
+	 * Every thread did as much work as the single one. Without
+	 * contention this takes the same time, allow for a busy machine.
+	 */
+	assert_true(multi < single * NUM_THREADS / 2);
+}
+
+int main(void)
+{
+	int rc;
+
+	const struct CMUnitTest thread_tests[] = {
+		cmocka_unit_test(test_res_query_threads),
+		cmocka_unit_test(test_res_query_threads_conf),
+		cmocka_unit_test(test_res_query_threads_refresh),
+		cmocka_unit_test(test_res_query_threads_scaling),
+	};
+
+	rc = cmocka_run_group_tests(thread_tests, NULL, NULL);
+
+	return rc;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) Jakub Hrozek 2014 <jakub.hrozek@posteo.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "config.h"
+#include "torture.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <arpa/inet.h>
+#include <resolv.h>
+
+#define ANSIZE 256
+
+#define RWRAP_TRACE_TMPL "rwrap_trace_XXXXXX"
+
+struct trace_test_state {
+	char *trace_path;
+};
+
+static int setup(void **state)
+{
+	struct trace_test_state *test_state;
+	int fd;
+	int rc;
+
+	test_state = malloc(sizeof(struct trace_test_state));
+	assert_non_null(test_state);
+
+	test_state->trace_path = strdup(RWRAP_TRACE_TMPL);
+	assert_non_null(test_state->trace_path);
+	fd = mkstemp(test_state->trace_path);
+	assert_int_not_equal(fd, -1);
+	close(fd);
+
+	rc = setenv("RESOLV_WRAPPER_TRACE_FILE", test_state->trace_path, 1);
+	assert_int_equal(rc, 0);
+	torture_rwrap_refresh_config();
+
+	*state = test_state;
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	struct trace_test_state *test_state;
+
+	test_state = (struct trace_test_state *) *state;
+
+	if (test_state == NULL) return -1;
+
+	unsetenv("RESOLV_WRAPPER_TRACE_FILE");
+	torture_rwrap_refresh_config();
+
+	unlink(test_state->trace_path);
+	free(test_state->trace_path);
+	free(test_state);
+
+	return 0;
+}
+
+static void *query_thread_main(void *arg)
+{
+	unsigned char answer[ANSIZE];
+	int *rv = (int *)arg;
+
+	rv[0] = res_query("cwrap.org", ns_c_in, ns_t_a,
+			  answer, sizeof(answer));
+	rv[1] = res_query("cwrap.org", ns_c_in, ns_t_a,
+			  answer, sizeof(answer));
+
+	/* The ring of the thread is written when it exits */
+	return NULL;
+}
+
+static void test_res_trace_thread(void **state)
+{
+	struct trace_test_state *test_state;
+	int (*trace_decode)(const char *tracefile, FILE *out);
+	pthread_t tid;
+	int rv[2];
+	char line[256];
+	bool query = false;
+	bool cached = false;
+	FILE *out;
+	int rc;
+
+	test_state = (struct trace_test_state *) *state;
+
+	rc = pthread_create(&tid, NULL, query_thread_main, rv);
+	assert_int_equal(rc, 0);
+	rc = pthread_join(tid, NULL);
+	assert_int_equal(rc, 0);
+	assert_in_range(rv[0], 1, 100);
+	assert_int_equal(rv[1], rv[0]);
+
+	*(void **)(&trace_decode) = dlsym(RTLD_DEFAULT, "rwrap_trace_decode");
+	assert_true(trace_decode != NULL);
+
+	out = tmpfile();
+	assert_non_null(out);
+
+	rc = trace_decode(test_state->trace_path, out);
+	assert_int_equal(rc, 0);
+
+	rewind(out);
+	while (fgets(line, sizeof(line), out) != NULL) {
+		if (strstr(line, " query type=1 class=1 search=0") != NULL) {
+			query = true;
+		}
+		if (strstr(line, " fake_cached type=1") != NULL) {
+			cached = true;
+		}
+	}
+	fclose(out);
+
+	assert_true(query);
+	assert_true(cached);
+}
+
+int main(void)
+{
+	int rc;
+
+	const struct CMUnitTest trace_tests[] = {
+		cmocka_unit_test_setup_teardown(test_res_trace_thread,
+						setup, teardown),
+	};
+
+	rc = cmocka_run_group_tests(trace_tests, NULL, NULL);
+
+	return rc;
+}
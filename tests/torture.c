@@ -49,6 +49,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdbool.h>
+#include <dlfcn.h>
 
 #define TORTURE_DNS_SRV_IPV4 "127.0.0.10"
 /* socket wrapper IPv6 prefix  fd00::5357:5fxx */
@@ -337,3 +338,15 @@ void torture_generate_random_buffer(uint8_t *out, int len)
 		out[i] = (uint8_t)rand();
 	}
 }
+
+/* Makes the preloaded resolv_wrapper read the changed environment */
+void torture_rwrap_refresh_config(void)
+{
+	void (*refresh_config)(void);
+
+	*(void **)(&refresh_config) = dlsym(RTLD_DEFAULT,
+					    "resolv_wrapper_refresh_config");
+	assert_true(refresh_config != NULL);
+
+	refresh_config();
+}
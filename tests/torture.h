@@ -84,5 +84,7 @@ void torture_teardown_socket_dir(void **state);
 void torture_teardown_dns_srv(void **state);
 
 void torture_generate_random_buffer(uint8_t *out, int len);
+
+void torture_rwrap_refresh_config(void);
 #endif /* _TORTURE_H */
 